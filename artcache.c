@@ -0,0 +1,271 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "artcache.h"
+#include "idtable.h"
+
+// Must be a power of two.
+#define ARTCACHE_SHARDS 16
+
+typedef struct artentry {
+    uint64_t    key;
+    article_t   article;
+    size_t      size;       // What this entry counts against the limit.
+    GList       link;       // In the shard's lru list, newest first.
+} artentry_t;
+
+typedef struct artshard {
+    pthread_mutex_t lock;
+    idtable_t      *entries;    // Key => artentry_t
+    GQueue          lru;
+    size_t          size;
+    uint64_t        generation; // Advanced by every forget, see artcache_store().
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+} artshard_t;
+
+struct artcache {
+    size_t      limit;      // Of each shard.
+    artshard_t  shards[ARTCACHE_SHARDS];
+};
+
+static artshard_t * artcache_shard(artcache_t *cache, uint64_t key)
+{
+    // Use the top bits of a multiplicative hash, the low bits of
+    // sequential ids would put a thread's comments in the same few shards.
+    return &cache->shards[(key * 0x9e3779b97f4a7c15ULL) >> 60 & (ARTCACHE_SHARDS - 1)];
+}
+
+static void artcache_entry_free(artentry_t *entry)
+{
+    artcache_release(&entry->article);
+    g_free(entry);
+}
+
+artcache_t * artcache_new(size_t limit)
+{
+    artcache_t *cache = g_new0(artcache_t, 1);
+
+    cache->limit = limit / ARTCACHE_SHARDS;
+
+    for (int i = 0; i < ARTCACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
+        cache->shards[i].entries = idtable_new((GDestroyNotify) artcache_entry_free);
+        g_queue_init(&cache->shards[i].lru);
+    }
+
+    return cache;
+}
+
+void artcache_free(artcache_t *cache)
+{
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < ARTCACHE_SHARDS; i++) {
+        idtable_free(cache->shards[i].entries);
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+
+    g_free(cache);
+}
+
+// Append text to blob a line at a time, with CRLF line endings and any line
+// starting with a dot escaped, see RFC3977 3.1.1. If text ends without a
+// newline, the last line is still terminated. If terminate is set, so is the
+// empty line after a final newline.
+static void artcache_stuff(GString *blob, const char *text, bool terminate)
+{
+    while (*text || terminate) {
+        const char *end = strchr(text, '\n');
+        size_t len = end ? end - text : strlen(text);
+
+        if (len && text[len - 1] == '\r')
+            len--;
+
+        if (*text == '.')
+            g_string_append_c(blob, '.');
+
+        g_string_append_len(blob, text, len);
+        g_string_append_len(blob, "\r\n", 2);
+
+        if (end == NULL)
+            break;
+
+        text = end + 1;
+    }
+}
+
+// Turn the headers and body of a generated article into one that can go
+// straight to a client. The caller should release it when finished with it.
+void artcache_render(const char *headers, const char *body, article_t *article)
+{
+    GString *blob = g_string_sized_new(strlen(headers) + strlen(body) + 64);
+
+    artcache_stuff(blob, headers, false);
+
+    article->headers = blob->len;
+
+    g_string_append_len(blob, "\r\n", 2);
+
+    article->body = blob->len;
+
+    artcache_stuff(blob, body, true);
+
+    article->blob = g_string_free_to_bytes(blob);
+}
+
+void artcache_release(article_t *article)
+{
+    g_bytes_unref(article->blob);
+    article->blob = NULL;
+}
+
+// If key is cached, take a reference to it for the caller. If it isn't, the
+// generation to pass to artcache_store() is saved, unless it's NULL.
+bool artcache_lookup(artcache_t *cache, uint64_t key, article_t *article, uint64_t *generation)
+{
+    artshard_t *shard;
+    artentry_t *entry;
+
+    if (cache == NULL)
+        return false;
+
+    shard = artcache_shard(cache, key);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if ((entry = idtable_lookup(shard->entries, key)) == NULL) {
+        shard->misses++;
+
+        if (generation)
+            *generation = shard->generation;
+
+        pthread_mutex_unlock(&shard->lock);
+        return false;
+    }
+
+    // Move it to the front.
+    g_queue_unlink(&shard->lru, &entry->link);
+    g_queue_push_head_link(&shard->lru, &entry->link);
+
+    *article = entry->article;
+    article->blob = g_bytes_ref(entry->article.blob);
+
+    shard->hits++;
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+static void artcache_remove(artshard_t *shard, artentry_t *entry)
+{
+    g_queue_unlink(&shard->lru, &entry->link);
+    shard->size -= entry->size;
+    idtable_remove(shard->entries, entry->key);
+}
+
+// Keep a reference to article as key, making room for it if necessary. The
+// generation is from the lookup that missed before it was rendered. If key
+// might have been forgotten since then, the article could be stale, so it
+// isn't kept.
+void artcache_store(artcache_t *cache, uint64_t key, const article_t *article, uint64_t generation)
+{
+    artshard_t *shard;
+    artentry_t *entry;
+    artentry_t *old;
+
+    if (cache == NULL)
+        return;
+
+    entry            = g_new0(artentry_t, 1);
+    entry->key       = key;
+    entry->article   = *article;
+    entry->size      = g_bytes_get_size(article->blob) + sizeof(*entry);
+    entry->link.data = entry;
+
+    // Not worth throwing everything else out for.
+    if (entry->size > cache->limit / 4) {
+        g_free(entry);
+        return;
+    }
+
+    entry->article.blob = g_bytes_ref(article->blob);
+
+    shard = artcache_shard(cache, key);
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Generations are per shard, not per key, so this is sometimes wrong
+    // the safe way.
+    if (shard->generation != generation) {
+        pthread_mutex_unlock(&shard->lock);
+        artcache_entry_free(entry);
+        return;
+    }
+
+    // Someone might have got here first.
+    if ((old = idtable_lookup(shard->entries, key)))
+        artcache_remove(shard, old);
+
+    while (shard->size + entry->size > cache->limit) {
+        old = g_queue_peek_tail_link(&shard->lru)->data;
+        artcache_remove(shard, old);
+        shard->evictions++;
+    }
+
+    idtable_insert(shard->entries, key, entry);
+    g_queue_push_head_link(&shard->lru, &entry->link);
+    shard->size += entry->size;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// The object key was generated from has changed, so drop the article.
+void artcache_forget(artcache_t *cache, uint64_t key)
+{
+    artshard_t *shard;
+    artentry_t *entry;
+
+    if (cache == NULL)
+        return;
+
+    shard = artcache_shard(cache, key);
+
+    pthread_mutex_lock(&shard->lock);
+
+    // Even if it isn't cached, it might be being rendered.
+    shard->generation++;
+
+    if ((entry = idtable_lookup(shard->entries, key)))
+        artcache_remove(shard, entry);
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void artcache_stats(artcache_t *cache, artcachestats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    if (cache == NULL)
+        return;
+
+    for (int i = 0; i < ARTCACHE_SHARDS; i++) {
+        artshard_t *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->lock);
+        stats->hits      += shard->hits;
+        stats->misses    += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->articles  += idtable_size(shard->entries);
+        stats->bytes     += shard->size;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef __ARTCACHE_H
+#define __ARTCACHE_H
+
+// The article cache keeps recently requested articles exactly as they're
+// sent to clients, so a HEAD followed by a BODY (or another client reading
+// the same thread) doesn't have to generate the article again. It's split
+// into shards with their own lock and least recently used list, and holds no
+// more than the limit it was created with.
+
+typedef struct artcache artcache_t;
+
+// A rendered article is the headers, a blank line, then the body, with CRLF
+// line endings and dot-stuffing already done, but no terminating dot. The
+// blob is immutable and refcounted, so it can be queued for writing as is.
+typedef struct article {
+    GBytes     *blob;
+    size_t      headers;    // Length of the headers.
+    size_t      body;       // Offset of the body.
+} article_t;
+
+typedef struct artcachestats {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    evictions;  // Articles dropped to make room.
+    uint64_t    articles;   // Articles cached now.
+    uint64_t    bytes;      // Size of those articles.
+} artcachestats_t;
+
+artcache_t *
+artcache_new(size_t limit);
+
+void
+artcache_free(artcache_t *cache);
+
+void
+artcache_render(const char *headers, const char *body, article_t *article);
+
+void
+artcache_release(article_t *article);
+
+bool
+artcache_lookup(artcache_t *cache, uint64_t key, article_t *article, uint64_t *generation);
+
+void
+artcache_store(artcache_t *cache, uint64_t key, const article_t *article, uint64_t generation);
+
+void
+artcache_forget(artcache_t *cache, uint64_t key);
+
+void
+artcache_stats(artcache_t *cache, artcachestats_t *stats);
+
+#endif
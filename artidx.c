@@ -0,0 +1,395 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "artlog.h"
+#include "artidx.h"
+
+#define ARTIDX_MAGIC 0x58444941  // "AIDX"
+#define ARTIDX_VERSION 1
+
+// Number of buckets in a new index, must be a power of two.
+#define ARTIDX_INITIAL_BUCKETS 4096
+
+// The buckets start on the first page after the header.
+#define ARTIDX_BUCKET_OFFSET 8192
+
+struct artidx_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    nbuckets;
+    uint32_t    count;          // Live entries.
+    uint32_t    used;           // Live and deleted entries.
+    uint32_t    segment;        // The segment being appended to.
+    uint32_t    live[ARTIDX_MAX_SEGMENTS];
+};
+
+struct artidx {
+    char                 *path;
+    int                   fd;
+    size_t                maplen;
+    struct artidx_header *hdr;
+    struct artidx_entry  *buckets;
+};
+
+static uint32_t artidx_hash(const char *id)
+{
+    uint32_t hash = 2166136261;
+
+    while (*id) {
+        hash ^= (uint8_t) *id++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static int artidx_map(artidx_t *idx, int fd, uint32_t nbuckets)
+{
+    size_t maplen = ARTIDX_BUCKET_OFFSET + (size_t) nbuckets * sizeof(struct artidx_entry);
+    void *map;
+
+    map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        g_warning("failed to map spool index, %s", strerror(errno));
+        return -1;
+    }
+
+    if (idx->hdr)
+        munmap(idx->hdr, idx->maplen);
+
+    if (idx->fd >= 0 && idx->fd != fd)
+        close(idx->fd);
+
+    idx->fd      = fd;
+    idx->maplen  = maplen;
+    idx->hdr     = map;
+    idx->buckets = (struct artidx_entry *)((char *) map + ARTIDX_BUCKET_OFFSET);
+    return 0;
+}
+
+static int artidx_create(const char *path, uint32_t nbuckets)
+{
+    struct artidx_header hdr = {
+        .magic      = ARTIDX_MAGIC,
+        .version    = ARTIDX_VERSION,
+        .nbuckets   = nbuckets,
+    };
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        g_warning("failed to create spool index %s, %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, ARTIDX_BUCKET_OFFSET + (off_t) nbuckets * sizeof(struct artidx_entry)) != 0
+     || pwrite(fd, &hdr, sizeof hdr, 0) != sizeof hdr) {
+        g_warning("failed to initialize spool index %s, %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+artidx_t * artidx_open(const char *path, bool *created)
+{
+    struct artidx_header hdr;
+    struct stat st;
+    artidx_t *idx;
+    int fd;
+
+    idx = g_new0(artidx_t, 1);
+    idx->path = g_strdup(path);
+    idx->fd   = -1;
+
+    *created = false;
+
+    fd = open(path, O_RDWR);
+
+    // Check this looks like an index we understand, otherwise it will have to
+    // be rebuilt by the caller.
+    if (fd >= 0) {
+        if (pread(fd, &hdr, sizeof hdr, 0) != sizeof hdr
+         || hdr.magic != ARTIDX_MAGIC
+         || hdr.version != ARTIDX_VERSION
+         || hdr.nbuckets == 0
+         || (hdr.nbuckets & (hdr.nbuckets - 1)) != 0
+         || fstat(fd, &st) != 0
+         || st.st_size < ARTIDX_BUCKET_OFFSET + (off_t) hdr.nbuckets * sizeof(struct artidx_entry)) {
+            g_warning("spool index %s is not valid, it will be rebuilt", path);
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) {
+        hdr.nbuckets = ARTIDX_INITIAL_BUCKETS;
+
+        if ((fd = artidx_create(path, hdr.nbuckets)) < 0) {
+            artidx_close(idx);
+            return NULL;
+        }
+
+        *created = true;
+    }
+
+    if (artidx_map(idx, fd, hdr.nbuckets) != 0) {
+        close(fd);
+        artidx_close(idx);
+        return NULL;
+    }
+
+    return idx;
+}
+
+void artidx_close(artidx_t *idx)
+{
+    if (idx == NULL)
+        return;
+
+    if (idx->hdr) {
+        artidx_sync(idx);
+        munmap(idx->hdr, idx->maplen);
+    }
+
+    if (idx->fd >= 0)
+        close(idx->fd);
+
+    g_free(idx->path);
+    g_free(idx);
+}
+
+// Find the bucket for id, or the best place to insert it.
+static struct artidx_entry * artidx_probe(artidx_t *idx, const char *id, bool *found)
+{
+    uint32_t mask = idx->hdr->nbuckets - 1;
+    struct artidx_entry *deleted = NULL;
+
+    *found = false;
+
+    for (uint32_t i = artidx_hash(id) & mask; ; i = (i + 1) & mask) {
+        struct artidx_entry *entry = &idx->buckets[i];
+
+        if (entry->id[0] == '\0')
+            return deleted ? deleted : entry;
+
+        if (strncmp(entry->id, id, ARTLOG_MAX_ID) == 0) {
+            if (entry->length) {
+                *found = true;
+                return entry;
+            }
+
+            return deleted ? deleted : entry;
+        }
+
+        if (entry->length == 0 && deleted == NULL)
+            deleted = entry;
+    }
+}
+
+// Rehash into a new file, then atomically replace the old one.
+static int artidx_resize(artidx_t *idx, uint32_t nbuckets)
+{
+    struct artidx_header *old = idx->hdr;
+    struct artidx_entry *oldbuckets = idx->buckets;
+    uint32_t oldcount = old->nbuckets;
+    size_t oldlen = idx->maplen;
+    int oldfd = idx->fd;
+    char *tmppath;
+    int fd;
+
+    g_debug("resizing spool index from %u to %u buckets", oldcount, nbuckets);
+
+    tmppath = g_strdup_printf("%s.new", idx->path);
+
+    if ((fd = artidx_create(tmppath, nbuckets)) < 0) {
+        g_free(tmppath);
+        return -1;
+    }
+
+    // Map the new file without releasing the old one yet.
+    idx->hdr = NULL;
+    idx->fd  = -1;
+
+    if (artidx_map(idx, fd, nbuckets) != 0) {
+        close(fd);
+        goto failed;
+    }
+
+    idx->hdr->segment = old->segment;
+
+    memcpy(idx->hdr->live, old->live, sizeof old->live);
+
+    for (uint32_t i = 0; i < oldcount; i++) {
+        struct artidx_entry *entry;
+        bool found;
+
+        if (oldbuckets[i].id[0] == '\0' || oldbuckets[i].length == 0)
+            continue;
+
+        entry  = artidx_probe(idx, oldbuckets[i].id, &found);
+        *entry = oldbuckets[i];
+
+        idx->hdr->count++;
+        idx->hdr->used++;
+    }
+
+    // Anything inserted into a table that isn't the one at path would be
+    // lost, so keep using the old one.
+    if (msync(idx->hdr, idx->maplen, MS_SYNC) != 0 || rename(tmppath, idx->path) != 0) {
+        g_warning("failed to replace spool index, %s", strerror(errno));
+        munmap(idx->hdr, idx->maplen);
+        close(idx->fd);
+        goto failed;
+    }
+
+    munmap(old, oldlen);
+    close(oldfd);
+    g_free(tmppath);
+    return 0;
+
+failed:
+    unlink(tmppath);
+    idx->hdr     = old;
+    idx->buckets = oldbuckets;
+    idx->maplen  = oldlen;
+    idx->fd      = oldfd;
+    g_free(tmppath);
+    return -1;
+}
+
+const struct artidx_entry * artidx_lookup(artidx_t *idx, const char *id)
+{
+    struct artidx_entry *entry;
+    bool found;
+
+    entry = artidx_probe(idx, id, &found);
+
+    return found ? entry : NULL;
+}
+
+static void artidx_segment_adjust(artidx_t *idx, uint32_t segment, int delta)
+{
+    if (segment >= ARTIDX_MAX_SEGMENTS) {
+        g_warning("spool segment %u is out of range", segment);
+        return;
+    }
+
+    idx->hdr->live[segment] += delta;
+}
+
+int artidx_insert(artidx_t *idx, const struct artidx_entry *entry)
+{
+    struct artidx_entry *bucket;
+    bool found;
+
+    g_return_val_if_fail(entry->length != 0, -1);
+
+    // Keep the load factor under 70%, counting deleted entries.
+    if ((uint64_t) (idx->hdr->used + 1) * 10 > (uint64_t) idx->hdr->nbuckets * 7) {
+        uint32_t nbuckets = idx->hdr->nbuckets;
+
+        // If most of those were deletions, just rehashing is enough.
+        if ((uint64_t) idx->hdr->count * 10 > (uint64_t) nbuckets * 3)
+            nbuckets *= 2;
+
+        if (artidx_resize(idx, nbuckets) != 0)
+            return -1;
+    }
+
+    bucket = artidx_probe(idx, entry->id, &found);
+
+    if (found) {
+        artidx_segment_adjust(idx, bucket->segment, -1);
+    } else {
+        if (bucket->id[0] == '\0')
+            idx->hdr->used++;
+        idx->hdr->count++;
+    }
+
+    // Fill in the location before the id, so that a torn update never makes
+    // a new id point somewhere random.
+    bucket->segment   = entry->segment;
+    bucket->offset    = entry->offset;
+    bucket->timestamp = entry->timestamp;
+    bucket->length    = entry->length;
+
+    memcpy(bucket->id, entry->id, ARTLOG_MAX_ID);
+
+    artidx_segment_adjust(idx, entry->segment, +1);
+    return 0;
+}
+
+int artidx_remove(artidx_t *idx, const char *id)
+{
+    struct artidx_entry *bucket;
+    bool found;
+
+    bucket = artidx_probe(idx, id, &found);
+
+    if (!found)
+        return -1;
+
+    artidx_segment_adjust(idx, bucket->segment, -1);
+
+    // Leave the id, so the probe sequence isn't broken.
+    bucket->length = 0;
+
+    idx->hdr->count--;
+    return 0;
+}
+
+uint32_t artidx_segment(artidx_t *idx)
+{
+    return idx->hdr->segment;
+}
+
+void artidx_set_segment(artidx_t *idx, uint32_t segment)
+{
+    idx->hdr->segment = segment;
+}
+
+uint32_t artidx_segment_live(artidx_t *idx, uint32_t segment)
+{
+    return segment < ARTIDX_MAX_SEGMENTS ? idx->hdr->live[segment] : 1;
+}
+
+uint32_t artidx_count(artidx_t *idx)
+{
+    return idx->hdr->count;
+}
+
+int artidx_sync(artidx_t *idx)
+{
+    if (msync(idx->hdr, idx->maplen, MS_ASYNC) != 0) {
+        g_warning("failed to sync spool index, %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// The callback is allowed to remove entries, but not to insert them.
+void artidx_foreach(artidx_t *idx, artidx_cb_t callback, void *opaque)
+{
+    for (uint32_t i = 0; i < idx->hdr->nbuckets; i++) {
+        if (idx->buckets[i].id[0] == '\0' || idx->buckets[i].length == 0)
+            continue;
+
+        callback(&idx->buckets[i], opaque);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef __ARTIDX_H
+#define __ARTIDX_H
+
+// The article index is a persistent open-addressing hash table from object
+// id to its location in the article log. It is used directly from a shared
+// mapping of the index file, so opening it costs the same no matter how many
+// articles are spooled.
+
+#define ARTIDX_MAX_SEGMENTS 1024
+
+typedef struct artidx artidx_t;
+
+struct artidx_entry {
+    char        id[ARTLOG_MAX_ID];
+    uint32_t    segment;
+    uint32_t    length;         // Zero if this entry was deleted.
+    uint64_t    offset;
+    int64_t     timestamp;
+};
+
+typedef void (*artidx_cb_t)(const struct artidx_entry *entry, void *opaque);
+
+artidx_t *
+artidx_open(const char *path, bool *created);
+
+void
+artidx_close(artidx_t *idx);
+
+const struct artidx_entry *
+artidx_lookup(artidx_t *idx, const char *id);
+
+int
+artidx_insert(artidx_t *idx, const struct artidx_entry *entry);
+
+int
+artidx_remove(artidx_t *idx, const char *id);
+
+uint32_t
+artidx_segment(artidx_t *idx);
+
+void
+artidx_set_segment(artidx_t *idx, uint32_t segment);
+
+uint32_t
+artidx_segment_live(artidx_t *idx, uint32_t segment);
+
+uint32_t
+artidx_count(artidx_t *idx);
+
+int
+artidx_sync(artidx_t *idx);
+
+void
+artidx_foreach(artidx_t *idx, artidx_cb_t callback, void *opaque);
+
+#endif
@@ -0,0 +1,165 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that the spool index keeps every entry when it grows or is rehashed,
+// across a reopen, and when a resize can't be committed. Run with
+// `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "artlog.h"
+#include "artidx.h"
+
+// More than a new index holds before it has to grow.
+#define TEST_ENTRIES 5000
+
+// Enough deletions that the next resize only rehashes.
+#define TEST_REMOVED 4000
+
+static int failures;
+
+static void check(bool passed, const char *what, uint32_t n)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s (%u)\n", what, n);
+        failures++;
+    }
+}
+
+// Every field of entry n is derived from n.
+static void test_entry(struct artidx_entry *entry, uint32_t n)
+{
+    memset(entry, 0, sizeof *entry);
+    snprintf(entry->id, sizeof entry->id, "t1_%x", n);
+
+    entry->segment   = n % 3;
+    entry->length    = n + 1;
+    entry->offset    = (uint64_t) n << 20;
+    entry->timestamp = 1600000000 + n;
+}
+
+static bool test_insert(artidx_t *idx, uint32_t n)
+{
+    struct artidx_entry entry;
+
+    test_entry(&entry, n);
+
+    return artidx_insert(idx, &entry) == 0;
+}
+
+// Entries from first up to last should be there, and nothing else.
+static void check_entries(artidx_t *idx, uint32_t first, uint32_t last, uint32_t max)
+{
+    uint32_t live[3] = {0};
+
+    for (uint32_t n = 0; n < max; n++) {
+        const struct artidx_entry *found;
+        struct artidx_entry entry;
+
+        test_entry(&entry, n);
+
+        found = artidx_lookup(idx, entry.id);
+
+        if (n < first || n >= last) {
+            check(found == NULL, "removed entry is gone", n);
+            continue;
+        }
+
+        check(found && memcmp(found, &entry, sizeof entry) == 0, "entry is found", n);
+
+        live[n % 3]++;
+    }
+
+    check(artidx_count(idx) == last - first, "count is right", artidx_count(idx));
+
+    for (uint32_t segment = 0; segment < 3; segment++) {
+        check(artidx_segment_live(idx, segment) == live[segment], "segment count is right", segment);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = g_dir_make_tmp("artidxtest-XXXXXX", NULL);
+    struct stat st;
+    artidx_t *idx;
+    bool created;
+    uint32_t n;
+
+    // Everything is opened in the current directory.
+    if (dir == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "%s: couldn't make a temporary directory\n", argv[0]);
+        return 1;
+    }
+
+    idx = artidx_open("idx", &created);
+
+    check(idx && created, "a new index is created", 0);
+
+    // Fill it past the point where it has to grow.
+    for (n = 0; n < TEST_ENTRIES; n++) {
+        check(test_insert(idx, n), "entry can be inserted", n);
+    }
+
+    check_entries(idx, 0, TEST_ENTRIES, TEST_ENTRIES);
+
+    // Remove most of them, and keep inserting until the deleted buckets have
+    // to be cleared out.
+    for (n = 0; n < TEST_REMOVED; n++) {
+        struct artidx_entry entry;
+
+        test_entry(&entry, n);
+        check(artidx_remove(idx, entry.id) == 0, "entry can be removed", n);
+    }
+
+    for (n = TEST_ENTRIES; n < TEST_ENTRIES * 2; n++) {
+        check(test_insert(idx, n), "entry can be inserted after removals", n);
+    }
+
+    check_entries(idx, TEST_REMOVED, TEST_ENTRIES * 2, TEST_ENTRIES * 2);
+    check(stat("idx.new", &st) != 0, "nothing is left after resizing", 0);
+
+    // It's all still there after a reopen.
+    artidx_close(idx);
+
+    idx = artidx_open("idx", &created);
+
+    check(idx && !created, "the index is reopened", 0);
+    check_entries(idx, TEST_REMOVED, TEST_ENTRIES * 2, TEST_ENTRIES * 2);
+
+    // If the new table can't replace the old one, the old one is kept.
+    if (unlink("idx") != 0 || mkdir("idx", 0700) != 0) {
+        fprintf(stderr, "%s: couldn't replace the index with a directory\n", argv[0]);
+        return 1;
+    }
+
+    for (n = TEST_ENTRIES * 2; n < TEST_ENTRIES * 4; n++) {
+        if (!test_insert(idx, n))
+            break;
+    }
+
+    check(n < TEST_ENTRIES * 4, "the resize fails", n);
+
+    check_entries(idx, TEST_REMOVED, n, n);
+    check(stat("idx.new", &st) != 0, "nothing is left after a failed resize", 0);
+
+    artidx_close(idx);
+
+    if (chdir("/") == 0) {
+        char *command = g_strdup_printf("rm -rf '%s'", dir);
+
+        if (system(command) != 0)
+            fprintf(stderr, "%s: failed to remove %s\n", argv[0], dir);
+
+        g_free(command);
+    }
+
+    g_free(dir);
+    return failures != 0;
+}
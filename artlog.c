@@ -0,0 +1,387 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "setup.h"
+#include "artlog.h"
+#include "artidx.h"
+
+#define ARTLOG_MAGIC 0x4c54524e  // "NRTL"
+
+// Every object appended to a segment is prefixed with this header, which
+// makes the segments self-describing if the index ever needs rebuilding.
+struct artlog_hdr {
+    uint32_t    magic;
+    uint32_t    length;
+    int64_t     timestamp;
+    char        id[ARTLOG_MAX_ID];
+};
+
+struct artlog {
+    char        *prefix;
+    artidx_t    *index;         // id => location, mapped from prefix.idx
+    int          segfd;         // the segment we're appending to
+    uint32_t     segment;
+    uint64_t     segsize;
+    GHashTable  *segfds;        // segment => fd, opened for reading on demand
+};
+
+static char * artlog_segment_name(artlog_t *log, uint32_t segment)
+{
+    return g_strdup_printf("%s.%03u", log->prefix, segment);
+}
+
+static int artlog_segment_fd(artlog_t *log, uint32_t segment)
+{
+    gpointer fd;
+    char *name;
+    int newfd;
+
+    if (segment == log->segment)
+        return log->segfd;
+
+    if (g_hash_table_lookup_extended(log->segfds, GUINT_TO_POINTER(segment), NULL, &fd))
+        return GPOINTER_TO_INT(fd);
+
+    name  = artlog_segment_name(log, segment);
+    newfd = open(name, O_RDONLY);
+
+    if (newfd < 0) {
+        g_warning("failed to open spool segment %s, %s", name, strerror(errno));
+    } else {
+        g_hash_table_insert(log->segfds, GUINT_TO_POINTER(segment), GINT_TO_POINTER(newfd));
+    }
+
+    g_free(name);
+    return newfd;
+}
+
+// Once nothing in an old segment is referenced any more it can be deleted.
+static void artlog_segment_collect(artlog_t *log, uint32_t segment)
+{
+    gpointer key = GUINT_TO_POINTER(segment);
+    gpointer fd;
+    char *name;
+
+    if (segment == log->segment || artidx_segment_live(log->index, segment) != 0)
+        return;
+
+    if (g_hash_table_lookup_extended(log->segfds, key, NULL, &fd)) {
+        close(GPOINTER_TO_INT(fd));
+        g_hash_table_remove(log->segfds, key);
+    }
+
+    name = artlog_segment_name(log, segment);
+
+    g_debug("spool segment %s has no live objects, removing", name);
+
+    unlink(name);
+    g_free(name);
+}
+
+static int artlog_segment_open(artlog_t *log, uint32_t segment)
+{
+    struct stat st;
+    char *name = artlog_segment_name(log, segment);
+
+    if (segment >= ARTIDX_MAX_SEGMENTS) {
+        g_warning("too many spool segments, try expunging old articles");
+        g_free(name);
+        return -1;
+    }
+
+    if (log->segfd >= 0)
+        close(log->segfd);
+
+    log->segment = segment;
+    log->segfd   = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (log->segfd < 0 || fstat(log->segfd, &st) != 0) {
+        g_warning("failed to open spool segment %s, %s", name, strerror(errno));
+        g_free(name);
+        return -1;
+    }
+
+    log->segsize = st.st_size;
+
+    artidx_set_segment(log->index, segment);
+
+    g_free(name);
+    return 0;
+}
+
+// Walk every segment and index the last copy of each object found, this is
+// only needed if the index was lost or is from an older version. Removals
+// aren't recorded in the segments, but expunge will just find them again.
+static void artlog_rebuild(artlog_t *log)
+{
+    struct artlog_hdr hdr;
+    uint32_t lastseg = 0;
+
+    for (uint32_t segment = 0; segment < ARTIDX_MAX_SEGMENTS; segment++) {
+        char *name = artlog_segment_name(log, segment);
+        int fd = open(name, O_RDONLY);
+        uint64_t offset = 0;
+
+        g_free(name);
+
+        if (fd < 0)
+            continue;
+
+        while (pread(fd, &hdr, sizeof hdr, offset) == sizeof hdr && hdr.magic == ARTLOG_MAGIC) {
+            struct artidx_entry entry = {0};
+
+            memcpy(entry.id, hdr.id, sizeof entry.id);
+
+            entry.id[ARTLOG_MAX_ID - 1] = '\0';
+            entry.segment   = segment;
+            entry.offset    = offset + sizeof hdr;
+            entry.length    = hdr.length;
+            entry.timestamp = hdr.timestamp;
+
+            offset += sizeof hdr + hdr.length;
+
+            if (entry.length)
+                artidx_insert(log->index, &entry);
+        }
+
+        lastseg = segment;
+        close(fd);
+    }
+
+    artidx_set_segment(log->index, lastseg);
+
+    g_message("rebuilt spool index with %u objects", artidx_count(log->index));
+}
+
+artlog_t * artlog_open(const char *prefix)
+{
+    artlog_t *log;
+    bool created;
+    char *name;
+
+    log = g_new0(artlog_t, 1);
+    log->prefix = g_strdup(prefix);
+    log->segfd  = -1;
+    log->segfds = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    name = g_strdup_printf("%s.idx", prefix);
+
+    log->index = artidx_open(name, &created);
+
+    g_free(name);
+
+    if (log->index == NULL) {
+        artlog_close(log);
+        return NULL;
+    }
+
+    if (created) {
+        artlog_rebuild(log);
+    }
+
+    if (artlog_segment_open(log, artidx_segment(log->index)) != 0) {
+        artlog_close(log);
+        return NULL;
+    }
+
+    g_debug("opened spool %s with %u objects", prefix, artidx_count(log->index));
+
+    return log;
+}
+
+void artlog_close(artlog_t *log)
+{
+    GHashTableIter iter;
+    gpointer fd;
+
+    if (log == NULL)
+        return;
+
+    if (log->index) {
+        artlog_sync(log);
+        artidx_close(log->index);
+    }
+
+    g_hash_table_iter_init(&iter, log->segfds);
+
+    while (g_hash_table_iter_next(&iter, NULL, &fd)) {
+        close(GPOINTER_TO_INT(fd));
+    }
+
+    if (log->segfd >= 0)
+        close(log->segfd);
+
+    g_hash_table_destroy(log->segfds);
+    g_free(log->prefix);
+    g_free(log);
+}
+
+int artlog_append(artlog_t *log, const char *id, const void *data, size_t len, time_t timestamp)
+{
+    const struct artidx_entry *old;
+    struct artlog_hdr hdr = {0};
+    struct artidx_entry entry = {0};
+    uint32_t oldseg;
+
+    if (strlen(id) >= ARTLOG_MAX_ID || len == 0 || len > UINT32_MAX) {
+        g_warning("refusing to spool object %s with length %zu", id, len);
+        return -1;
+    }
+
+    // Start a new segment if this one is full.
+    if (log->segsize + sizeof hdr + len > ARTLOG_SEGMENT_SIZE && log->segsize > 0) {
+        uint32_t previous = log->segment;
+
+        if (artlog_segment_open(log, log->segment + 1) != 0)
+            return -1;
+
+        // It might be garbage already.
+        artlog_segment_collect(log, previous);
+    }
+
+    hdr.magic     = ARTLOG_MAGIC;
+    hdr.length    = len;
+    hdr.timestamp = timestamp;
+
+    strncpy(hdr.id, id, sizeof hdr.id - 1);
+
+    if (write(log->segfd, &hdr, sizeof hdr) != sizeof hdr
+     || write(log->segfd, data, len) != (ssize_t) len) {
+        g_warning("failed to append %s to spool, %s", id, strerror(errno));
+
+        // Throw away whatever made it, so the next record is aligned.
+        if (ftruncate(log->segfd, log->segsize) != 0) {
+            g_warning("failed to truncate spool segment, %s", strerror(errno));
+        }
+
+        return -1;
+    }
+
+    memcpy(entry.id, hdr.id, sizeof entry.id);
+
+    entry.segment   = log->segment;
+    entry.offset    = log->segsize + sizeof hdr;
+    entry.length    = len;
+    entry.timestamp = timestamp;
+
+    log->segsize   += sizeof hdr + len;
+
+    old    = artidx_lookup(log->index, id);
+    oldseg = old ? old->segment : log->segment;
+
+    if (artidx_insert(log->index, &entry) != 0)
+        return -1;
+
+    artlog_segment_collect(log, oldseg);
+    return 0;
+}
+
+int artlog_read(artlog_t *log, const char *id, char **data, size_t *len)
+{
+    const struct artidx_entry *entry = artidx_lookup(log->index, id);
+    ssize_t n;
+    int fd;
+
+    *data = NULL;
+    *len  = 0;
+
+    if (entry == NULL)
+        return -1;
+
+    if ((fd = artlog_segment_fd(log, entry->segment)) < 0)
+        return -1;
+
+    *data = g_malloc(entry->length + 1);
+
+    n = pread(fd, *data, entry->length, entry->offset);
+
+    if (n != entry->length) {
+        g_warning("short read of %s from spool segment %u", id, entry->segment);
+        g_free(*data);
+        *data = NULL;
+        return -1;
+    }
+
+    (*data)[entry->length] = '\0';
+    *len = entry->length;
+    return 0;
+}
+
+bool artlog_contains(artlog_t *log, const char *id)
+{
+    return artidx_lookup(log->index, id) != NULL;
+}
+
+int artlog_remove(artlog_t *log, const char *id)
+{
+    const struct artidx_entry *entry = artidx_lookup(log->index, id);
+    uint32_t segment;
+
+    if (entry == NULL)
+        return 0;
+
+    segment = entry->segment;
+
+    if (artidx_remove(log->index, id) != 0)
+        return -1;
+
+    artlog_segment_collect(log, segment);
+    return 0;
+}
+
+int artlog_sync(artlog_t *log)
+{
+    int result = artidx_sync(log->index);
+
+#ifdef HAVE_FDATASYNC
+    if (log->segfd >= 0 && fdatasync(log->segfd) != 0)
+        result = -1;
+#else
+    if (log->segfd >= 0 && fsync(log->segfd) != 0)
+        result = -1;
+#endif
+    return result;
+}
+
+size_t artlog_count(artlog_t *log)
+{
+    return artidx_count(log->index);
+}
+
+struct artlog_foreach_ctx {
+    artlog_cb_t  callback;
+    void        *opaque;
+};
+
+static void artlog_foreach_entry(const struct artidx_entry *entry, void *opaque)
+{
+    struct artlog_foreach_ctx *ctx = opaque;
+    char id[ARTLOG_MAX_ID];
+
+    // The entry might be removed by the callback.
+    memcpy(id, entry->id, sizeof id);
+
+    ctx->callback(id, entry->timestamp, ctx->opaque);
+}
+
+// The callback may remove objects, but must not append new ones.
+void artlog_foreach(artlog_t *log, artlog_cb_t callback, void *opaque)
+{
+    struct artlog_foreach_ctx ctx = {
+        .callback   = callback,
+        .opaque     = opaque,
+    };
+
+    artidx_foreach(log->index, artlog_foreach_entry, &ctx);
+}
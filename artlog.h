@@ -0,0 +1,49 @@
+#ifndef __ARTLOG_H
+#define __ARTLOG_H
+
+// The article log is an append-only set of segment files holding serialized
+// spool objects, plus a small index file recording where the most recent
+// copy of each object lives. Nothing already written is ever modified, an
+// update is just another record appended to the current segment.
+//
+// The index is a hash table used through a shared mapping (see artidx.c),
+// so opening the log doesn't read anything and lookups are constant time.
+
+// Segments are rolled over once they reach this size.
+#define ARTLOG_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// Longest object id we can record, e.g. "t1_abcdefg".
+#define ARTLOG_MAX_ID 16
+
+typedef struct artlog artlog_t;
+
+typedef void (*artlog_cb_t)(const char *id, time_t timestamp, void *opaque);
+
+artlog_t *
+artlog_open(const char *prefix);
+
+void
+artlog_close(artlog_t *log);
+
+int
+artlog_append(artlog_t *log, const char *id, const void *data, size_t len, time_t timestamp);
+
+int
+artlog_read(artlog_t *log, const char *id, char **data, size_t *len);
+
+bool
+artlog_contains(artlog_t *log, const char *id);
+
+int
+artlog_remove(artlog_t *log, const char *id);
+
+int
+artlog_sync(artlog_t *log);
+
+size_t
+artlog_count(artlog_t *log);
+
+void
+artlog_foreach(artlog_t *log, artlog_cb_t callback, void *opaque);
+
+#endif
@@ -1,4 +1,4 @@
-/* 
+/*
  * This file is part of nntpit, https://github.com/taviso/nntpit.
  *
  * Based on nntpsink, Copyright (c) 2011-2014 Felicity Tarnell.
@@ -8,6 +8,7 @@
 #include  <sys/uio.h>
 
 #include  <stdlib.h>
+#include  <string.h>
 #include  <strings.h>
 #include  <unistd.h>
 #include  <errno.h>
@@ -16,6 +17,24 @@
 #include  "charq.h"
 #include  "nntpit.h"
 
+/* Most ents cq_write can send with one writev. */
+#define CHARQ_IOV 64
+
+static size_t const cq_sizes[CHARQ_NCLASSES] = { 0, 256, 1024, 4096, CHARQ_BSZ };
+
+/*
+ * Every thread has its own pool, clients never move between threads so
+ * blocks are almost always freed by the thread that allocated them.
+ */
+typedef struct charq_pool {
+  charq_ent_list_t cqp_free[CHARQ_NCLASSES];
+  size_t     cqp_nfree[CHARQ_NCLASSES];
+  charq_stats_t    cqp_stats;
+  int      cqp_init;
+} charq_pool_t;
+
+static __thread charq_pool_t cq_pool;
+
 charq_t *
 cq_new()
 {
@@ -24,6 +43,71 @@ charq_t   *cq = xcalloc(1, sizeof(*cq));
   return cq;
 }
 
+/*
+ * Get an ent of the smallest class that holds sz bytes, or the largest class
+ * if none do.  The data isn't cleared.
+ */
+static charq_ent_t *
+cq_ent_new(size_t sz)
+{
+    charq_pool_t *pool = &cq_pool;
+    charq_ent_t *cqe;
+    unsigned c;
+
+    if (!pool->cqp_init) {
+        for (c = 0; c < CHARQ_NCLASSES; c++)
+            TAILQ_INIT(&pool->cqp_free[c]);
+        pool->cqp_init = 1;
+    }
+
+    for (c = 0; c < CHARQ_NCLASSES - 1 && cq_sizes[c] < sz; c++)
+        ;
+
+    if ((cqe = TAILQ_FIRST(&pool->cqp_free[c]))) {
+        TAILQ_REMOVE(&pool->cqp_free[c], cqe, cqe_list);
+        pool->cqp_nfree[c]--;
+        pool->cqp_stats.cqs_resident -= sizeof(*cqe) + cq_sizes[c];
+        pool->cqp_stats.cqs_hits++;
+    } else {
+        cqe = xmalloc(sizeof(*cqe) + cq_sizes[c]);
+        pool->cqp_stats.cqs_misses++;
+    }
+
+    cqe->cqe_start = cqe->cqe_end = cqe->cqe_data;
+    cqe->cqe_release = NULL;
+    cqe->cqe_opaque = NULL;
+    cqe->cqe_class = c;
+    cqe->cqe_size = cq_sizes[c];
+    return cqe;
+}
+
+static void
+cq_ent_free(charq_ent_t *cqe)
+{
+    charq_pool_t *pool = &cq_pool;
+    unsigned c = cqe->cqe_class;
+
+    if (cqe->cqe_release)
+        cqe->cqe_release(cqe->cqe_opaque);
+
+    if (!pool->cqp_init
+      || (pool->cqp_nfree[c] + 1) * (sizeof(*cqe) + cq_sizes[c]) > CHARQ_POOLMAX) {
+        free(cqe);
+        return;
+    }
+
+    /* Most recently used first, it's more likely to still be in cache. */
+    TAILQ_INSERT_HEAD(&pool->cqp_free[c], cqe, cqe_list);
+    pool->cqp_nfree[c]++;
+    pool->cqp_stats.cqs_resident += sizeof(*cqe) + cq_sizes[c];
+}
+
+void
+cq_stats(charq_stats_t *stats)
+{
+    *stats = cq_pool.cqp_stats;
+}
+
 void
 cq_free(cq)
   charq_t *cq;
@@ -31,8 +115,9 @@ cq_free(cq)
 charq_ent_t *cqe;
   while ((cqe = TAILQ_FIRST(&cq->cq_ents))) {
     TAILQ_REMOVE(&cq->cq_ents, cqe, cqe_list);
-    free(cqe);
+    cq_ent_free(cqe);
   }
+  free(cq->cq_linebuf);
   free(cq);
 }
 
@@ -43,18 +128,23 @@ cq_append(cq, data, sz)
   size_t     sz;
 {
   if (!TAILQ_EMPTY(&cq->cq_ents)) {
-  size_t     todo = sz > cq_left(cq) ? cq_left(cq) : sz;
-    bcopy(data, cq_last_ent_free(cq), todo);
+  charq_ent_t *last = cq_last_ent(cq);
+  size_t     todo = sz > cqe_left(last) ? cqe_left(last) : sz;
+    bcopy(data, last->cqe_end, todo);
+    last->cqe_end += todo;
     sz -= todo;
     data += todo;
     cq->cq_len += todo;
   }
 
   while (sz) {
-  charq_ent_t *new;
-  size_t     todo = sz > CHARQ_BSZ ? CHARQ_BSZ : sz;
-    new = calloc(1, sizeof(*new));
+  charq_ent_t *new, *last = cq_last_ent(cq);
+  size_t     todo;
+    /* Grow quickly, lots of small writes shouldn't mean lots of small blocks. */
+    new = cq_ent_new(last && sz < last->cqe_size * 4 ? last->cqe_size * 4 : sz);
+    todo = sz > new->cqe_size ? new->cqe_size : sz;
     bcopy(data, new->cqe_data, todo);
+    new->cqe_end += todo;
     cq->cq_len += todo;
     sz -= todo;
     data += todo;
@@ -62,41 +152,91 @@ cq_append(cq, data, sz)
   }
 }
 
+/*
+ * Queue sz bytes of data without copying them. The data must not change
+ * until release(opaque) is called, which happens when the last of it has been
+ * written or the charq is freed.
+ */
+void
+cq_append_ref(charq_t *cq, char const *data, size_t sz,
+              charq_release_t release, void *opaque)
+{
+    charq_ent_t *cqe;
+
+    if (sz < CHARQ_MINREF) {
+        cq_append(cq, data, sz);
+        release(opaque);
+        return;
+    }
+
+    cqe = cq_ent_new(0);
+    cqe->cqe_start = (char *) data;
+    cqe->cqe_end = cqe->cqe_start + sz;
+    cqe->cqe_release = release;
+    cqe->cqe_opaque = opaque;
+    cq->cq_len += sz;
+    TAILQ_INSERT_TAIL(&cq->cq_ents, cqe, cqe_list);
+}
+
 void
 cq_remove_start(charq_t *cq, size_t sz)
 {
     assert(sz <= cq_len(cq));
-    while (sz >= (CHARQ_BSZ - cq->cq_offs)) {
+    cq->cq_len -= sz;
+    cq->cq_scanned = sz < cq->cq_scanned ? cq->cq_scanned - sz : 0;
+
+    while (sz) {
         charq_ent_t *n = cq_first_ent(cq);
+
+        if (sz < cqe_len(n)) {
+            n->cqe_start += sz;
+            return;
+        }
+
+        sz -= cqe_len(n);
+
+        /* Drained blocks go back to the pool, even the last. */
         TAILQ_REMOVE(&cq->cq_ents, n, cqe_list);
-        free(n);
-        cq->cq_len -= (CHARQ_BSZ - cq->cq_offs);
-        sz -= (CHARQ_BSZ - cq->cq_offs);
-        cq->cq_offs = 0;
+        cq_ent_free(n);
     }
-
-    cq->cq_offs += sz;
-    cq->cq_len -= sz;
 }
 
+/*
+ * Write as much as the socket will take, all the ents go in one writev.
+ */
 ssize_t
 cq_write(charq_t *cq, int fd)
 {
+    struct iovec iov[CHARQ_IOV];
     ssize_t   i = 0;
-    charq_ent_t *first = cq_first_ent(cq);
 
     while (cq_len(cq)) {
+        charq_ent_t *e;
+        size_t want = 0;
+        int niov = 0;
         ssize_t n;
-        first = cq_first_ent(cq);
-        n = write(fd, first->cqe_data + cq->cq_offs, 
-                cq_nents(cq) > 1 
-                ? (CHARQ_BSZ - cq->cq_offs)
-                : cq_len(cq));
+
+        TAILQ_FOREACH(e, &cq->cq_ents, cqe_list) {
+            if (niov == CHARQ_IOV)
+                break;
+            if (cqe_len(e) == 0)
+                continue;
+            iov[niov].iov_base = e->cqe_start;
+            iov[niov].iov_len = cqe_len(e);
+            want += cqe_len(e);
+            niov++;
+        }
+
+        n = writev(fd, iov, niov);
         if (n <= 0)
             return n;
 
         cq_remove_start(cq, n);
         i += n;
+
+        /* The socket is full, trying again now would only fail. */
+        if ((size_t) n < want)
+            break;
     }
 
     return i;
@@ -109,18 +249,15 @@ cq_extract_start(cq, buf, len)
   size_t   len;
 {
 unsigned char *bufp = buf;
-charq_ent_t *first = cq_first_ent(cq);
+charq_ent_t *first;
 
   while (len && cq_len(cq)) {
-  ssize_t n;
+  size_t  n;
     first = cq_first_ent(cq);
-    n = cq_nents(cq) > 1 
-      ? (CHARQ_BSZ - cq->cq_offs)
-      : cq_len(cq);
+    n = cqe_len(first);
     if (n > len)
       n = len;
-    bcopy(first->cqe_data + cq->cq_offs,
-          bufp, n);
+    bcopy(first->cqe_start, bufp, n);
     len -= n;
     bufp += n;
     cq_remove_start(cq, n);
@@ -130,105 +267,130 @@ charq_ent_t *first = cq_first_ent(cq);
 ssize_t
 cq_read(charq_t *cq, int fd)
 {
-    ssize_t n;  
-    if (cq_left(cq) == 0) {
-        charq_ent_t *cqe;
-        cqe = xcalloc(1, sizeof(*cqe));
-        n = read(fd, cqe->cqe_data, CHARQ_BSZ);
+    charq_ent_t *cqe = cq_last_ent(cq);
+    ssize_t n;
+    if (cqe == NULL || cqe_left(cqe) == 0) {
+        cqe = cq_ent_new(CHARQ_BSZ);
+        n = read(fd, cqe->cqe_end, cqe->cqe_size);
         if (n <= 0) {
             if (n == -1 && errno == EINVAL)
                 abort();
-            free(cqe);
+            cq_ent_free(cqe);
             return n;
         }
+        cqe->cqe_end += n;
         cq->cq_len += n;
         TAILQ_INSERT_TAIL(&cq->cq_ents, cqe, cqe_list);
         return n;
     }
 
-    n = read(fd, cq_last_ent_free(cq), cq_left(cq));
+    n = read(fd, cqe->cqe_end, cqe_left(cqe));
     if (n == -1 && errno == EINVAL)
         abort();
-    if (n > 0)
+    if (n > 0) {
+        cqe->cqe_end += n;
         cq->cq_len += n;
+    }
     return n;
 }
 
+/*
+ * Find the first newline.  A command often arrives in more than one read, so
+ * remember how far we got and don't look at those bytes again next time.
+ */
 static ssize_t
-cq_find(cq, c)
-  charq_t *cq;
-  char   c;
+cq_find_eol(charq_t *cq)
 {
-char    *p;
-charq_ent_t *e;
-size_t     i = 0, flen;
+    charq_ent_t *e;
+    size_t skip = cq->cq_scanned;
+    size_t i = 0;
+
+    TAILQ_FOREACH(e, &cq->cq_ents, cqe_list) {
+        char *p;
+
+        if (skip >= cqe_len(e)) {
+            skip -= cqe_len(e);
+            i += cqe_len(e);
+            continue;
+        }
 
-  if (cq_len(cq) == 0)
+        if ((p = memchr(e->cqe_start + skip, '\n', cqe_len(e) - skip))) {
+            cq->cq_scanned = i + (p - e->cqe_start);
+            return cq->cq_scanned;
+        }
+
+        i += cqe_len(e);
+        skip = 0;
+    }
+
+    cq->cq_scanned = cq_len(cq);
     return -1;
-  
-  flen = CHARQ_BSZ - cq->cq_offs;
-  if (flen > cq_len(cq))
-    flen = cq_len(cq);
-
-  for (e = cq_first_ent(cq), p = e->cqe_data + cq->cq_offs;
-       p < (e->cqe_data + cq->cq_offs + flen); p++) {
-    if (*p == c)
-      return p - (e->cqe_data + cq->cq_offs);
-  }
-  i = CHARQ_BSZ - cq->cq_offs;
-  for (e = TAILQ_NEXT(e, cqe_list); e; e = TAILQ_NEXT(e, cqe_list)) {
-    for (p = e->cqe_data; i < cq->cq_len && p < (e->cqe_data + CHARQ_BSZ); p++, i++) {
-      if (*p == c) {
-        return i;
-      }
+}
+
+/*
+ * Copy the first len bytes without removing them.
+ */
+static void
+cq_peek(charq_t *cq, char *buf, size_t len)
+{
+    charq_ent_t *e;
+
+    TAILQ_FOREACH(e, &cq->cq_ents, cqe_list) {
+        size_t n = cqe_len(e) < len ? cqe_len(e) : len;
+
+        if (len == 0)
+            break;
+
+        bcopy(e->cqe_start, buf, n);
+        buf += n;
+        len -= n;
     }
-  }
-  return -1;
 }
 
 char *
-cq_read_line(cq)
-  charq_t *cq;
+cq_line(charq_t *cq)
 {
-charq_ent_t *e;
-ssize_t    pos;
-char    *line;
-size_t     done = 0, todo;
-
-  if ((pos = cq_find(cq, '\n')) == -1)
-    return NULL;
-  pos++;
-  line = xmalloc(pos + 1);
-
-  e = cq_first_ent(cq);
-  todo = pos <= (CHARQ_BSZ - cq->cq_offs) ?
-    pos : (CHARQ_BSZ - cq->cq_offs);
-  assert(todo <= pos);
-  bcopy(e->cqe_data + cq->cq_offs, line, todo);
-  done += todo;
-
-  if (done == pos) {
-    line[done - 1] = 0;
-    if (*line && line[done - 2] == '\r')
-      line[done - 2] = 0;
-    cq_remove_start(cq, pos);
-    return line;
-  }
+    charq_ent_t *first;
+    ssize_t pos;
+    char *line;
+
+    if (cq->cq_line)
+        return cq->cq_line;
+
+    if ((pos = cq_find_eol(cq)) == -1)
+        return NULL;
+
+    first = cq_first_ent(cq);
 
-  for (e = TAILQ_NEXT(e, cqe_list); e; e = TAILQ_NEXT(e, cqe_list)) {
-    todo = pos <= CHARQ_BSZ ?  pos : CHARQ_BSZ;
-    if (todo > (pos - done))
-      todo = pos - done;
-    bcopy(e->cqe_data, line + done, todo);
-    done += todo;
-    if (done == pos) {
-      line[done - 1] = 0;
-      if (*line && line[done - 2] == '\r')
-        line[done - 2] = 0;
-      cq_remove_start(cq, pos);
-      return line;
+    if ((size_t) pos < cqe_len(first) && !first->cqe_release) {
+        /* It's all in one block, so it can be terminated where it is. */
+        line = first->cqe_start;
+    } else {
+        if (cq->cq_linebufsz < (size_t) pos + 1) {
+            free(cq->cq_linebuf);
+            cq->cq_linebufsz = pos + 1;
+            cq->cq_linebuf = xmalloc(cq->cq_linebufsz);
+        }
+
+        line = cq->cq_linebuf;
+        cq_peek(cq, line, pos);
     }
-  }
 
-  abort();
+    line[pos] = 0;
+    if (pos > 0 && line[pos - 1] == '\r')
+        line[pos - 1] = 0;
+
+    cq->cq_line = line;
+    cq->cq_linelen = pos + 1;
+    return line;
+}
+
+void
+cq_line_done(charq_t *cq)
+{
+    if (cq->cq_line == NULL)
+        return;
+
+    cq->cq_line = NULL;
+    cq_remove_start(cq, cq->cq_linelen);
 }
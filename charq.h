@@ -10,6 +10,7 @@
 #define NTS_CHARQ_H
 
 #include  <sys/types.h>
+#include  <stdint.h>
 
 #include  "queue.h"
 
@@ -19,30 +20,68 @@
  * buffering.
  *
  * A charq is actually a deque, but only queue operations are provided.
+ *
+ * Most ents are blocks owned by the charq that data is copied into, but an ent
+ * can also refer to someone else's buffer (see cq_append_ref), which must not
+ * change until the charq calls its release function.  cq_write sends every
+ * ent with one writev, so referenced data is never copied at all.
+ *
+ * Blocks come in a few sizes, so a short reply doesn't need a whole
+ * CHARQ_BSZ.  Drained blocks go back to a free list kept by each thread, and
+ * are handed out again without being zeroed, so an idle client holds no
+ * blocks at all and a busy one rarely calls malloc.
  */
 
 #define CHARQ_BSZ 16384
 
+/* Size classes, the last is CHARQ_BSZ.  Class 0 is for ents that refer to
+ * someone else's buffer, and have no data of their own. */
+#define CHARQ_NCLASSES  5
+
+/* Most bytes of blocks of each class a thread keeps for reuse. */
+#define CHARQ_POOLMAX (256 * 1024)
+
+/* Don't bother referring to anything shorter than this, just copy it. */
+#define CHARQ_MINREF  512
+
+typedef void (*charq_release_t)(void *);
+
 typedef struct charq_ent {
   TAILQ_ENTRY(charq_ent)  cqe_list;
-  char      cqe_data[CHARQ_BSZ];
+  char      *cqe_start; /* First byte not yet removed */
+  char      *cqe_end; /* End of the data */
+  charq_release_t    cqe_release;  /* NULL if this ent owns cqe_data */
+  void      *cqe_opaque;
+  unsigned     cqe_class;
+  size_t       cqe_size;  /* Size of cqe_data */
+  char      cqe_data[];
 } charq_ent_t;
 
 typedef TAILQ_HEAD(charq_ent_list, charq_ent) charq_ent_list_t;
 
 typedef struct charq {
   size_t     cq_len;  /* Amount of data in q */
-  size_t     cq_offs; /* Unused space in the first ent */
   charq_ent_list_t cq_ents; /* List of ents */
+  size_t     cq_scanned;  /* Bytes at the start known to have no newline */
+  char      *cq_line; /* Line returned by cq_line, or NULL */
+  size_t     cq_linelen;  /* Its length including the newline */
+  char      *cq_linebuf;  /* For lines that span ents */
+  size_t     cq_linebufsz;
 } charq_t;
 
 #define cq_len(cq)    ((cq)->cq_len)
-#define cq_used(cq)   ((cq)->cq_len + (cq)->cq_offs)
-#define cq_nents(cq)    (TAILQ_EMPTY(&cq->cq_ents) ? 0 : ((cq_used(cq) + CHARQ_BSZ - 1) / CHARQ_BSZ))
-#define cq_left(cq)   (cq_nents(cq) * CHARQ_BSZ - cq_used(cq))
 #define cq_first_ent(cq)  (TAILQ_FIRST(&(cq)->cq_ents))
 #define cq_last_ent(cq)   (TAILQ_LAST(&(cq)->cq_ents, charq_ent_list))
-#define cq_last_ent_free(cq)  (cq_last_ent(cq)->cqe_data + (CHARQ_BSZ - cq_left(cq)))
+#define cqe_len(cqe)    ((size_t) ((cqe)->cqe_end - (cqe)->cqe_start))
+#define cqe_left(cqe)   ((cqe)->cqe_release ? 0 : \
+          (size_t) ((cqe)->cqe_data + (cqe)->cqe_size - (cqe)->cqe_end))
+
+/* Pool counters for the calling thread. */
+typedef struct charq_stats {
+  uint64_t   cqs_hits;  /* Blocks reused from the pool */
+  uint64_t   cqs_misses;  /* Blocks that had to be allocated */
+  size_t     cqs_resident;  /* Bytes of blocks in the pool now */
+} charq_stats_t;
 
 void   cq_init(void);
 
@@ -53,9 +92,19 @@ ssize_t  cq_write(charq_t *, int);
 ssize_t  cq_read(charq_t *, int);
 
 void   cq_append(charq_t *, char const *, size_t);
+void   cq_append_ref(charq_t *, char const *, size_t, charq_release_t, void *);
 void   cq_remove_start(charq_t *, size_t);
 void   cq_extract_start(charq_t *, void *buf, size_t);
 
-char   *cq_read_line(charq_t *);
+/*
+ * cq_line returns the first line, without its line ending, or NULL if there
+ * isn't a whole one yet.  It's usually terminated in place rather than
+ * copied, so it's only valid until cq_line_done removes it, and nothing else
+ * may be done to the charq until then.
+ */
+char   *cq_line(charq_t *);
+void   cq_line_done(charq_t *);
+
+void   cq_stats(charq_stats_t *);
 
 #endif  /* !NTS_CHARQ_H */
@@ -0,0 +1,151 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that command lines are found however they arrive, including lines
+// that span blocks, end exactly at the end of one, or are in data the charq
+// doesn't own. Run with `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "charq.h"
+
+static int failures;
+static int released;
+
+void * xmalloc(size_t size)
+{
+    return g_malloc(size);
+}
+
+void * xcalloc(size_t n, size_t size)
+{
+    return g_malloc0_n(n, size);
+}
+
+static void check(bool passed, const char *what)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// The next line should be want, or there shouldn't be one if want is NULL.
+static void check_line(charq_t *cq, const char *want, const char *what)
+{
+    char *line = cq_line(cq);
+
+    if (want == NULL) {
+        check(line == NULL, what);
+        return;
+    }
+
+    check(line && strcmp(line, want) == 0, what);
+
+    cq_line_done(cq);
+}
+
+static void test_release(void *opaque)
+{
+    released++;
+}
+
+int main(int argc, char **argv)
+{
+    charq_t *cq = cq_new();
+    char *text = g_strnfill(CHARQ_BSZ, 'x');
+    char *copy;
+    char *ref;
+    char *want;
+    size_t size;
+
+    // One line, in one piece.
+    cq_append(cq, "MODE READER\r\n", 13);
+    check_line(cq, "MODE READER", "a whole line is found");
+    check_line(cq, NULL, "there's nothing after it");
+    check(cq_len(cq) == 0, "the line is removed");
+
+    // A line that arrives a few bytes at a time, the carriage return on its
+    // own at the end.
+    cq_append(cq, "ARTI", 4);
+    check_line(cq, NULL, "a partial line isn't found");
+    cq_append(cq, "CLE <a@b>\r", 10);
+    check_line(cq, NULL, "a line without its newline isn't found");
+    cq_append(cq, "\n", 1);
+    check_line(cq, "ARTICLE <a@b>", "a line in pieces is found");
+
+    // Pipelined commands, and empty lines with and without a carriage return.
+    cq_append(cq, "GROUP a\r\nXOVER 1-2\r\n\r\n\nQUIT\r", 27);
+    check_line(cq, "GROUP a", "the first pipelined line is found");
+    check_line(cq, "XOVER 1-2", "the second pipelined line is found");
+    check_line(cq, "", "an empty line is found");
+    check_line(cq, "", "an empty line without a carriage return is found");
+    check_line(cq, NULL, "the last line isn't finished");
+    cq_append(cq, "\n", 1);
+    check_line(cq, "QUIT", "the last line is found");
+
+    // A line that fills the first block exactly...
+    cq_append(cq, text, 100);
+    size = cqe_left(cq_first_ent(cq));
+    cq_append(cq, text, size - 2);
+    cq_append(cq, "\r\nNEXT\r\n", 8);
+
+    check(TAILQ_NEXT(cq_first_ent(cq), cqe_list) != NULL, "the next line is in another block");
+
+    want = g_strndup(text, 100 + size - 2);
+    check_line(cq, want, "a line at the end of a block is found");
+    check_line(cq, "NEXT", "the line in the next block is found");
+    g_free(want);
+
+    // ...one with just the newline in the next block...
+    cq_append(cq, text, 100);
+    size = cqe_left(cq_first_ent(cq));
+    cq_append(cq, text, size - 1);
+    cq_append(cq, "\r\nNEXT\r\n", 8);
+
+    want = g_strndup(text, 100 + size - 1);
+    check_line(cq, want, "a line with its newline in the next block is found");
+    check_line(cq, "NEXT", "the line after the split newline is found");
+    g_free(want);
+
+    // ...and one that's mostly in the next block.
+    cq_append(cq, text, 100);
+    size = cqe_left(cq_first_ent(cq));
+    cq_append(cq, text, size + 1000);
+    cq_append(cq, "\r\n", 2);
+
+    want = g_strndup(text, 100 + size + 1000);
+    check_line(cq, want, "a line that spans blocks is found");
+    g_free(want);
+
+    check(cq_len(cq) == 0, "every line has been removed");
+
+    // Data that's referred to, not copied, mustn't be changed, and is only
+    // released when the last of it has been removed.
+    ref  = g_strdup_printf("%.*s\r\nREF\r\n", CHARQ_MINREF, text);
+    copy = g_strdup(ref);
+
+    cq_append(cq, "BEFORE ", 7);
+    cq_append_ref(cq, ref, strlen(ref), test_release, NULL);
+
+    want = g_strdup_printf("BEFORE %.*s", CHARQ_MINREF, text);
+    check_line(cq, want, "a line that ends in referred data is found");
+    check_line(cq, "REF", "a line in referred data is found");
+    check_line(cq, NULL, "there's nothing after the referred data");
+    g_free(want);
+
+    check(strcmp(ref, copy) == 0, "referred data isn't changed");
+    check(released == 1, "referred data is released once it's removed");
+
+    cq_free(cq);
+    g_free(copy);
+    g_free(ref);
+    g_free(text);
+
+    return failures != 0;
+}
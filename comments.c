@@ -1,12 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <json.h>
 #include <glib.h>
 
 #include "jsonutil.h"
+#include "newsrc.h"
 #include "reddit.h"
 
 int reddit_parse_listing(json_object *listing, json_object *props, json_object *newsrc);
@@ -103,7 +105,7 @@ unsigned str_count_newlines(const char *string)
 }
 
 // Parse the comment object specified, and return a news message
-int reddit_parse_comment(json_object *spool, json_object *comment, char **headers, char **body)
+int reddit_parse_comment(spool_t *spool, json_object *comment, char **headers, char **body)
 {
     json_object *data;
     json_object *created;
@@ -168,7 +170,7 @@ int reddit_parse_comment(json_object *spool, json_object *comment, char **header
             "Content-Type: text/plain; charset=UTF-8\r\n"
             "X-Reddit-URL: https://www.reddit.com%s\r\n",
             json_object_get_string_prop(data, "author"),
-            json_object_get_string_prop(data, "title"),
+            reddit_spool_title(spool, data),
             str_count_newlines(*body),
             date,
             json_object_get_string_prop(data, "name"),
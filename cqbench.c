@@ -0,0 +1,134 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Compare the line scanner with the one it replaced, parsing pipelined
+// commands as they'd arrive from a busy newsreader. Build with `make cqbench`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "charq.h"
+
+// How many commands a newsreader sends before it waits for the replies.
+#define BENCH_PIPELINE 500
+
+#define BENCH_ROUNDS 2000
+
+// Commands usually arrive split across a few reads.
+#define BENCH_READ 1460
+
+void * xmalloc(size_t size)
+{
+    return g_malloc(size);
+}
+
+void * xcalloc(size_t n, size_t size)
+{
+    return g_malloc0_n(n, size);
+}
+
+static ssize_t legacy_find(charq_t *cq, char c)
+{
+    charq_ent_t *e;
+    size_t i = 0;
+
+    TAILQ_FOREACH(e, &cq->cq_ents, cqe_list) {
+        for (char *p = e->cqe_start; p < e->cqe_end; p++, i++) {
+            if (*p == c)
+                return i;
+        }
+    }
+
+    return -1;
+}
+
+static char * legacy_read_line(charq_t *cq)
+{
+    ssize_t pos;
+    char *line;
+
+    if ((pos = legacy_find(cq, '\n')) == -1)
+        return NULL;
+
+    pos++;
+    line = xmalloc(pos + 1);
+
+    cq_extract_start(cq, line, pos);
+
+    line[pos - 1] = 0;
+    if (pos > 1 && line[pos - 2] == '\r')
+        line[pos - 2] = 0;
+    return line;
+}
+
+static double elapsed(gint64 start)
+{
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    GString *batch = g_string_new(NULL);
+    uint64_t legacy = 0;
+    uint64_t check = 0;
+    charq_t *cq = cq_new();
+    gint64 start;
+    double ms;
+
+    // What slrn sends when it opens a thread.
+    for (int i = 0; i < BENCH_PIPELINE; i++) {
+        if (i % 3)
+            g_string_append_printf(batch, "HEAD %d\r\n", 120000 + i);
+        else
+            g_string_append_printf(batch, "ARTICLE <t1_%x@reddit>\r\n", 0x6d5a1b0 + i);
+    }
+
+    start = g_get_monotonic_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t off = 0; off < batch->len; off += BENCH_READ) {
+            char *line;
+
+            cq_append(cq, batch->str + off, MIN(BENCH_READ, batch->len - off));
+
+            while ((line = legacy_read_line(cq))) {
+                legacy += line[0];
+                g_free(line);
+            }
+        }
+    }
+    ms = elapsed(start);
+    printf("parse, legacy:  %8.2f ms, %6.2f M lines/s\n",
+           ms, BENCH_PIPELINE * BENCH_ROUNDS / ms / 1000);
+
+    start = g_get_monotonic_time();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t off = 0; off < batch->len; off += BENCH_READ) {
+            char *line;
+
+            cq_append(cq, batch->str + off, MIN(BENCH_READ, batch->len - off));
+
+            while ((line = cq_line(cq))) {
+                check += line[0];
+                cq_line_done(cq);
+            }
+        }
+    }
+    ms = elapsed(start);
+    printf("parse, memchr:  %8.2f ms, %6.2f M lines/s\n",
+           ms, BENCH_PIPELINE * BENCH_ROUNDS / ms / 1000);
+
+    cq_free(cq);
+    g_string_free(batch, true);
+
+    // The old and new versions should agree.
+    if (check != legacy) {
+        fprintf(stderr, "%s: results didn't match\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -2,19 +2,202 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include <curl/curl.h>
+#include <ev.h>
 #include <json.h>
 #include <glib.h>
 
 #include "json_object.h"
+#include "jsonutil.h"
+#include "jsonstream.h"
+#include "newsrc.h"
 #include "reddit.h"
+#include "fetch.h"
 
 struct MemoryStruct {
   char *memory;
   size_t size;
 };
 
+// How many connections to keep open to each host, more than one request can
+// use each connection if the server speaks HTTP/2.
+#define FETCH_MAX_HOST_CONNECTIONS 4
+
+// How many idle easy handles to keep for reuse.
+#define FETCH_MAX_IDLE_HANDLES 32
+
+// Requests per second we allow ourselves, and how many can be made in a burst
+// after being idle. If reddit tells us its limits we use those when lower.
+#define FETCH_RATE 1.0
+#define FETCH_BURST 10.0
+
+// The most comments reddit will expand in one morechildren request.
+#define FETCH_MORE_BATCH 100
+
+// The most morechildren requests we make for a thread each time it's fetched.
+#define FETCH_MORE_REQUESTS 10
+
+// How long to wait after a 429 if reddit didn't say.
+#define FETCH_THROTTLE_DELAY 60.0
+
+// How many urls to keep validators for, every comment thread has its own.
+#define FETCH_MAX_CACHED 8192
+
+// Requests are queued by priority until the rate limiter lets them go.
+enum {
+    FETCH_CLASS_LISTING,
+    FETCH_CLASS_COMMENTS,
+    FETCH_CLASS_BACKGROUND_LISTING,
+    FETCH_CLASS_BACKGROUND_COMMENTS,
+    FETCH_CLASSES,
+};
+
+struct fetcher {
+    struct ev_loop  *loop;
+    CURLM           *multi;
+    ev_timer         timeout;
+    ev_timer         throttle;  // Try the queues again when this fires.
+    GHashTable      *sockets;   // Socket => fetchsock_t
+    GHashTable      *requests;  // Set of outstanding request_t
+    GQueue          *idle;      // Easy handles ready for reuse.
+    GQueue          *queued[FETCH_CLASSES];
+    ev_async         wakeup;    // Another thread put something in the inbox.
+    GQueue          *inbox;     // Results of requests we joined.
+    pthread_mutex_t  inboxlock;
+    bool             closing;   // Being freed, so no new requests.
+};
+
+// If a url is already being fetched, anyone else who wants it waits for that
+// request to finish instead of making their own. That might be on another
+// thread, so results are passed back through the waiter's inbox.
+typedef struct waiter {
+    fetcher_t       *fetcher;
+    fetch_cb_t       callback;
+    void            *opaque;
+} waiter_t;
+
+typedef struct delivery {
+    fetch_cb_t       callback;
+    void            *opaque;
+    char            *url;
+    int              status;
+    GBytes          *body;
+} delivery_t;
+
+static GHashTable *inflight;    // url => GPtrArray of waiter_t
+static pthread_mutex_t flightlock = PTHREAD_MUTEX_INITIALIZER;
+
+// One token bucket is shared by every fetcher, reddit limits all of us
+// together.
+static struct {
+    double      rate;       // Tokens added per second.
+    double      tokens;
+    double      updated;    // When tokens was last refilled.
+    double      blocked;    // Nothing is sent until this time.
+    unsigned    waiting[FETCH_CLASSES];
+    uint64_t    dispatched;
+    uint64_t    throttled;
+    double      waited;     // Total seconds requests spent queued.
+    double      maxwait;
+    uint64_t    joined;
+} bucket = {
+    .rate       = FETCH_RATE,
+    .tokens     = FETCH_BURST,
+};
+
+static pthread_mutex_t bucketlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Where every url is fetched from, only changed by the tests.
+static const char *site = "https://www.reddit.com";
+
+// The DNS and TLS session caches are shared by every fetcher, each fetcher
+// keeps its own connections in its multi handle.
+static CURLSH *share;
+static pthread_mutex_t sharelocks[CURL_LOCK_DATA_LAST];
+
+// The validators from the last response to each url, so we can ask reddit
+// to only send it again if it changed.
+typedef struct cached {
+    GList            link;      // In cachelru, link.data points here.
+    char            *url;       // The key in cache, which frees it.
+    char            *etag;
+    char            *lastmod;
+    GBytes          *body;      // Only kept if FETCH_KEEP was used.
+} cached_t;
+
+static GHashTable *cache;       // url => cached_t
+static GQueue cachelru = G_QUEUE_INIT; // Least recently used first.
+static fetchstats_t stats;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct fetchsock {
+    fetcher_t       *fetcher;
+    ev_io            watcher;
+} fetchsock_t;
+
+typedef struct request {
+    CURL            *easy;
+    char            *url;
+    unsigned         flags;
+    int              class;
+    double           queued;    // When the request was made.
+    double           remaining; // X-Ratelimit-Remaining, or -1.
+    double           reset;     // X-Ratelimit-Reset, or -1.
+    char            *etag;
+    char            *lastmod;
+    struct curl_slist *headers;
+    struct MemoryStruct chunk;
+    jsonstream_t    *stream;    // Instead of chunk, if the things are wanted.
+    size_t           streamed;  // Bytes fed to the stream.
+    fetch_cb_t       callback;
+    void            *opaque;
+} request_t;
+
+// A refresh fetches a listing, and then the comments of every story that has
+// changed. It completes when the last of those requests does.
+struct refresh {
+    fetcher_t       *fetcher;
+    spool_t         *spool;
+    newsrc_t        *newsrc;
+    char            *group;
+    char            *url;
+    json_object     *listing;
+    int              pending;   // Requests still outstanding.
+    int              result;
+    unsigned         flags;     // Flags for every fetch_url().
+    GHashTable      *failed;    // Stories we missed comments for => num_comments we knew.
+    unsigned         churn;     // New comments seen in the listing.
+    char            *after;     // Cursor for the next page of the listing.
+    time_t           oldest;    // When the oldest story in the listing was posted.
+    bool             unchanged; // The listing was not modified.
+    refresh_cb_t     callback;
+    void            *opaque;
+};
+
+// A comment thread being fetched as part of a refresh.
+typedef struct story {
+    refresh_t       *refresh;
+    char            *id;
+    int              known;     // How many comments we knew about before.
+} story_t;
+
+// Comments that reddit left out of a thread are fetched in the background
+// after it, a batch at a time.
+typedef struct expand {
+    fetcher_t       *fetcher;
+    spool_t         *spool;
+    newsrc_t        *newsrc;
+    char            *group;
+    char            *linkid;
+    char            *batch;     // The ids being fetched now.
+    int              requests;  // How many we've made so far.
+} expand_t;
+
 static size_t
 WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
 {
@@ -36,218 +219,1403 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
   return realsize;
 }
 
-int fetch_subreddit_json(json_object *spool, json_object *newsrc, const char *group)
+// Things are picked out of the response as it arrives, so it never has to be
+// held all at once.
+static size_t fetch_stream_cb(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    request_t *request = userp;
+    size_t realsize = size * nmemb;
+    long status = 0;
+
+    curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &status);
+
+    // Error pages aren't worth parsing.
+    if (status != 200)
+        return realsize;
+
+    request->streamed += realsize;
+
+    if (jsonstream_feed(request->stream, contents, realsize) != 0) {
+        g_warning("failed to parse the response from %s", request->url);
+        return 0;
+    }
+
+    return realsize;
+}
+
+static void fetch_cached_free(cached_t *cached)
 {
-  CURL *curl_handle;
-  json_object *subreddit;
-  json_tokener *tokener;
-  CURLcode res;
-  char *url;
+    g_queue_unlink(&cachelru, &cached->link);
 
-  struct MemoryStruct chunk;
+    if (cached->body)
+        g_bytes_unref(cached->body);
 
-  chunk.memory = malloc(1);  /* will be grown as needed by the realloc above */ 
-  chunk.size = 0;    /* no data at this point */ 
+    g_free(cached->etag);
+    g_free(cached->lastmod);
+    g_free(cached);
+}
 
-  curl_global_init(CURL_GLOBAL_ALL);
+// Send the validators we have for this url, if any.
+static void fetch_cache_prepare(request_t *request)
+{
+    cached_t *cached;
 
-  /* init the curl session */ 
-  curl_handle = curl_easy_init();
+    pthread_mutex_lock(&cachelock);
 
-  url = g_strdup_printf("https://www.reddit.com/r/%s.json", group);
+    if ((cached = g_hash_table_lookup(cache, request->url))) {
+        char *header;
 
-  /* specify URL to get */ 
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+        g_queue_unlink(&cachelru, &cached->link);
+        g_queue_push_tail_link(&cachelru, &cached->link);
 
-  /* send all data to this function  */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        if (cached->etag) {
+            header = g_strdup_printf("If-None-Match: %s", cached->etag);
+            request->headers = curl_slist_append(request->headers, header);
+            g_free(header);
+        }
 
-  /* we pass our 'chunk' struct to the callback function */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+        if (cached->lastmod) {
+            header = g_strdup_printf("If-Modified-Since: %s", cached->lastmod);
+            request->headers = curl_slist_append(request->headers, header);
+            g_free(header);
+        }
+    }
 
-  /* some servers don't like requests that are made without a user-agent
-     field, so we provide one */ 
-  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "nntpit/1.0");
+    pthread_mutex_unlock(&cachelock);
+}
 
-  /* get it! */ 
-  res = curl_easy_perform(curl_handle);
+// Remember the validators from a complete response, and forget the least
+// recently used if there are too many.
+static void fetch_cache_store(request_t *request)
+{
+    cached_t *cached;
 
-  /* check for errors */ 
-  if (res != CURLE_OK) {
-    g_warning("curl_easy_perform() failed: %s", curl_easy_strerror(res));
-  } else {
-    g_debug("%lu bytes retrieved, %.8s...", chunk.size, chunk.memory);
+    pthread_mutex_lock(&cachelock);
 
-    // The JSON_TOKENER_DEFAULT_DEPTH is too shallow for reddit, let's
-    // try doubling it. See https://github.com/taviso/nntpit/issues/7
-    tokener   = json_tokener_new_ex(64);
-    subreddit = NULL;
+    if (request->etag == NULL && request->lastmod == NULL) {
+        g_hash_table_remove(cache, request->url);
+        pthread_mutex_unlock(&cachelock);
+        return;
+    }
 
-    if (tokener) {
-        subreddit = json_tokener_parse_ex(tokener, chunk.memory, chunk.size);
+    cached          = g_new0(cached_t, 1);
+    cached->url     = g_strdup(request->url);
+    cached->etag    = g_strdup(request->etag);
+    cached->lastmod = g_strdup(request->lastmod);
+
+    if (request->flags & FETCH_KEEP) {
+        cached->body = g_bytes_new(request->chunk.memory, request->chunk.size);
     }
 
-    if (subreddit != NULL) {
-        json_object *data;
-        json_object *children;
+    cached->link.data = cached;
+
+    g_hash_table_replace(cache, cached->url, cached);
+    g_queue_push_tail_link(&cachelru, &cached->link);
+
+    while (cachelru.length > FETCH_MAX_CACHED) {
+        cached_t *oldest = g_queue_peek_head(&cachelru);
+
+        g_hash_table_remove(cache, oldest->url);
+    }
+
+    pthread_mutex_unlock(&cachelock);
+}
 
-        g_warn_if_fail(reddit_object_type(subreddit) == REDDIT_OBJ_LISTING);
-        // The question is, are there any new comments we don't know about?
+// Return the body we kept for a url that wasn't modified, or NULL.
+static GBytes * fetch_cache_body(const char *url)
+{
+    cached_t *cached;
+    GBytes *body = NULL;
+
+    pthread_mutex_lock(&cachelock);
+
+    if ((cached = g_hash_table_lookup(cache, url)) && cached->body) {
+        body = g_bytes_ref(cached->body);
+    }
 
-        // For every object we just fetched, compare the number of comments to
-        // the number of comments we already knew about.
-        if (!json_object_object_get_ex(subreddit, "data", &children)) {
-            g_warning("no data was found in the listing object");
-            goto parseerror;
+    pthread_mutex_unlock(&cachelock);
+    return body;
+}
+
+// Make sure the next fetch of url gets a full response.
+void fetch_forget(const char *url)
+{
+    pthread_mutex_lock(&cachelock);
+    g_hash_table_remove(cache, url);
+    pthread_mutex_unlock(&cachelock);
+}
+
+void fetch_stats(fetchstats_t *result)
+{
+    pthread_mutex_lock(&cachelock);
+    *result = stats;
+    pthread_mutex_unlock(&cachelock);
+
+    pthread_mutex_lock(&bucketlock);
+
+    result->queued = 0;
+
+    for (int i = 0; i < FETCH_CLASSES; i++) {
+        result->queued += bucket.waiting[i];
+    }
+
+    result->dispatched = bucket.dispatched;
+    result->throttled  = bucket.throttled;
+    result->waited     = bucket.waited;
+    result->maxwait    = bucket.maxwait;
+    result->joined     = bucket.joined;
+
+    pthread_mutex_unlock(&bucketlock);
+}
+
+static void fetch_bucket_refill(double now)
+{
+    bucket.tokens  = MIN(FETCH_BURST, bucket.tokens + (now - bucket.updated) * bucket.rate);
+    bucket.updated = now;
+}
+
+// Take a token for a request of this class, unless it has to wait.
+static bool fetch_bucket_take(int class, double queued)
+{
+    double now = ev_time();
+    bool granted = false;
+
+    pthread_mutex_lock(&bucketlock);
+
+    fetch_bucket_refill(now);
+
+    if (now >= bucket.blocked && bucket.tokens >= 1.0) {
+        granted = true;
+
+        // Anything more important waiting elsewhere goes first.
+        for (int i = 0; i < class; i++) {
+            if (bucket.waiting[i])
+                granted = false;
         }
+    }
+
+    if (granted) {
+        bucket.tokens -= 1.0;
+        bucket.waiting[class]--;
+        bucket.dispatched++;
+        bucket.waited  += now - queued;
+        bucket.maxwait  = MAX(bucket.maxwait, now - queued);
+    }
+
+    pthread_mutex_unlock(&bucketlock);
+    return granted;
+}
+
+// How long until it's worth trying again.
+static double fetch_bucket_delay(void)
+{
+    double now = ev_time();
+    double delay;
 
-        if (!json_object_object_get_ex(children, "children", &children)) {
-            g_warning("no child objects found in the listing");
-            goto parseerror;
+    pthread_mutex_lock(&bucketlock);
+
+    fetch_bucket_refill(now);
+
+    delay = MAX(bucket.blocked - now, (1.0 - bucket.tokens) / bucket.rate);
+
+    pthread_mutex_unlock(&bucketlock);
+
+    return MAX(delay, 1.0 / FETCH_RATE / 10);
+}
+
+// Adjust to what reddit says we're allowed.
+static void fetch_bucket_update(request_t *request, long status)
+{
+    double now = ev_time();
+
+    pthread_mutex_lock(&bucketlock);
+
+    if (request->remaining >= 0 && request->reset >= 0) {
+        // Spread what's left over the rest of the period.
+        bucket.rate = MIN(FETCH_RATE, request->remaining / MAX(request->reset, 1.0));
+        bucket.rate = MAX(bucket.rate, 1.0 / FETCH_THROTTLE_DELAY);
+
+        if (request->remaining < 1.0) {
+            bucket.blocked = MAX(bucket.blocked, now + request->reset);
         }
+    }
+
+    if (status == 429) {
+        g_warning("reddit is rate limiting us, backing off");
+        bucket.throttled++;
+        bucket.tokens  = 0;
+        bucket.blocked = MAX(bucket.blocked,
+                             now + (request->reset > 0 ? request->reset : FETCH_THROTTLE_DELAY));
+    }
+
+    pthread_mutex_unlock(&bucketlock);
+}
+
+static size_t fetch_header_cb(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    request_t *request = userp;
+    size_t len = size * nitems;
+    char **value = NULL;
+
+    if (len > 5 && g_ascii_strncasecmp(buffer, "ETag:", 5) == 0) {
+        value   = &request->etag;
+        buffer += 5;
+        len    -= 5;
+    } else if (len > 14 && g_ascii_strncasecmp(buffer, "Last-Modified:", 14) == 0) {
+        value   = &request->lastmod;
+        buffer += 14;
+        len    -= 14;
+    } else if (len > 22 && g_ascii_strncasecmp(buffer, "X-Ratelimit-Remaining:", 22) == 0) {
+        request->remaining = g_ascii_strtod(buffer + 22, NULL);
+    } else if (len > 18 && g_ascii_strncasecmp(buffer, "X-Ratelimit-Reset:", 18) == 0) {
+        request->reset = g_ascii_strtod(buffer + 18, NULL);
+    }
+
+    if (value) {
+        g_free(*value);
+        *value = g_strstrip(g_strndup(buffer, len));
+    }
 
-        if (!json_object_is_type(children, json_type_array)) {
-            g_info("expecting children to be an array of objects");
-            goto parseerror;
+    return size * nitems;
+}
+
+static void fetch_share_lock(CURL *easy, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    pthread_mutex_lock(&sharelocks[data]);
+}
+
+static void fetch_share_unlock(CURL *easy, curl_lock_data data, void *userp)
+{
+    pthread_mutex_unlock(&sharelocks[data]);
+}
+
+// Fetch from somewhere that isn't reddit, before any threads are started.
+void fetch_set_site(const char *url)
+{
+    site = url;
+}
+
+// Must be called once before any threads are started.
+int fetch_global_init(void)
+{
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+        g_warning("failed to initialize libcurl");
+        return -1;
+    }
+
+    cache = g_hash_table_new_full(g_str_hash,
+                                  g_str_equal,
+                                  g_free,
+                                  (GDestroyNotify) fetch_cached_free);
+    inflight = g_hash_table_new_full(g_str_hash,
+                                     g_str_equal,
+                                     g_free,
+                                     (GDestroyNotify) g_ptr_array_unref);
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(&sharelocks[i], NULL);
+    }
+
+    // If this fails we just don't share anything.
+    if ((share = curl_share_init()) != NULL) {
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, fetch_share_lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, fetch_share_unlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    return 0;
+}
+
+void fetch_global_cleanup(void)
+{
+    curl_share_cleanup(share);
+    curl_global_cleanup();
+    g_hash_table_destroy(cache);
+    g_hash_table_destroy(inflight);
+    share    = NULL;
+    cache    = NULL;
+    inflight = NULL;
+}
+
+// Get a handle for a new request, reusing an idle one if we can.
+static CURL * fetch_easy_get(fetcher_t *fetcher)
+{
+    CURL *easy = g_queue_pop_head(fetcher->idle);
+
+    if (easy == NULL && (easy = curl_easy_init()) == NULL)
+        return NULL;
+
+    // Some servers don't like requests that are made without a user-agent
+    // field, so we provide one.
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, "nntpit/1.0");
+
+    // There are multiple threads, so signals can't be used for timeouts.
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+
+    // Use HTTP/2 where the server supports it, and prefer waiting for an
+    // existing connection to multiplex over opening another one.
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+
+    // Stop idle connections being dropped by anything in between.
+    curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    // Accept any compression curl supports, the listings compress well.
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+
+    if (share) {
+        curl_easy_setopt(easy, CURLOPT_SHARE, share);
+    }
+
+    return easy;
+}
+
+// Options are reset, but connections stay in the multi handle's cache.
+static void fetch_easy_put(fetcher_t *fetcher, CURL *easy)
+{
+    if (g_queue_get_length(fetcher->idle) >= FETCH_MAX_IDLE_HANDLES) {
+        curl_easy_cleanup(easy);
+        return;
+    }
+
+    curl_easy_reset(easy);
+    g_queue_push_head(fetcher->idle, easy);
+}
+
+static void fetch_request_free(fetcher_t *fetcher, request_t *request)
+{
+    fetch_easy_put(fetcher, request->easy);
+    curl_slist_free_all(request->headers);
+    free(request->chunk.memory);
+    jsonstream_free(request->stream);
+    g_free(request->etag);
+    g_free(request->lastmod);
+    g_free(request->url);
+    g_free(request);
+}
+
+static void fetch_delivery_free(delivery_t *delivery)
+{
+    if (delivery->body)
+        g_bytes_unref(delivery->body);
+
+    g_free(delivery->url);
+    g_free(delivery);
+}
+
+// Wait for a request for url that's already in progress, if there is one.
+static bool fetch_flight_join(fetcher_t *fetcher, const char *url, fetch_cb_t callback, void *opaque)
+{
+    GPtrArray *waiters;
+    waiter_t *waiter;
+
+    pthread_mutex_lock(&flightlock);
+
+    if ((waiters = g_hash_table_lookup(inflight, url)) == NULL) {
+        // We're the first, so anyone else can wait for us.
+        g_hash_table_insert(inflight, g_strdup(url), g_ptr_array_new_with_free_func(g_free));
+        pthread_mutex_unlock(&flightlock);
+        return false;
+    }
+
+    waiter           = g_new0(waiter_t, 1);
+    waiter->fetcher  = fetcher;
+    waiter->callback = callback;
+    waiter->opaque   = opaque;
+
+    g_ptr_array_add(waiters, waiter);
+
+    pthread_mutex_unlock(&flightlock);
+
+    pthread_mutex_lock(&bucketlock);
+    bucket.joined++;
+    pthread_mutex_unlock(&bucketlock);
+
+    g_debug("joined a request for %s already in progress", url);
+    return true;
+}
+
+// The request for url has finished, give everyone waiting for it a copy.
+static void fetch_flight_land(const char *url, int status, const char *data, size_t len)
+{
+    GPtrArray *waiters;
+    char *key;
+
+    pthread_mutex_lock(&flightlock);
+
+    if (!g_hash_table_lookup_extended(inflight, url, (gpointer *) &key, (gpointer *) &waiters)) {
+        pthread_mutex_unlock(&flightlock);
+        return;
+    }
+
+    g_hash_table_steal(inflight, url);
+
+    // The lock stays held so that no waiting fetcher can be freed.
+    for (guint i = 0; i < waiters->len; i++) {
+        waiter_t *waiter = g_ptr_array_index(waiters, i);
+        fetcher_t *fetcher = waiter->fetcher;
+        delivery_t *delivery = g_new0(delivery_t, 1);
+
+        delivery->callback = waiter->callback;
+        delivery->opaque   = waiter->opaque;
+        delivery->url      = g_strdup(url);
+        delivery->status   = status;
+        delivery->body     = data ? g_bytes_new(data, len) : NULL;
+
+        pthread_mutex_lock(&fetcher->inboxlock);
+        g_queue_push_tail(fetcher->inbox, delivery);
+        pthread_mutex_unlock(&fetcher->inboxlock);
+
+        ev_async_send(fetcher->loop, &fetcher->wakeup);
+    }
+
+    pthread_mutex_unlock(&flightlock);
+
+    g_ptr_array_unref(waiters);
+    g_free(key);
+}
+
+static void fetch_inbox_event(struct ev_loop *loop, ev_async *w, int revents)
+{
+    fetcher_t *fetcher = w->data;
+    delivery_t *delivery;
+    GQueue inbox;
+
+    // Take everything at once, the callbacks might add more.
+    pthread_mutex_lock(&fetcher->inboxlock);
+    inbox = *fetcher->inbox;
+    g_queue_init(fetcher->inbox);
+    pthread_mutex_unlock(&fetcher->inboxlock);
+
+    while ((delivery = g_queue_pop_head(&inbox))) {
+        delivery->callback(delivery->url,
+                           delivery->status,
+                           delivery->body ? g_bytes_get_data(delivery->body, NULL) : NULL,
+                           delivery->body ? g_bytes_get_size(delivery->body) : 0,
+                           delivery->opaque);
+        fetch_delivery_free(delivery);
+    }
+}
+
+// Call back whoever made the request, and anyone who joined it.
+static void fetch_request_finish(request_t *request, int status, const char *data, size_t len)
+{
+    fetch_flight_land(request->url, status, data, len);
+
+    request->callback(request->url, status, data, len, request->opaque);
+}
+
+static void fetch_socket_free(fetchsock_t *sock)
+{
+    ev_io_stop(sock->fetcher->loop, &sock->watcher);
+    g_free(sock);
+}
+
+// Hand every finished transfer to its callback.
+static void fetch_complete(fetcher_t *fetcher)
+{
+    CURLMsg *msg;
+    int remaining;
+
+    while ((msg = curl_multi_info_read(fetcher->multi, &remaining))) {
+        request_t *request;
+        CURLcode res;
+        GBytes *body;
+        curl_off_t received = 0;
+        long status = 0;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        // The message is invalid once the handle is removed.
+        res = msg->data.result;
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &request);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &received);
+        curl_multi_remove_handle(fetcher->multi, request->easy);
+        g_hash_table_remove(fetcher->requests, request);
+
+        fetch_bucket_update(request, status);
+
+        if (res != CURLE_OK) {
+            g_warning("fetching %s failed: %s", request->url, curl_easy_strerror(res));
+            fetch_request_finish(request, FETCH_FAILED, NULL, 0);
+        } else if (status == 304) {
+            g_debug("%s was not modified", request->url);
+
+            pthread_mutex_lock(&cachelock);
+            stats.hits++;
+            pthread_mutex_unlock(&cachelock);
+
+            if ((body = fetch_cache_body(request->url))) {
+                fetch_request_finish(request,
+                                     FETCH_NOT_MODIFIED,
+                                     g_bytes_get_data(body, NULL),
+                                     g_bytes_get_size(body));
+                g_bytes_unref(body);
+            } else {
+                fetch_request_finish(request, FETCH_NOT_MODIFIED, NULL, 0);
+            }
+        } else if (status >= 400) {
+            g_warning("fetching %s failed with http status %ld", request->url, status);
+            fetch_request_finish(request, FETCH_FAILED, NULL, 0);
+        } else if (request->stream) {
+            g_debug("%zu bytes streamed from %s", request->streamed, request->url);
+
+            pthread_mutex_lock(&cachelock);
+            stats.misses++;
+            stats.received += received;
+            stats.decoded  += request->streamed;
+            pthread_mutex_unlock(&cachelock);
+
+            // Whatever things we did get have been passed on, but don't
+            // let a truncated response be skipped next time.
+            if (jsonstream_finish(request->stream) != 0) {
+                g_warning("the response from %s was incomplete", request->url);
+                fetch_request_finish(request, FETCH_FAILED, NULL, 0);
+            } else {
+                fetch_cache_store(request);
+                fetch_request_finish(request, FETCH_OK, NULL, 0);
+            }
+        } else {
+            g_debug("%zu bytes retrieved, %.8s...", request->chunk.size, request->chunk.memory);
+
+            pthread_mutex_lock(&cachelock);
+            stats.misses++;
+            stats.received += received;
+            stats.decoded  += request->chunk.size;
+            pthread_mutex_unlock(&cachelock);
+
+            fetch_cache_store(request);
+
+            fetch_request_finish(request,
+                                 FETCH_OK,
+                                 request->chunk.memory,
+                                 request->chunk.size);
         }
 
-        for (size_t i = 0; i < json_object_array_length(children); i++) {
-            json_object *child = json_object_array_get_idx(children, i);
-            json_object *origdata;
-            json_object *newdata;
-            json_object *orig;
-            json_object *origcomments;
-            json_object *newcomments;
-
-            // Lookup if this id is in the spool
-            if (!reddit_spool_retrieve(spool, reddit_object_id(child), &orig)) {
-                // I don't know this article, so we definitely need it.
-                fetch_comments_json(spool, newsrc, group, reddit_object_id(child));
-                continue;
+        fetch_request_free(fetcher, request);
+    }
+}
+
+static void fetch_socket_event(struct ev_loop *loop, ev_io *w, int revents)
+{
+    fetcher_t *fetcher = w->data;
+    int action = 0;
+    int running;
+
+    if (revents & EV_READ)
+        action |= CURL_CSELECT_IN;
+    if (revents & EV_WRITE)
+        action |= CURL_CSELECT_OUT;
+
+    curl_multi_socket_action(fetcher->multi, w->fd, action, &running);
+
+    fetch_complete(fetcher);
+}
+
+static void fetch_timeout_event(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    fetcher_t *fetcher = w->data;
+    int running;
+
+    curl_multi_socket_action(fetcher->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+    fetch_complete(fetcher);
+}
+
+// Curl tells us which sockets it wants to wait on...
+static int fetch_socket_cb(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+    fetcher_t *fetcher = userp;
+    fetchsock_t *sock = g_hash_table_lookup(fetcher->sockets, GINT_TO_POINTER(fd));
+    int events = 0;
+
+    if (what == CURL_POLL_REMOVE) {
+        g_hash_table_remove(fetcher->sockets, GINT_TO_POINTER(fd));
+        return 0;
+    }
+
+    if (what & CURL_POLL_IN)
+        events |= EV_READ;
+    if (what & CURL_POLL_OUT)
+        events |= EV_WRITE;
+
+    if (sock == NULL) {
+        sock = g_new0(fetchsock_t, 1);
+        sock->fetcher = fetcher;
+        g_hash_table_insert(fetcher->sockets, GINT_TO_POINTER(fd), sock);
+    } else {
+        ev_io_stop(fetcher->loop, &sock->watcher);
+    }
+
+    ev_io_init(&sock->watcher, fetch_socket_event, fd, events);
+    sock->watcher.data = fetcher;
+    ev_io_start(fetcher->loop, &sock->watcher);
+    return 0;
+}
+
+// ...and when it next needs to be called if nothing happens on them.
+static int fetch_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+    fetcher_t *fetcher = userp;
+
+    ev_timer_stop(fetcher->loop, &fetcher->timeout);
+
+    if (timeout_ms >= 0) {
+        ev_timer_set(&fetcher->timeout, timeout_ms / 1000., 0.);
+        ev_timer_start(fetcher->loop, &fetcher->timeout);
+    }
+
+    return 0;
+}
+
+// Send as many queued requests as the rate limiter allows, most important
+// first, and come back later for the rest.
+static void fetch_dispatch(fetcher_t *fetcher)
+{
+    bool pending = false;
+
+    for (int class = 0; class < FETCH_CLASSES; class++) {
+        request_t *request;
+
+        while ((request = g_queue_peek_head(fetcher->queued[class]))) {
+            if (!fetch_bucket_take(class, request->queued)) {
+                pending = true;
+                break;
+            }
+
+            g_queue_pop_head(fetcher->queued[class]);
+
+            if (curl_multi_add_handle(fetcher->multi, request->easy) != CURLM_OK) {
+                g_warning("failed to add a request for %s", request->url);
+                g_hash_table_remove(fetcher->requests, request);
+                fetch_request_finish(request, FETCH_FAILED, NULL, 0);
+                fetch_request_free(fetcher, request);
             }
+        }
+    }
+
+    if (pending && !ev_is_active(&fetcher->throttle)) {
+        ev_timer_set(&fetcher->throttle, fetch_bucket_delay(), 0.);
+        ev_timer_start(fetcher->loop, &fetcher->throttle);
+    }
+}
+
+static void fetch_throttle_event(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    fetch_dispatch(w->data);
+}
+
+fetcher_t * fetcher_new(struct ev_loop *loop)
+{
+    fetcher_t *fetcher = g_new0(fetcher_t, 1);
+
+    if ((fetcher->multi = curl_multi_init()) == NULL) {
+        g_warning("failed to create a curl multi handle");
+        g_free(fetcher);
+        return NULL;
+    }
+
+    fetcher->loop     = loop;
+    fetcher->idle     = g_queue_new();
+    fetcher->requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+    fetcher->sockets  = g_hash_table_new_full(g_direct_hash,
+                                              g_direct_equal,
+                                              NULL,
+                                              (GDestroyNotify) fetch_socket_free);
+
+    for (int i = 0; i < FETCH_CLASSES; i++) {
+        fetcher->queued[i] = g_queue_new();
+    }
 
-            // Check if there are new comments since we last looked.
-            json_object_object_get_ex(child, "data", &newdata);
-            json_object_object_get_ex(orig, "data", &origdata);
-            json_object_object_get_ex(origdata, "num_comments", &origcomments);
-            json_object_object_get_ex(newdata, "num_comments", &newcomments);
+    ev_timer_init(&fetcher->timeout, fetch_timeout_event, 0., 0.);
+    fetcher->timeout.data = fetcher;
 
-            if (json_object_get_int(origcomments) < json_object_get_int(newcomments)) {
-                // There are new comments.
-                g_debug("story %s has %u vs %u known comments => re-fetch",
-                        reddit_object_id(child),
-                        json_object_get_int(origcomments),
-                        json_object_get_int(newcomments));
+    ev_timer_init(&fetcher->throttle, fetch_throttle_event, 0., 0.);
+    fetcher->throttle.data = fetcher;
+
+    fetcher->inbox = g_queue_new();
+    pthread_mutex_init(&fetcher->inboxlock, NULL);
+
+    ev_async_init(&fetcher->wakeup, fetch_inbox_event);
+    fetcher->wakeup.data = fetcher;
+    ev_async_start(loop, &fetcher->wakeup);
+
+    curl_multi_setopt(fetcher->multi, CURLMOPT_SOCKETFUNCTION, fetch_socket_cb);
+    curl_multi_setopt(fetcher->multi, CURLMOPT_SOCKETDATA, fetcher);
+    curl_multi_setopt(fetcher->multi, CURLMOPT_TIMERFUNCTION, fetch_timer_cb);
+    curl_multi_setopt(fetcher->multi, CURLMOPT_TIMERDATA, fetcher);
+    curl_multi_setopt(fetcher->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(fetcher->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) FETCH_MAX_HOST_CONNECTIONS);
+
+    return fetcher;
+}
+
+// Any requests still outstanding fail, so that everyone waiting for one is
+// called back and can clean up. Nothing new can be started from those
+// callbacks.
+void fetcher_free(fetcher_t *fetcher)
+{
+    GHashTableIter iter;
+    GPtrArray *waiters;
+    GList *requests;
+    char *url;
 
-                fetch_comments_json(spool, newsrc, group, reddit_object_id(child));
+    if (fetcher == NULL)
+        return;
+
+    fetcher->closing = true;
+
+    pthread_mutex_lock(&bucketlock);
+
+    for (int i = 0; i < FETCH_CLASSES; i++) {
+        bucket.waiting[i] -= g_queue_get_length(fetcher->queued[i]);
+        g_queue_free(fetcher->queued[i]);
+    }
+
+    pthread_mutex_unlock(&bucketlock);
+
+    // Stop waiting for anything other fetchers are doing, those fail along
+    // with whatever they already finished...
+    pthread_mutex_lock(&flightlock);
+
+    g_hash_table_iter_init(&iter, inflight);
+
+    while (g_hash_table_iter_next(&iter, (gpointer *) &url, (gpointer *) &waiters)) {
+        for (guint i = waiters->len; i > 0; i--) {
+            waiter_t *waiter = g_ptr_array_index(waiters, i - 1);
+            delivery_t *delivery;
+
+            if (waiter->fetcher != fetcher)
                 continue;
-            }
+
+            delivery           = g_new0(delivery_t, 1);
+            delivery->callback = waiter->callback;
+            delivery->opaque   = waiter->opaque;
+            delivery->url      = g_strdup(url);
+            delivery->status   = FETCH_FAILED;
+
+            pthread_mutex_lock(&fetcher->inboxlock);
+            g_queue_push_tail(fetcher->inbox, delivery);
+            pthread_mutex_unlock(&fetcher->inboxlock);
+
+            g_ptr_array_remove_index_fast(waiters, i - 1);
         }
+    }
 
-        // Merge every known object with the spool.
-        reddit_spool_merge_object(spool, subreddit);
+    pthread_mutex_unlock(&flightlock);
 
-        // Update our article ids.
-        reddit_spool_maparticles(spool, group, newsrc);
-      parseerror:
-        // Done with this object.
-        json_object_put(subreddit);
-        json_tokener_free(tokener);
-    } else {
-        g_warning("failed to parse subreddit json");
+    fetch_inbox_event(fetcher->loop, &fetcher->wakeup, 0);
+
+    // ...and make sure nobody is left waiting for us.
+    requests = g_hash_table_get_keys(fetcher->requests);
+
+    g_hash_table_remove_all(fetcher->requests);
+
+    for (GList *item = requests; item; item = item->next) {
+        request_t *request = item->data;
+
+        curl_multi_remove_handle(fetcher->multi, request->easy);
+        fetch_request_finish(request, FETCH_FAILED, NULL, 0);
+        fetch_request_free(fetcher, request);
     }
-  }
 
-  /* cleanup curl stuff */ 
-  curl_easy_cleanup(curl_handle);
+    g_list_free(requests);
+
+    ev_async_stop(fetcher->loop, &fetcher->wakeup);
 
-  free(chunk.memory);
+    g_queue_free_full(fetcher->inbox, (GDestroyNotify) fetch_delivery_free);
+    pthread_mutex_destroy(&fetcher->inboxlock);
 
-  g_free(url);
+    curl_multi_cleanup(fetcher->multi);
 
-  /* we're done with libcurl, so clean it up */ 
-  curl_global_cleanup();
+    g_queue_free_full(fetcher->idle, (GDestroyNotify) curl_easy_cleanup);
 
-  return res == CURLE_OK ? 0 : -1;
+    ev_timer_stop(fetcher->loop, &fetcher->timeout);
+    ev_timer_stop(fetcher->loop, &fetcher->throttle);
+
+    g_hash_table_destroy(fetcher->sockets);
+    g_hash_table_destroy(fetcher->requests);
+    g_free(fetcher);
 }
 
-int fetch_comments_json(json_object *spool, json_object *newsrc, const char *group, const char *id)
+static int fetch_request(fetcher_t *fetcher,
+                         const char *url,
+                         unsigned flags,
+                         fetch_thing_cb_t thing,
+                         fetch_cb_t callback,
+                         void *opaque)
 {
-  CURL *curl_handle;
-  json_tokener *tokener;
-  json_object *comments;
-  CURLcode res;
-  char *url;
+    request_t *request;
 
-  struct MemoryStruct chunk;
+    if (fetcher->closing)
+        return -1;
 
-  chunk.memory = malloc(1);  /* will be grown as needed by the realloc above */ 
-  chunk.size = 0;    /* no data at this point */ 
+    if (fetch_flight_join(fetcher, url, callback, opaque))
+        return 0;
 
-  curl_global_init(CURL_GLOBAL_ALL);
+    request = g_new0(request_t, 1);
 
-  /* init the curl session */ 
-  curl_handle = curl_easy_init();
+    if ((request->easy = fetch_easy_get(fetcher)) == NULL) {
+        g_warning("failed to create a curl handle for %s", url);
+        fetch_flight_land(url, FETCH_FAILED, NULL, 0);
+        g_free(request);
+        return -1;
+    }
 
-  url = g_strdup_printf("https://www.reddit.com/r/%s/comments/%s.json", group, id + 3);
+    request->url          = g_strdup(url);
+    request->flags        = flags;
+    request->queued       = ev_time();
+    request->remaining    = -1;
+    request->reset        = -1;
+    request->callback     = callback;
+    request->opaque       = opaque;
+    request->chunk.memory = malloc(1);
+    request->chunk.size   = 0;
 
-  g_debug("url is %s", url);
+    g_debug("url is %s", url);
 
-  /* specify URL to get */ 
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+    curl_easy_setopt(request->easy, CURLOPT_URL, request->url);
 
-  /* send all data to this function  */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    if (thing) {
+        request->stream = jsonstream_new(thing, opaque);
+        curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, fetch_stream_cb);
+        curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, request);
+    } else {
+        curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+        curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, (void *) &request->chunk);
+    }
+    curl_easy_setopt(request->easy, CURLOPT_PRIVATE, request);
+    curl_easy_setopt(request->easy, CURLOPT_HEADERFUNCTION, fetch_header_cb);
+    curl_easy_setopt(request->easy, CURLOPT_HEADERDATA, request);
 
-  /* we pass our 'chunk' struct to the callback function */ 
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    fetch_cache_prepare(request);
 
-  /* some servers don't like requests that are made without a user-agent
-     field, so we provide one */ 
-  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "nntpit/1.0");
+    if (request->headers) {
+        curl_easy_setopt(request->easy, CURLOPT_HTTPHEADER, request->headers);
+    }
 
-  /* get it! */ 
-  res = curl_easy_perform(curl_handle);
+    request->class = (flags & FETCH_COMMENTS) ? FETCH_CLASS_COMMENTS : FETCH_CLASS_LISTING;
 
-  /* check for errors */ 
-  if (res != CURLE_OK) {
-    g_warning("curl_easy_perform() failed: %s", curl_easy_strerror(res));
-  } else {
-    g_debug("%lu bytes retrieved, %.8s...", chunk.size, chunk.memory);
+    if (flags & FETCH_BACKGROUND) {
+        request->class += FETCH_CLASS_BACKGROUND_LISTING;
+    }
+
+    pthread_mutex_lock(&bucketlock);
+    bucket.waiting[request->class]++;
+    pthread_mutex_unlock(&bucketlock);
+
+    g_queue_push_tail(fetcher->queued[request->class], request);
+    g_hash_table_add(fetcher->requests, request);
+
+    // Dispatch from the loop, callers don't expect to be called back before
+    // this returns.
+    if (!ev_is_active(&fetcher->throttle)) {
+        ev_timer_set(&fetcher->throttle, 0., 0.);
+        ev_timer_start(fetcher->loop, &fetcher->throttle);
+    }
+
+    return 0;
+}
+
+// Queue a request for url, callback is called from the loop when it's done.
+int fetch_url(fetcher_t *fetcher,
+              const char *url,
+              unsigned flags,
+              fetch_cb_t callback,
+              void *opaque)
+{
+    return fetch_request(fetcher, url, flags, NULL, callback, opaque);
+}
+
+// Like fetch_url(), but the body is never kept. Instead, thing is called with
+// each reddit thing in the response as soon as it arrives, and then callback
+// is called with no data.
+//
+// Anyone else who wants the same url waits for this request and gets no
+// data either, so the things should go somewhere they can all see them.
+int fetch_stream(fetcher_t *fetcher,
+                 const char *url,
+                 unsigned flags,
+                 fetch_thing_cb_t thing,
+                 fetch_cb_t callback,
+                 void *opaque)
+{
+    return fetch_request(fetcher, url, flags, thing, callback, opaque);
+}
+
+// Every thing streamed from a comment thread goes straight into the spool.
+static void fetch_spool_thing(spool_t *spool, json_object *thing)
+{
+    reddit_spool_lock(spool);
+    reddit_spool_merge_object(spool, thing);
+    reddit_spool_unlock(spool);
+}
+
+static json_object * fetch_parse_json(const char *data, size_t len)
+{
+    json_tokener *tokener;
+    json_object *object;
 
     // The JSON_TOKENER_DEFAULT_DEPTH is too shallow for reddit, let's
     // try doubling it. See https://github.com/taviso/nntpit/issues/7
-    tokener   = json_tokener_new_ex(64);
-    comments  = NULL;
+    if ((tokener = json_tokener_new_ex(64)) == NULL)
+        return NULL;
+
+    object = json_tokener_parse_ex(tokener, data, len);
+
+    json_tokener_free(tokener);
+    return object;
+}
+
+// A story whose comments we missed keeps the num_comments we knew about, or
+// the next refresh would think it already has them and never try again.
+static void refresh_restore_failed(refresh_t *refresh)
+{
+    json_object *children;
+
+    if (!json_object_object_get_ex(refresh->listing, "data", &children)
+     || !json_object_object_get_ex(children, "children", &children))
+        return;
+
+    for (size_t i = 0; i < json_object_array_length(children); i++) {
+        json_object *child = json_object_array_get_idx(children, i);
+        json_object *data;
+        gpointer known;
+
+        if (!g_hash_table_lookup_extended(refresh->failed, reddit_object_id(child), NULL, &known))
+            continue;
 
-    if (tokener) {
-        comments = json_tokener_parse_ex(tokener, chunk.memory, chunk.size);
+        if (json_object_object_get_ex(child, "data", &data)) {
+            json_object_object_add(data, "num_comments", json_object_new_int(GPOINTER_TO_INT(known)));
+        }
     }
+}
+
+// Called as each request belonging to a refresh completes, the listing is
+// merged last so that it has the most recent num_comments.
+static void refresh_release(refresh_t *refresh)
+{
+    if (--refresh->pending > 0)
+        return;
+
+    // The listing itself hasn't changed, so don't let it be skipped next
+    // time either.
+    if (g_hash_table_size(refresh->failed)) {
+        fetch_forget(refresh->url);
+    }
+
+    if (refresh->listing) {
+        reddit_spool_lock(refresh->spool);
+
+        refresh_restore_failed(refresh);
 
-    if (comments != NULL) {
         // Merge every known object with the spool.
-        reddit_spool_merge_object(spool, comments);
+        reddit_spool_merge_object(refresh->spool, refresh->listing);
 
         // Update our article ids.
-        reddit_spool_maparticles(spool, group, newsrc);
-      parseerror:
-        // Done with this object.
-        json_object_put(comments);
-        json_tokener_free(tokener);
+        reddit_spool_maparticles(refresh->spool, refresh->group, refresh->newsrc);
+
+        reddit_spool_unlock(refresh->spool);
+
+        json_object_put(refresh->listing);
+    }
+
+    if (refresh->callback) {
+        refreshed_t refreshed = {
+            .group  = refresh->group,
+            .result = refresh->result,
+            .churn  = refresh->churn,
+            .after  = refresh->after,
+            .oldest = refresh->oldest,
+            .unchanged = refresh->unchanged,
+        };
+
+        refresh->callback(&refreshed, refresh->opaque);
+    }
+
+    g_hash_table_destroy(refresh->failed);
+    g_free(refresh->group);
+    g_free(refresh->after);
+    g_free(refresh->url);
+    g_free(refresh);
+}
+
+static void expand_free(expand_t *expand)
+{
+    g_free(expand->batch);
+    g_free(expand->group);
+    g_free(expand->linkid);
+    g_free(expand);
+}
+
+static void expand_next(expand_t *expand);
+
+static void expand_done(const char *url,
+                        int status,
+                        const char *data,
+                        size_t len,
+                        void *opaque)
+{
+    expand_t *expand = opaque;
+
+    reddit_spool_lock(expand->spool);
+
+    // The children were stored as they arrived, so now the ids can go. If
+    // it failed, put them back for the next time the thread is fetched.
+    reddit_spool_more_done(expand->spool, expand->linkid, expand->batch, status == FETCH_OK);
+
+    if (status != FETCH_OK) {
+        reddit_spool_unlock(expand->spool);
+        g_warning("failed to expand comments in %s", expand->linkid);
+        expand_free(expand);
+        return;
+    }
+
+    reddit_spool_maparticles(expand->spool, expand->group, expand->newsrc);
+    reddit_spool_unlock(expand->spool);
+
+    g_free(expand->batch);
+    expand->batch = NULL;
+
+    expand_next(expand);
+}
+
+// The comments are in json.data.things, without their replies, which might
+// include more objects of their own.
+static void expand_thing(json_object *thing, void *opaque)
+{
+    expand_t *expand = opaque;
+
+    fetch_spool_thing(expand->spool, thing);
+}
+
+static void expand_next(expand_t *expand)
+{
+    char *children;
+    char *url;
+
+    if (expand->requests >= FETCH_MORE_REQUESTS) {
+        g_debug("giving up expanding %s for now", expand->linkid);
+        expand_free(expand);
+        return;
+    }
+
+    reddit_spool_lock(expand->spool);
+    children = reddit_spool_take_more(expand->spool, expand->linkid, FETCH_MORE_BATCH);
+    reddit_spool_unlock(expand->spool);
+
+    if (children == NULL) {
+        expand_free(expand);
+        return;
+    }
+
+    expand->batch = children;
+
+    url = g_strdup_printf("%s/api/morechildren.json"
+                          "?api_type=json&limit_children=false&link_id=%s&children=%s",
+                          site,
+                          expand->linkid,
+                          children);
+
+    if (fetch_stream(expand->fetcher,
+                     url,
+                     FETCH_BACKGROUND | FETCH_COMMENTS,
+                     expand_thing,
+                     expand_done,
+                     expand) != 0) {
+        reddit_spool_lock(expand->spool);
+        reddit_spool_more_done(expand->spool, expand->linkid, children, false);
+        reddit_spool_unlock(expand->spool);
+        expand_free(expand);
+    } else {
+        expand->requests++;
+    }
+
+    g_free(url);
+}
+
+// Start fetching any comments that were left out of this thread.
+static void fetch_expand(refresh_t *refresh, const char *linkid)
+{
+    expand_t *expand = g_new0(expand_t, 1);
+
+    expand->fetcher = refresh->fetcher;
+    expand->spool   = refresh->spool;
+    expand->newsrc  = refresh->newsrc;
+    expand->group   = g_strdup(refresh->group);
+    expand->linkid  = g_strdup(linkid);
+
+    expand_next(expand);
+}
+
+static void refresh_comments_done(const char *url,
+                                  int status,
+                                  const char *data,
+                                  size_t len,
+                                  void *opaque)
+{
+    story_t *story = opaque;
+    refresh_t *refresh = story->refresh;
+
+    // Nothing new if it wasn't modified.
+    if (status != FETCH_OK) {
+        if (status == FETCH_FAILED) {
+            g_hash_table_insert(refresh->failed, g_strdup(story->id), GINT_TO_POINTER(story->known));
+        }
+        goto finished;
+    }
+
+    // The comments were merged as they arrived, so just update our article
+    // ids.
+    reddit_spool_lock(refresh->spool);
+    reddit_spool_maparticles(refresh->spool, refresh->group, refresh->newsrc);
+    reddit_spool_unlock(refresh->spool);
+
+    // Big threads have comments left out, go and get those too.
+    fetch_expand(refresh, story->id);
+
+  finished:
+    g_free(story->id);
+    g_free(story);
+    refresh_release(refresh);
+}
+
+static void refresh_comments_thing(json_object *thing, void *opaque)
+{
+    story_t *story = opaque;
+
+    fetch_spool_thing(story->refresh->spool, thing);
+}
+
+static void refresh_fetch_comments(refresh_t *refresh, const char *id, int known)
+{
+    story_t *story = g_new0(story_t, 1);
+    char *url = g_strdup_printf("%s/r/%s/comments/%s.json",
+                                site,
+                                refresh->group,
+                                id + 3);
+
+    story->refresh = refresh;
+    story->id      = g_strdup(id);
+    story->known   = known;
+
+    if (fetch_stream(refresh->fetcher,
+                     url,
+                     refresh->flags | FETCH_COMMENTS,
+                     refresh_comments_thing,
+                     refresh_comments_done,
+                     story) == 0) {
+        refresh->pending++;
     } else {
+        g_hash_table_insert(refresh->failed, story->id, GINT_TO_POINTER(known));
+        g_free(story);
+    }
+
+    g_free(url);
+}
+
+static void refresh_listing_done(const char *url,
+                                 int status,
+                                 const char *data,
+                                 size_t len,
+                                 void *opaque)
+{
+    refresh_t *refresh = opaque;
+    json_object *children;
+
+    if (status == FETCH_FAILED) {
+        refresh->result = -1;
+        goto finished;
+    }
+
+    // If the listing hasn't changed, neither has anything in it.
+    if (status == FETCH_NOT_MODIFIED) {
+        refresh->unchanged = true;
+        goto finished;
+    }
+
+    if ((refresh->listing = fetch_parse_json(data, len)) == NULL) {
         g_warning("failed to parse subreddit json");
+        refresh->result = -1;
+        goto finished;
     }
-  }
 
-  /* cleanup curl stuff */ 
-  curl_easy_cleanup(curl_handle);
+    g_warn_if_fail(reddit_object_type(refresh->listing) == REDDIT_OBJ_LISTING);
+    // The question is, are there any new comments we don't know about?
+
+    // For every object we just fetched, compare the number of comments to
+    // the number of comments we already knew about.
+    if (!json_object_object_get_ex(refresh->listing, "data", &children)) {
+        g_warning("no data was found in the listing object");
+        goto parseerror;
+    }
+
+    // This is null on the last page.
+    refresh->after = g_strdup(json_object_get_string_prop(children, "after"));
+
+    if (!json_object_object_get_ex(children, "children", &children)) {
+        g_warning("no child objects found in the listing");
+        goto parseerror;
+    }
 
-  free(chunk.memory);
+    if (!json_object_is_type(children, json_type_array)) {
+        g_info("expecting children to be an array of objects");
+        goto parseerror;
+    }
+
+    reddit_spool_lock(refresh->spool);
+
+    for (size_t i = 0; i < json_object_array_length(children); i++) {
+        json_object *child = json_object_array_get_idx(children, i);
+        json_object *origdata;
+        json_object *newdata;
+        json_object *orig;
+        json_object *origcomments;
+        json_object *newcomments = NULL;
+        json_object *created;
+
+        json_object_object_get_ex(child, "data", &newdata);
+        json_object_object_get_ex(newdata, "num_comments", &newcomments);
+
+        if (json_object_object_get_ex(newdata, "created_utc", &created)) {
+            time_t posted = json_object_get_int64(created);
+
+            if (refresh->oldest == 0 || posted < refresh->oldest)
+                refresh->oldest = posted;
+        }
+
+        // Lookup if this id is in the spool
+        if (!reddit_spool_retrieve(refresh->spool, reddit_object_id(child), &orig)) {
+            // I don't know this article, so we definitely need it.
+            refresh->churn += json_object_get_int(newcomments);
+            refresh_fetch_comments(refresh, reddit_object_id(child), 0);
+            continue;
+        }
+
+        // Check if there are new comments since we last looked.
+        json_object_object_get_ex(orig, "data", &origdata);
+        json_object_object_get_ex(origdata, "num_comments", &origcomments);
+
+        if (json_object_get_int(origcomments) < json_object_get_int(newcomments)) {
+            // There are new comments.
+            g_debug("story %s has %u vs %u known comments => re-fetch",
+                    reddit_object_id(child),
+                    json_object_get_int(origcomments),
+                    json_object_get_int(newcomments));
+
+            refresh->churn += json_object_get_int(newcomments)
+                            - json_object_get_int(origcomments);
+            refresh_fetch_comments(refresh, reddit_object_id(child), json_object_get_int(origcomments));
+            continue;
+        }
+    }
 
-  g_free(url);
+    reddit_spool_unlock(refresh->spool);
 
-  /* we're done with libcurl, so clean it up */ 
-  curl_global_cleanup();
+    // The comment fetches are now running concurrently, the listing is
+    // merged when they have all finished.
+    goto finished;
+
+  parseerror:
+    json_object_put(refresh->listing);
+    refresh->listing = NULL;
+    refresh->result  = -1;
+
+  finished:
+    refresh_release(refresh);
+}
+
+// Start refreshing a subreddit, callback is called from the loop once the
+// listing and any changed comment threads are merged into the spool.
+//
+// If after is NULL this is the front page, otherwise it's the page of older
+// stories after that cursor. Use "" for the first of those pages.
+refresh_t * fetch_subreddit(fetcher_t *fetcher,
+                            spool_t *spool,
+                            newsrc_t *newsrc,
+                            const char *group,
+                            const char *after,
+                            unsigned flags,
+                            refresh_cb_t callback,
+                            void *opaque)
+{
+    refresh_t *refresh = g_new0(refresh_t, 1);
+
+    if (after == NULL) {
+        refresh->url = g_strdup_printf("%s/r/%s.json", site, group);
+    } else if (*after == '\0') {
+        refresh->url = g_strdup_printf("%s/r/%s.json?limit=100", site, group);
+    } else {
+        refresh->url = g_strdup_printf("%s/r/%s.json?limit=100&after=%s",
+                                       site,
+                                       group,
+                                       after);
+    }
+
+    refresh->fetcher  = fetcher;
+    refresh->spool    = spool;
+    refresh->newsrc   = newsrc;
+    refresh->flags    = flags;
+    refresh->group    = g_strdup(group);
+    refresh->callback = callback;
+    refresh->opaque   = opaque;
+    refresh->pending  = 1;
+    refresh->failed   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    // Only the front page is fetched repeatedly, so that's the only one
+    // worth keeping.
+    if (after == NULL) {
+        flags |= FETCH_KEEP;
+    }
+
+    if (fetch_url(fetcher, refresh->url, flags, refresh_listing_done, refresh) != 0) {
+        g_hash_table_destroy(refresh->failed);
+        g_free(refresh->group);
+        g_free(refresh->url);
+        g_free(refresh);
+        return NULL;
+    }
+
+    return refresh;
+}
+
+// The refresh continues, but nobody is waiting for it anymore.
+void fetch_subreddit_detach(refresh_t *refresh)
+{
+    refresh->callback = NULL;
+    refresh->opaque   = NULL;
+}
+
+static void fetch_subreddit_wait(const refreshed_t *refreshed, void *opaque)
+{
+    int *status = opaque;
+
+    *status = refreshed->result;
+}
+
+// Refresh a subreddit and wait for it, used before the server is running.
+int fetch_subreddit_json(spool_t *spool, newsrc_t *newsrc, const char *group)
+{
+    struct ev_loop *loop = ev_loop_new(ev_supported_backends());
+    fetcher_t *fetcher = fetcher_new(loop);
+    int result = 1;
+
+    if (fetcher == NULL
+     || fetch_subreddit(fetcher, spool, newsrc, group, NULL, 0, fetch_subreddit_wait, &result) == NULL) {
+        fetcher_free(fetcher);
+        ev_loop_destroy(loop);
+        return -1;
+    }
+
+    while (result > 0) {
+        ev_run(loop, EVRUN_ONCE);
+    }
 
-  return res == CURLE_OK ? 0 : -1;
+    fetcher_free(fetcher);
+    ev_loop_destroy(loop);
+    return result;
 }
@@ -0,0 +1,112 @@
+#ifndef __FETCH_H
+#define __FETCH_H
+
+// The fetcher runs HTTP requests on a curl multi handle driven by an ev_loop,
+// so fetching from reddit never blocks the loop. Every thread has its own,
+// a fetcher must only be used from the thread running its loop.
+
+typedef struct fetcher fetcher_t;
+typedef struct refresh refresh_t;
+
+enum {
+    FETCH_OK,
+    FETCH_NOT_MODIFIED,
+    FETCH_FAILED,
+};
+
+// Flags for fetch_url(), the last two decide its priority. Nobody is waiting
+// for background requests, and comments are less important than listings.
+enum {
+    FETCH_KEEP          = 1 << 0,   // Keep the body to hand back when not modified.
+    FETCH_BACKGROUND    = 1 << 1,
+    FETCH_COMMENTS      = 1 << 2,
+};
+
+typedef struct fetchstats {
+    uint64_t    hits;       // Responses that were 304 Not Modified.
+    uint64_t    misses;     // Responses with a body.
+    uint64_t    received;   // Bytes of body received, before decompression.
+    uint64_t    decoded;    // Bytes of body received, after decompression.
+    uint64_t    queued;     // Requests waiting for the rate limiter now.
+    uint64_t    dispatched; // Requests the rate limiter has let go.
+    uint64_t    throttled;  // Responses that were 429 Too Many Requests.
+    double      waited;     // Total seconds requests spent queued.
+    double      maxwait;    // The longest any request was queued.
+    uint64_t    joined;     // Requests that waited for an identical one.
+} fetchstats_t;
+
+// Called when a request completes. If the status is FETCH_NOT_MODIFIED, data
+// is the body we kept from last time or NULL. If it's FETCH_FAILED, data is
+// always NULL.
+typedef void (*fetch_cb_t)(const char *url,
+                           int status,
+                           const char *data,
+                           size_t len,
+                           void *opaque);
+
+// Called with each reddit thing in a streamed response as it arrives, take a
+// reference to keep it.
+typedef void (*fetch_thing_cb_t)(json_object *thing, void *opaque);
+
+// What a subreddit refresh found, passed to its callback.
+typedef struct refreshed {
+    const char  *group;
+    int          result;    // 0 on success.
+    unsigned     churn;     // How many new comments the listing said there were.
+    const char  *after;     // Cursor for the next page, NULL on the last page.
+    time_t       oldest;    // When the oldest story in the listing was posted.
+    bool         unchanged; // The listing was not modified, so after is unknown.
+} refreshed_t;
+
+typedef void (*refresh_cb_t)(const refreshed_t *refreshed, void *opaque);
+
+int
+fetch_global_init(void);
+
+void
+fetch_global_cleanup(void);
+
+void
+fetch_set_site(const char *url);
+
+fetcher_t *
+fetcher_new(struct ev_loop *loop);
+
+void
+fetcher_free(fetcher_t *fetcher);
+
+int
+fetch_url(fetcher_t *fetcher,
+          const char *url,
+          unsigned flags,
+          fetch_cb_t callback,
+          void *opaque);
+
+int
+fetch_stream(fetcher_t *fetcher,
+             const char *url,
+             unsigned flags,
+             fetch_thing_cb_t thing,
+             fetch_cb_t callback,
+             void *opaque);
+
+void
+fetch_forget(const char *url);
+
+void
+fetch_stats(fetchstats_t *stats);
+
+refresh_t *
+fetch_subreddit(fetcher_t *fetcher,
+                spool_t *spool,
+                newsrc_t *newsrc,
+                const char *group,
+                const char *after,
+                unsigned flags,
+                refresh_cb_t callback,
+                void *opaque);
+
+void
+fetch_subreddit_detach(refresh_t *refresh);
+
+#endif
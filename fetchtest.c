@@ -0,0 +1,218 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that a story whose comments couldn't be fetched is asked for again
+// on the next refresh, and that comments left out of a thread are still
+// wanted if the fetcher goes away before they're expanded. The responses
+// come from a tiny http server on a thread of its own. Run with `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ev.h>
+#include <json.h>
+#include <glib.h>
+
+#include "newsrc.h"
+#include "reddit.h"
+#include "fetch.h"
+
+#define TEST_GROUP "test"
+
+#define TEST_LISTING "{\"kind\": \"Listing\", \"data\": {\"after\": null, \"children\": [" \
+                     "{\"kind\": \"t3\", \"data\": {"                                  \
+                         "\"name\": \"t3_aaa\","                                       \
+                         "\"id\": \"aaa\","                                            \
+                         "\"subreddit\": \"" TEST_GROUP "\","                          \
+                         "\"title\": \"A story\","                                     \
+                         "\"author\": \"someone\","                                    \
+                         "\"selftext\": \"text\","                                     \
+                         "\"num_comments\": 1,"                                        \
+                         "\"created_utc\": 1600000000.0}}]}}"
+
+#define TEST_COMMENT "{\"kind\": \"Listing\", \"data\": {\"after\": null, \"children\": [" \
+                     "{\"kind\": \"t1\", \"data\": {"                                  \
+                         "\"name\": \"t1_ccc\","                                       \
+                         "\"parent_id\": \"t3_aaa\","                                  \
+                         "\"link_id\": \"t3_aaa\","                                    \
+                         "\"subreddit\": \"" TEST_GROUP "\","                          \
+                         "\"author\": \"someone\","                                    \
+                         "\"body\": \"a reply\","                                      \
+                         "\"replies\": \"\","                                          \
+                         "\"created_utc\": 1600000001.0}},"                          \
+                     "{\"kind\": \"more\", \"data\": {"                                \
+                         "\"parent_id\": \"t3_aaa\","                                  \
+                         "\"children\": [\"ddd\"]}}]}}"
+
+static int failures;
+static int listings;    // Requests the server has seen for each url.
+static int comments;
+
+static void check(bool passed, const char *what)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void server_reply(int fd, const char *status, const char *body)
+{
+    char *response = g_strdup_printf("HTTP/1.1 %s\r\n"
+                                     "Content-Type: application/json\r\n"
+                                     "Content-Length: %zu\r\n"
+                                     "Connection: close\r\n"
+                                     "\r\n"
+                                     "%s",
+                                     status,
+                                     strlen(body),
+                                     body);
+
+    if (write(fd, response, strlen(response)) < 0)
+        fprintf(stderr, "failed to send a response\n");
+
+    g_free(response);
+}
+
+static bool server_wants(const char *request, const char *path)
+{
+    char *line = g_strdup_printf("GET %s HTTP/", path);
+    bool wanted = g_str_has_prefix(request, line);
+
+    g_free(line);
+    return wanted;
+}
+
+// Answer one request per connection, the first comment fetch fails.
+static void * server_run(void *opaque)
+{
+    int listener = GPOINTER_TO_INT(opaque);
+    int fd;
+
+    while ((fd = accept(listener, NULL, NULL)) >= 0) {
+        char request[4096] = {0};
+        size_t len = 0;
+        ssize_t got;
+
+        while (strstr(request, "\r\n\r\n") == NULL && len < sizeof(request) - 1) {
+            if ((got = read(fd, request + len, sizeof(request) - len - 1)) <= 0)
+                break;
+            len += got;
+        }
+
+        if (server_wants(request, "/r/" TEST_GROUP ".json")) {
+            listings++;
+            server_reply(fd, "200 OK", TEST_LISTING);
+        } else if (server_wants(request, "/r/" TEST_GROUP "/comments/aaa.json")) {
+            if (comments++ == 0) {
+                server_reply(fd, "500 Internal Server Error", "{}");
+            } else {
+                server_reply(fd, "200 OK", "[" TEST_LISTING ", " TEST_COMMENT "]");
+            }
+        } else {
+            server_reply(fd, "404 Not Found", "{}");
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Listen on any free port on localhost, and return the url for it.
+static char * server_start(void)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    pthread_t thread;
+    int listener;
+
+    if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0
+     || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+     || listen(listener, 16) != 0
+     || getsockname(listener, (struct sockaddr *) &addr, &addrlen) != 0
+     || pthread_create(&thread, NULL, server_run, GINT_TO_POINTER(listener)) != 0)
+        return NULL;
+
+    pthread_detach(thread);
+
+    return g_strdup_printf("http://127.0.0.1:%u", ntohs(addr.sin_port));
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = g_dir_make_tmp("fetchtest-XXXXXX", NULL);
+    json_object *object;
+    char *more;
+    newsrc_t *newsrc;
+    spool_t *spool;
+    char *site;
+
+    // Everything is opened in the current directory.
+    if (dir == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "%s: couldn't make a temporary directory\n", argv[0]);
+        return 1;
+    }
+
+    if ((site = server_start()) == NULL || fetch_global_init() != 0) {
+        fprintf(stderr, "%s: couldn't start the server\n", argv[0]);
+        return 1;
+    }
+
+    fetch_set_site(site);
+
+    newsrc = newsrc_open("newsrc");
+    spool  = reddit_spool_open("spool");
+
+    // The story is new, but its comments can't be fetched.
+    check(fetch_subreddit_json(spool, newsrc, TEST_GROUP) == 0, "first refresh succeeds");
+    check(comments == 1, "comments are fetched for a new story");
+    check(!reddit_spool_retrieve(spool, "t1_ccc", &object), "failed comments aren't spooled");
+
+    // So the next refresh has to ask for them again.
+    check(fetch_subreddit_json(spool, newsrc, TEST_GROUP) == 0, "second refresh succeeds");
+    check(listings == 2, "the listing is fetched again");
+    check(comments == 2, "failed comments are fetched again");
+    check(reddit_spool_retrieve(spool, "t1_ccc", &object), "comments are spooled after a retry");
+
+    // The refresh is over before the rest of the thread could be expanded,
+    // so that has to be left for next time.
+    more = reddit_spool_take_more(spool, "t3_aaa", 100);
+    check(more && strcmp(more, "ddd") == 0, "unexpanded comments are still wanted");
+
+    if (more) {
+        reddit_spool_more_done(spool, "t3_aaa", more, false);
+    }
+
+    g_free(more);
+
+    // Now there's nothing left to get.
+    check(fetch_subreddit_json(spool, newsrc, TEST_GROUP) == 0, "third refresh succeeds");
+    check(comments == 2, "comments aren't fetched once they're known");
+
+    reddit_spool_close(spool);
+    newsrc_close(newsrc);
+    fetch_global_cleanup();
+
+    if (chdir("/") == 0) {
+        char *command = g_strdup_printf("rm -rf '%s'", dir);
+
+        if (system(command) != 0)
+            fprintf(stderr, "%s: failed to remove %s\n", argv[0], dir);
+
+        g_free(command);
+    }
+
+    g_free(site);
+    g_free(dir);
+    return failures != 0;
+}
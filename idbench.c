@@ -0,0 +1,152 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Compare the id codec and kind classifier with the versions they replaced,
+// over a spool sized set of objects. Build with `make idbench`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <json.h>
+#include <glib.h>
+
+#include "newsrc.h"
+#include "reddit.h"
+#include "jsonutil.h"
+
+#define BENCH_OBJECTS 100000
+
+// XOVER and reference generation classify each article a few times.
+#define BENCH_PASSES 4
+
+static const char kidAlphabet[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static uint64_t legacy_decode_id(const char *idstr)
+{
+    uint64_t id;
+
+    for (id = 0; *idstr; idstr++) {
+        uint8_t val = index(kidAlphabet, *idstr) - kidAlphabet;
+        id = id * 36 + val;
+    }
+
+    return id;
+}
+
+static int legacy_encode_id(uint64_t id, char idstr[REDDIT_MAX_ID])
+{
+    lldiv_t result = {
+        .quot = id
+    };
+
+    for (*idstr = 0; result.quot != 0;) {
+        result = lldiv(result.quot, 36);
+        memmove(idstr + 1, idstr, strlen(idstr) + 1);
+        *idstr = kidAlphabet[result.rem];
+    }
+
+    return 0;
+}
+
+static int legacy_object_type(json_object *obj)
+{
+    static const struct {
+        const char *kind;
+        int         type;
+    } kinds[] = {
+        { "listing",    REDDIT_OBJ_LISTING },
+        { "t1",         REDDIT_OBJ_COMMENT },
+        { "t3",         REDDIT_OBJ_LINK },
+        { "t2",         REDDIT_OBJ_ACCOUNT },
+        { "t4",         REDDIT_OBJ_MESSAGE },
+        { "t5",         REDDIT_OBJ_SUBREDDIT },
+        { "t6",         REDDIT_OBJ_AWARD },
+        { "t8",         REDDIT_OBJ_PROMO },
+        { "more",       REDDIT_OBJ_MORE },
+    };
+
+    for (size_t i = 0; i < G_N_ELEMENTS(kinds); i++) {
+        if (json_object_check_strprop(obj, "kind", kinds[i].kind, false))
+            return kinds[i].type;
+    }
+
+    return -1;
+}
+
+static double elapsed(gint64 start)
+{
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+int main(int argc, char **argv)
+{
+    json_object **objects = g_new0(json_object *, BENCH_OBJECTS);
+    char (*ids)[REDDIT_MAX_ID] = g_malloc0(BENCH_OBJECTS * REDDIT_MAX_ID);
+    char idstr[REDDIT_MAX_ID];
+    uint64_t check = 0;
+    gint64 start;
+
+    // Mostly comments with recent ids, like a real spool.
+    for (int i = 0; i < BENCH_OBJECTS; i++) {
+        json_object *data = json_object_new_object();
+        char *name;
+
+        reddit_encode_id(0x6d5a1b0ULL + i * 7, ids[i]);
+
+        name = g_strdup_printf("%s_%s", i % 20 ? "t1" : "t3", ids[i]);
+
+        objects[i] = json_object_new_object();
+        json_object_object_add(data, "name", json_object_new_string(name));
+        json_object_object_add(objects[i], "kind", json_object_new_string(i % 20 ? "t1" : "t3"));
+        json_object_object_add(objects[i], "data", data);
+
+        g_free(name);
+    }
+
+    start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        check += legacy_decode_id(ids[i]);
+    printf("decode, legacy:      %8.2f ms\n", elapsed(start));
+
+    start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        check -= reddit_decode_id(ids[i]);
+    printf("decode, table:       %8.2f ms\n", elapsed(start));
+
+    start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        check += legacy_encode_id(0x6d5a1b0ULL + i * 7, idstr) + idstr[0];
+    printf("encode, legacy:      %8.2f ms\n", elapsed(start));
+
+    start = g_get_monotonic_time();
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        check -= reddit_encode_id(0x6d5a1b0ULL + i * 7, idstr) + idstr[0];
+    printf("encode, fixed width: %8.2f ms\n", elapsed(start));
+
+    start = g_get_monotonic_time();
+    for (int pass = 0; pass < BENCH_PASSES; pass++)
+        for (int i = 0; i < BENCH_OBJECTS; i++)
+            check += legacy_object_type(objects[i]);
+    printf("classify, legacy:    %8.2f ms\n", elapsed(start));
+
+    start = g_get_monotonic_time();
+    for (int pass = 0; pass < BENCH_PASSES; pass++)
+        for (int i = 0; i < BENCH_OBJECTS; i++)
+            check -= reddit_object_type(objects[i]);
+    printf("classify, cached:    %8.2f ms\n", elapsed(start));
+
+    for (int i = 0; i < BENCH_OBJECTS; i++)
+        json_object_put(objects[i]);
+
+    g_free(objects);
+    g_free(ids);
+
+    // The old and new versions should agree.
+    if (check != 0) {
+        fprintf(stderr, "%s: results didn't match\n", argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
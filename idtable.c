@@ -0,0 +1,190 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+
+#include "idtable.h"
+
+// Number of slots in a new table, must be a power of two.
+#define IDTABLE_INITIAL_SLOTS 64
+
+struct idslot {
+    uint64_t    key;        // Zero if the slot is empty.
+    void       *value;
+};
+
+struct idtable {
+    struct idslot  *slots;
+    size_t          nslots;
+    size_t          count;
+    GDestroyNotify  destroy;
+};
+
+// Keys are mostly sequential, so they need mixing before they're any use as
+// a hash. This is the finalizer from splitmix64.
+static size_t idtable_hash(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+// Find the slot holding key, or the empty slot where it would go.
+static struct idslot * idtable_find(idtable_t *table, uint64_t key)
+{
+    size_t mask = table->nslots - 1;
+    size_t i = idtable_hash(key) & mask;
+
+    while (table->slots[i].key != 0 && table->slots[i].key != key) {
+        i = (i + 1) & mask;
+    }
+
+    return &table->slots[i];
+}
+
+static void idtable_resize(idtable_t *table, size_t nslots)
+{
+    struct idslot *old = table->slots;
+    size_t oldslots = table->nslots;
+
+    table->slots  = g_new0(struct idslot, nslots);
+    table->nslots = nslots;
+
+    for (size_t i = 0; i < oldslots; i++) {
+        if (old[i].key) {
+            *idtable_find(table, old[i].key) = old[i];
+        }
+    }
+
+    g_free(old);
+}
+
+idtable_t * idtable_new(GDestroyNotify destroy)
+{
+    idtable_t *table = g_new0(idtable_t, 1);
+
+    table->slots   = g_new0(struct idslot, IDTABLE_INITIAL_SLOTS);
+    table->nslots  = IDTABLE_INITIAL_SLOTS;
+    table->destroy = destroy;
+
+    return table;
+}
+
+void idtable_free(idtable_t *table)
+{
+    if (table == NULL)
+        return;
+
+    idtable_remove_all(table);
+
+    g_free(table->slots);
+    g_free(table);
+}
+
+void * idtable_lookup(idtable_t *table, uint64_t key)
+{
+    return key ? idtable_find(table, key)->value : NULL;
+}
+
+bool idtable_contains(idtable_t *table, uint64_t key)
+{
+    return key && idtable_find(table, key)->key == key;
+}
+
+// Add key, or replace its value if it's already there.
+void idtable_insert(idtable_t *table, uint64_t key, void *value)
+{
+    struct idslot *slot;
+
+    g_return_if_fail(key != 0);
+
+    // Keep the load under 3/4, probes get long after that.
+    if ((table->count + 1) * 4 > table->nslots * 3) {
+        idtable_resize(table, table->nslots * 2);
+    }
+
+    slot = idtable_find(table, key);
+
+    if (slot->key == 0) {
+        slot->key = key;
+        table->count++;
+    } else if (table->destroy) {
+        table->destroy(slot->value);
+    }
+
+    slot->value = value;
+}
+
+bool idtable_remove(idtable_t *table, uint64_t key)
+{
+    size_t mask = table->nslots - 1;
+    struct idslot *slot;
+    size_t i, j;
+
+    if (key == 0 || (slot = idtable_find(table, key))->key == 0)
+        return false;
+
+    if (table->destroy)
+        table->destroy(slot->value);
+
+    // There are no tombstones, instead anything after the hole that would
+    // have been placed before it is moved back into it.
+    i = slot - table->slots;
+    j = i;
+
+    while (true) {
+        size_t home;
+
+        j = (j + 1) & mask;
+
+        if (table->slots[j].key == 0)
+            break;
+
+        home = idtable_hash(table->slots[j].key) & mask;
+
+        // Can this entry be found if it moves to i?
+        if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+
+    table->slots[i].key   = 0;
+    table->slots[i].value = NULL;
+    table->count--;
+    return true;
+}
+
+void idtable_remove_all(idtable_t *table)
+{
+    for (size_t i = 0; i < table->nslots; i++) {
+        if (table->slots[i].key && table->destroy) {
+            table->destroy(table->slots[i].value);
+        }
+    }
+
+    memset(table->slots, 0, table->nslots * sizeof(struct idslot));
+    table->count = 0;
+}
+
+size_t idtable_size(idtable_t *table)
+{
+    return table->count;
+}
+
+// The table must not be changed by the callback.
+void idtable_foreach(idtable_t *table, idtable_cb_t callback, void *opaque)
+{
+    for (size_t i = 0; i < table->nslots; i++) {
+        if (table->slots[i].key) {
+            callback(table->slots[i].key, table->slots[i].value, opaque);
+        }
+    }
+}
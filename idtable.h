@@ -0,0 +1,39 @@
+#ifndef __IDTABLE_H
+#define __IDTABLE_H
+
+// An idtable maps spool keys (see reddit_name_key()) to pointers. It's an
+// open-addressing hash table with linear probing, so a lookup is usually one
+// cache line and each entry costs sixteen bytes. Zero is never a valid key.
+
+typedef struct idtable idtable_t;
+
+typedef void (*idtable_cb_t)(uint64_t key, void *value, void *opaque);
+
+idtable_t *
+idtable_new(GDestroyNotify destroy);
+
+void
+idtable_free(idtable_t *table);
+
+void *
+idtable_lookup(idtable_t *table, uint64_t key);
+
+bool
+idtable_contains(idtable_t *table, uint64_t key);
+
+void
+idtable_insert(idtable_t *table, uint64_t key, void *value);
+
+bool
+idtable_remove(idtable_t *table, uint64_t key);
+
+void
+idtable_remove_all(idtable_t *table);
+
+size_t
+idtable_size(idtable_t *table);
+
+void
+idtable_foreach(idtable_t *table, idtable_cb_t callback, void *opaque);
+
+#endif
@@ -0,0 +1,161 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that removing keys from an idtable leaves every other key findable,
+// especially when the probe sequences wrap around the end of the table. Run
+// with `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include "idtable.h"
+
+// A new table has this many slots, and doesn't grow until it's 3/4 full.
+#define TEST_SLOTS 64
+#define TEST_MAX_KEYS 40
+
+#define TEST_ROUNDS 200000
+
+static int failures;
+static int destroyed;
+
+static void check(bool passed, const char *what, uint64_t key)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s (%#llx)\n", what, (unsigned long long) key);
+        failures++;
+    }
+}
+
+// The same as idtable_hash(), so we know which slot each key wants.
+static size_t test_home(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key & (TEST_SLOTS - 1);
+}
+
+// Find the next key after *key that wants slot home.
+static uint64_t test_key(uint64_t *key, size_t home)
+{
+    do {
+        ++*key;
+    } while (test_home(*key) != home);
+
+    return *key;
+}
+
+static void test_destroy(void *value)
+{
+    destroyed++;
+}
+
+static uint64_t test_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// The table should hold exactly the keys marked present, each with itself as
+// its value.
+static void check_table(idtable_t *table, const uint64_t *keys, const bool *present, size_t nkeys)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < nkeys; i++) {
+        if (present[i]) {
+            check(idtable_lookup(table, keys[i]) == (void *) keys[i], "key can be found", keys[i]);
+            count++;
+        } else {
+            check(!idtable_contains(table, keys[i]), "removed key is gone", keys[i]);
+        }
+    }
+
+    check(idtable_size(table) == count, "size is right", count);
+}
+
+int main(int argc, char **argv)
+{
+    // A cluster that starts at the end of the table and wraps to the start.
+    size_t homes[] = { 62, 63, 62, 63, 0, 1, 62, 0 };
+    size_t nkeys = G_N_ELEMENTS(homes);
+    uint64_t keys[G_N_ELEMENTS(homes)];
+    bool present[G_N_ELEMENTS(homes)];
+    uint64_t pool[TEST_MAX_KEYS + 8];
+    bool inpool[TEST_MAX_KEYS + 8] = {0};
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    uint64_t next = 0;
+    idtable_t *table;
+    int removals = 0;
+
+    table = idtable_new(test_destroy);
+
+    for (size_t i = 0; i < nkeys; i++) {
+        keys[i]    = test_key(&next, homes[i]);
+        present[i] = true;
+        idtable_insert(table, keys[i], (void *) keys[i]);
+    }
+
+    check_table(table, keys, present, nkeys);
+
+    // Take them out from the front of the cluster, so everything after has
+    // to shift back across the end of the table.
+    for (size_t i = 0; i < nkeys; i++) {
+        check(idtable_remove(table, keys[i]), "key can be removed", keys[i]);
+        check(!idtable_remove(table, keys[i]), "key can't be removed twice", keys[i]);
+
+        present[i] = false;
+        removals++;
+
+        check_table(table, keys, present, nkeys);
+    }
+
+    // And from the middle.
+    for (size_t i = 0; i < nkeys; i++) {
+        present[i] = true;
+        idtable_insert(table, keys[i], (void *) keys[i]);
+    }
+
+    for (size_t i = nkeys / 2; i < nkeys + nkeys / 2; i++) {
+        idtable_remove(table, keys[i % nkeys]);
+
+        present[i % nkeys] = false;
+        removals++;
+
+        check_table(table, keys, present, nkeys);
+    }
+
+    check(destroyed == removals, "every removed value was destroyed", destroyed);
+
+    // Now lots of random inserts and removes, all clustered around the end
+    // of the table, without ever letting it grow.
+    for (size_t i = 0; i < G_N_ELEMENTS(pool); i++) {
+        pool[i] = test_key(&next, (TEST_SLOTS - 4 + i % 8) % TEST_SLOTS);
+    }
+
+    for (int round = 0; round < TEST_ROUNDS && failures == 0; round++) {
+        size_t i = test_random(&state) % G_N_ELEMENTS(pool);
+
+        if (inpool[i]) {
+            check(idtable_remove(table, pool[i]), "random key can be removed", pool[i]);
+            inpool[i] = false;
+        } else if (idtable_size(table) < TEST_MAX_KEYS) {
+            idtable_insert(table, pool[i], (void *) pool[i]);
+            inpool[i] = true;
+        }
+
+        check_table(table, pool, inpool, G_N_ELEMENTS(pool));
+    }
+
+    idtable_free(table);
+
+    return failures != 0;
+}
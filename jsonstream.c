@@ -0,0 +1,221 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <json.h>
+#include <glib.h>
+
+#include "jsonstream.h"
+
+// This only has to be long enough for the keys we're looking for.
+#define JSONSTREAM_MAX_KEY 16
+
+// We don't parse the structure around the things, just keep track of where
+// we are in it. That's enough to know when one of the arrays we want starts,
+// and where each element of it ends.
+struct jsonstream {
+    json_tokener    *tokener;
+    GByteArray      *thing;     // The element we're in the middle of.
+    int              depth;     // How many objects and arrays are open.
+    int              capture;   // The depth inside the array we want, or 0.
+    bool             element;   // Inside an element of that array.
+    bool             instring;
+    bool             escape;
+    bool             keyed;     // The last string was followed by a colon.
+    bool             started;
+    bool             failed;
+    char             key[JSONSTREAM_MAX_KEY];
+    size_t           keylen;
+    jsonstream_cb_t  callback;
+    void            *opaque;
+};
+
+jsonstream_t * jsonstream_new(jsonstream_cb_t callback, void *opaque)
+{
+    jsonstream_t *stream = g_new0(jsonstream_t, 1);
+
+    // The JSON_TOKENER_DEFAULT_DEPTH is too shallow for reddit, see
+    // https://github.com/taviso/nntpit/issues/7
+    if ((stream->tokener = json_tokener_new_ex(64)) == NULL) {
+        g_free(stream);
+        return NULL;
+    }
+
+    stream->thing    = g_byte_array_new();
+    stream->callback = callback;
+    stream->opaque   = opaque;
+    return stream;
+}
+
+void jsonstream_free(jsonstream_t *stream)
+{
+    if (stream == NULL)
+        return;
+
+    json_tokener_free(stream->tokener);
+    g_byte_array_free(stream->thing, true);
+    g_free(stream);
+}
+
+// Is the array that just opened one we want the elements of?
+static bool jsonstream_wanted(jsonstream_t *stream)
+{
+    return stream->keyed
+        && (strcmp(stream->key, "children") == 0
+         || strcmp(stream->key, "things") == 0);
+}
+
+static void jsonstream_key(jsonstream_t *stream, char c)
+{
+    // Too long to be one we're interested in.
+    if (stream->keylen == sizeof(stream->key) - 1) {
+        stream->key[0] = '\0';
+        return;
+    }
+
+    stream->key[stream->keylen++] = c;
+    stream->key[stream->keylen] = '\0';
+}
+
+// A complete element has been collected, parse it and pass it on.
+static int jsonstream_emit(jsonstream_t *stream)
+{
+    json_object *thing;
+
+    json_tokener_reset(stream->tokener);
+
+    thing = json_tokener_parse_ex(stream->tokener,
+                                  (const char *) stream->thing->data,
+                                  stream->thing->len);
+
+    g_byte_array_set_size(stream->thing, 0);
+
+    if (thing == NULL) {
+        g_warning("failed to parse a thing from the stream");
+        return -1;
+    }
+
+    stream->callback(thing, stream->opaque);
+
+    json_object_put(thing);
+    return 0;
+}
+
+// Feed the next part of the response, any things it completes are passed to
+// the callback before this returns.
+int jsonstream_feed(jsonstream_t *stream, const char *data, size_t len)
+{
+    size_t start = 0;   // Where the part of this chunk we're keeping starts.
+
+    if (stream->failed)
+        return -1;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+
+        if (stream->instring) {
+            if (stream->escape) {
+                stream->escape = false;
+            } else if (c == '\\') {
+                stream->escape = true;
+            } else if (c == '"') {
+                stream->instring = false;
+            } else if (!stream->element) {
+                jsonstream_key(stream, c);
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '"':
+                stream->instring = true;
+
+                if (!stream->element) {
+                    stream->keylen = 0;
+                    stream->key[0] = '\0';
+                    stream->keyed  = false;
+                }
+                break;
+
+            case ':':
+                stream->keyed = !stream->element;
+                break;
+
+            case '{':
+            case '[':
+                stream->started = true;
+
+                if (!stream->element
+                  && stream->capture
+                  && stream->depth == stream->capture
+                  && c == '{') {
+                    stream->element = true;
+                    start = i;
+                } else if (!stream->element && c == '[' && stream->capture == 0) {
+                    if (jsonstream_wanted(stream)) {
+                        stream->capture = stream->depth + 1;
+                    }
+                }
+
+                stream->depth++;
+                stream->keyed = false;
+                break;
+
+            case '}':
+            case ']':
+                if (--stream->depth < 0) {
+                    g_warning("unbalanced json in the stream");
+                    goto error;
+                }
+
+                if (stream->element && stream->depth == stream->capture) {
+                    g_byte_array_append(stream->thing, (const guint8 *) data + start, i - start + 1);
+
+                    stream->element = false;
+
+                    if (jsonstream_emit(stream) != 0)
+                        goto error;
+                } else if (!stream->element && stream->depth < stream->capture) {
+                    stream->capture = 0;
+                }
+
+                stream->keyed = false;
+                break;
+
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                break;
+
+            default:
+                stream->keyed = false;
+                break;
+        }
+    }
+
+    // Keep the rest of the element for next time.
+    if (stream->element) {
+        g_byte_array_append(stream->thing, (const guint8 *) data + start, len - start);
+    }
+
+    return 0;
+
+  error:
+    stream->failed = true;
+    return -1;
+}
+
+// Returns 0 if the whole response was seen.
+int jsonstream_finish(jsonstream_t *stream)
+{
+    if (stream->failed || !stream->started)
+        return -1;
+
+    if (stream->depth != 0 || stream->instring)
+        return -1;
+
+    return 0;
+}
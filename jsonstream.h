@@ -0,0 +1,26 @@
+#ifndef __JSONSTREAM_H
+#define __JSONSTREAM_H
+
+// A jsonstream picks reddit things out of a response while it's still
+// arriving. Every element of a "children" or "things" array is parsed and
+// handed to the callback as soon as its closing brace is seen, so only one
+// thing (and its replies) is ever held in memory, never the whole response.
+
+typedef struct jsonstream jsonstream_t;
+
+// The callback doesn't own the thing, take a reference to keep it.
+typedef void (*jsonstream_cb_t)(json_object *thing, void *opaque);
+
+jsonstream_t *
+jsonstream_new(jsonstream_cb_t callback, void *opaque);
+
+int
+jsonstream_feed(jsonstream_t *stream, const char *data, size_t len);
+
+int
+jsonstream_finish(jsonstream_t *stream);
+
+void
+jsonstream_free(jsonstream_t *stream);
+
+#endif
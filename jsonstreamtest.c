@@ -0,0 +1,123 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that the things in a response are found however it's split into
+// chunks, and that anything nested inside a thing stays part of it. Run with
+// `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <json.h>
+#include <glib.h>
+
+#include "jsonstream.h"
+
+// A comment thread, as reddit sends it. The reply has a children array of
+// its own, and the strings have brackets and quotes that aren't structure.
+static const char response[] =
+    "[{\"kind\": \"Listing\", \"data\": {\"after\": null, \"children\": ["
+        "{\"kind\": \"t3\", \"data\": {\"name\": \"t3_story\", \"title\": \"[meta] {\\\"children\\\": [\","
+            "\"selftext\": \"say \\\"}\\\" or \\\"]\\\"\"}}"
+    "]}},"
+    " {\"kind\": \"Listing\", \"data\": {\"after\": null, \"children\": ["
+        "{\"kind\": \"t1\", \"data\": {\"name\": \"t1_top\", \"body\": \"}]\\\\\","
+            "\"replies\": {\"kind\": \"Listing\", \"data\": {\"children\": ["
+                "{\"kind\": \"t1\", \"data\": {\"name\": \"t1_reply\", \"replies\": \"\"}}"
+            "]}}}},"
+        "{\"kind\": \"more\", \"data\": {\"name\": \"t1_more\", \"children\": [\"aaa\", \"bbb\"]}}"
+    "]}}]";
+
+static const char *expected = "t3_story t1_top(t1_reply) t1_more";
+
+static int failures;
+
+static void check(bool passed, const char *what, const char *found)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s, found %s\n", what, found);
+        failures++;
+    }
+}
+
+static const char * thing_name(json_object *thing)
+{
+    json_object *data;
+    json_object *name;
+
+    if (!json_object_object_get_ex(thing, "data", &data)
+     || !json_object_object_get_ex(data, "name", &name))
+        return "?";
+
+    return json_object_get_string(name);
+}
+
+// Record the name of each thing, and of any replies it contains.
+static void record_thing(json_object *thing, void *opaque)
+{
+    GString *found = opaque;
+    json_object *children;
+
+    g_string_append_printf(found, "%s%s", found->len ? " " : "", thing_name(thing));
+
+    if (json_object_object_get_ex(thing, "data", &children)
+     && json_object_object_get_ex(children, "replies", &children)
+     && json_object_object_get_ex(children, "data", &children)
+     && json_object_object_get_ex(children, "children", &children)) {
+        for (size_t i = 0; i < json_object_array_length(children); i++) {
+            g_string_append_printf(found, "%s%s", i ? " " : "(", thing_name(json_object_array_get_idx(children, i)));
+        }
+
+        g_string_append(found, ")");
+    }
+}
+
+// Feed the response in chunks of size, and then the rest.
+static void check_chunks(size_t first, size_t size)
+{
+    GString *found = g_string_new(NULL);
+    jsonstream_t *stream = jsonstream_new(record_thing, found);
+    size_t len = strlen(response);
+    size_t offset = MIN(first, len);
+    bool fed;
+
+    fed = jsonstream_feed(stream, response, offset) == 0;
+
+    for (; fed && offset < len; offset += size) {
+        fed = jsonstream_feed(stream, response + offset, MIN(size, len - offset)) == 0;
+    }
+
+    check(fed, "the whole response can be fed", found->str);
+    check(jsonstream_finish(stream) == 0, "the whole response was seen", found->str);
+    check(strcmp(found->str, expected) == 0, "every thing was found once", found->str);
+
+    jsonstream_free(stream);
+    g_string_free(found, true);
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = strlen(response);
+    GString *found = g_string_new(NULL);
+    jsonstream_t *stream;
+
+    // Every place it could be split in two, and then one byte at a time.
+    for (size_t i = 0; i <= len; i++) {
+        check_chunks(i, len);
+    }
+
+    check_chunks(0, 1);
+
+    // A truncated response passes on what it had, but isn't complete.
+    stream = jsonstream_new(record_thing, found);
+
+    check(jsonstream_feed(stream, response, len / 2) == 0, "half a response can be fed", found->str);
+    check(jsonstream_finish(stream) != 0, "half a response is incomplete", found->str);
+    check(strcmp(found->str, "t3_story") == 0, "things before the truncation are found", found->str);
+
+    jsonstream_free(stream);
+    g_string_free(found, true);
+
+    return failures != 0;
+}
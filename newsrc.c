@@ -0,0 +1,504 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <json.h>
+#include <glib.h>
+
+#include "newsrc.h"
+#include "reddit.h"
+#include "idtable.h"
+#include "rcu.h"
+
+static group_t * newsrc_group_new(const char *name, int low)
+{
+    group_t *group = g_new0(group_t, 1);
+
+    group->name     = g_strdup(name);
+    group->low      = low;
+    group->articles = g_array_new(false, true, sizeof(uint64_t));
+    group->numbers  = idtable_new(NULL);
+    group->dirty    = true;
+
+    return group;
+}
+
+static void newsrc_group_free(group_t *group)
+{
+    // Nobody can be reading any more.
+    g_free(group->published);
+    idtable_free(group->numbers);
+    g_array_free(group->articles, true);
+    g_free(group->after);
+    g_free(group->name);
+    g_free(group);
+}
+
+static void newsrc_add_group(newsrc_t *newsrc, group_t *group)
+{
+    grouplist_t *list = g_malloc(sizeof(grouplist_t) + (newsrc->groups->len + 1) * sizeof(group_t *));
+    grouplist_t *old = newsrc->published;
+
+    g_ptr_array_add(newsrc->groups, group);
+    g_hash_table_insert(newsrc->names, group->name, group);
+
+    newsrc_publish(group);
+
+    // Groups are added rarely, so just copy the whole list.
+    list->count = newsrc->groups->len;
+    memcpy(list->groups, newsrc->groups->pdata, list->count * sizeof(group_t *));
+
+    rcu_publish(newsrc->published, list);
+
+    if (old) {
+        rcu_retire(old, g_free);
+    }
+}
+
+// Put id at a specific number, used while loading.
+static void newsrc_place(group_t *group, const char *id, int number)
+{
+    uint64_t key = reddit_name_key(id);
+
+    if (key == 0) {
+        g_warning("ignoring bad id %s in %s", id, group->name);
+        return;
+    }
+
+    if (number < group->low || idtable_contains(group->numbers, key))
+        return;
+
+    if (number - group->low >= group->articles->len)
+        g_array_set_size(group->articles, number - group->low + 1);
+
+    if (g_array_index(group->articles, uint64_t, number - group->low)) {
+        g_warning("article number %d in %s was used twice", number, group->name);
+        return;
+    }
+
+    g_array_index(group->articles, uint64_t, number - group->low) = key;
+    idtable_insert(group->numbers, key, GINT_TO_POINTER(number));
+}
+
+// Older versions stored each group as an object mapping id => number.
+static group_t * newsrc_load_legacy(const char *name, json_object *groupmap)
+{
+    group_t *group;
+    int low = 0;
+
+    json_object_object_foreach(groupmap, id, number) {
+        if (low == 0 || json_object_get_int(number) < low)
+            low = json_object_get_int(number);
+    }
+
+    group = newsrc_group_new(name, low ? low : 1);
+
+    json_object_object_foreach(groupmap, key, artnum) {
+        newsrc_place(group, key, json_object_get_int(artnum));
+    }
+
+    return group;
+}
+
+static group_t * newsrc_load_group(const char *name, json_object *groupmap)
+{
+    json_object *articles;
+    json_object *low = NULL;
+    json_object *interval;
+    json_object *backfill;
+    group_t *group;
+
+    if (!json_object_object_get_ex(groupmap, "articles", &articles)
+     || !json_object_is_type(articles, json_type_array)) {
+        return newsrc_load_legacy(name, groupmap);
+    }
+
+    if (!json_object_object_get_ex(groupmap, "low", &low)) {
+        g_warning("group %s in newsrc has no low watermark, assuming 1", name);
+    }
+
+    group = newsrc_group_new(name, low ? json_object_get_int(low) : 1);
+
+    if (json_object_object_get_ex(groupmap, "interval", &interval)) {
+        group->interval = json_object_get_int(interval);
+    }
+
+    if (json_object_object_get_ex(groupmap, "after", &backfill)
+     && json_object_is_type(backfill, json_type_string)) {
+        group->after = g_strdup(json_object_get_string(backfill));
+    }
+
+    if (json_object_object_get_ex(groupmap, "pages", &backfill)) {
+        group->pages = json_object_get_int(backfill);
+    }
+
+    if (json_object_object_get_ex(groupmap, "backfilled", &backfill)) {
+        group->backfilled = json_object_get_boolean(backfill);
+    }
+
+    for (size_t i = 0; i < json_object_array_length(articles); i++) {
+        json_object *id = json_object_array_get_idx(articles, i);
+
+        // Holes are stored as null.
+        if (!json_object_is_type(id, json_type_string))
+            continue;
+
+        newsrc_place(group, json_object_get_string(id), group->low + i);
+    }
+
+    // Keep any holes at the end, those numbers were used.
+    g_array_set_size(group->articles, MAX(group->articles->len, json_object_array_length(articles)));
+
+    return group;
+}
+
+static gint newsrc_compare_names(const char **a, const char **b)
+{
+    return strcmp(*a, *b);
+}
+
+// Each group is saved in its own file in this directory, so a save only
+// writes the groups that changed.
+static char * newsrc_directory(const char *path)
+{
+    return g_strdup_printf("%s.d", path);
+}
+
+// Older versions saved every group in one file at path.
+static void newsrc_import(newsrc_t *newsrc, const char *path)
+{
+    json_object *groups;
+
+    // Use an empty newsrc if that didn't work.
+    if ((groups = json_object_from_file(path)) == NULL)
+        return;
+
+    g_debug("importing groups from %s, they'll be saved separately", path);
+
+    json_object_object_foreach(groups, name, groupmap) {
+        newsrc_add_group(newsrc, newsrc_load_group(name, groupmap));
+    }
+
+    json_object_put(groups);
+}
+
+newsrc_t * newsrc_open(const char *path)
+{
+    newsrc_t *newsrc = g_new0(newsrc_t, 1);
+    char *directory = newsrc_directory(path);
+    GPtrArray *names;
+    const char *name;
+    GDir *dir;
+
+    newsrc->groups = g_ptr_array_new();
+    newsrc->names  = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if ((dir = g_dir_open(directory, 0, NULL)) == NULL) {
+        newsrc_import(newsrc, path);
+        g_free(directory);
+        return newsrc;
+    }
+
+    names = g_ptr_array_new_with_free_func(g_free);
+
+    // Temporary files start with a dot, and so can't be a group.
+    while ((name = g_dir_read_name(dir))) {
+        if (*name != '.')
+            g_ptr_array_add(names, g_strdup(name));
+    }
+
+    g_dir_close(dir);
+
+    // The directory order is arbitrary, keep LIST stable.
+    g_ptr_array_sort(names, (GCompareFunc) newsrc_compare_names);
+
+    for (guint i = 0; i < names->len; i++) {
+        char *file = g_strdup_printf("%s/%s", directory, (char *) g_ptr_array_index(names, i));
+        json_object *groupmap = json_object_from_file(file);
+        group_t *group;
+
+        if (groupmap == NULL) {
+            g_warning("failed to load group from %s", file);
+            g_free(file);
+            continue;
+        }
+
+        group = newsrc_load_group(g_ptr_array_index(names, i), groupmap);
+        group->dirty = false;
+
+        newsrc_add_group(newsrc, group);
+
+        json_object_put(groupmap);
+        g_free(file);
+    }
+
+    g_ptr_array_free(names, true);
+    g_free(directory);
+    return newsrc;
+}
+
+static json_object * newsrc_group_json(group_t *group)
+{
+    json_object *groupmap = json_object_new_object();
+    json_object *articles = json_object_new_array();
+
+    for (guint n = 0; n < group->articles->len; n++) {
+        uint64_t key = g_array_index(group->articles, uint64_t, n);
+        char name[REDDIT_MAX_NAME];
+
+        // The names are regenerated from the keys.
+        json_object_array_add(articles, key ? json_object_new_string(reddit_key_name(key, name)) : NULL);
+    }
+
+    json_object_object_add(groupmap, "low", json_object_new_int(group->low));
+    json_object_object_add(groupmap, "articles", articles);
+
+    if (group->interval) {
+        json_object_object_add(groupmap, "interval", json_object_new_int(group->interval));
+    }
+
+    if (group->after) {
+        json_object_object_add(groupmap, "after", json_object_new_string(group->after));
+    }
+
+    if (group->pages) {
+        json_object_object_add(groupmap, "pages", json_object_new_int(group->pages));
+    }
+
+    if (group->backfilled) {
+        json_object_object_add(groupmap, "backfilled", json_object_new_boolean(true));
+    }
+
+    return groupmap;
+}
+
+// Write a group to a temporary file first, so a crash can't leave it
+// half written.
+static int newsrc_save_group(group_t *group, const char *directory)
+{
+    char *temp = g_strdup_printf("%s/.%s", directory, group->name);
+    char *name = g_strdup_printf("%s/%s", directory, group->name);
+    json_object *groupmap = newsrc_group_json(group);
+    int result = 0;
+
+    if (json_object_to_file(temp, groupmap) != 0 || rename(temp, name) != 0) {
+        g_warning("failed to save group %s to %s", group->name, name);
+        unlink(temp);
+        result = -1;
+    }
+
+    json_object_put(groupmap);
+    g_free(temp);
+    g_free(name);
+    return result;
+}
+
+// Save every group that changed since the last save.
+int newsrc_save(newsrc_t *newsrc, const char *path)
+{
+    char *directory = newsrc_directory(path);
+    int result = 0;
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        g_warning("failed to create newsrc directory %s, %s", directory, strerror(errno));
+        g_free(directory);
+        return -1;
+    }
+
+    for (guint i = 0; i < newsrc->groups->len; i++) {
+        group_t *group = g_ptr_array_index(newsrc->groups, i);
+
+        if (!group->dirty)
+            continue;
+
+        // Group names become filenames, so be careful.
+        if (strchr(group->name, '/') || *group->name == '.' || *group->name == '\0') {
+            g_warning("refusing to save strange group name %s", group->name);
+            continue;
+        }
+
+        if (newsrc_save_group(group, directory) != 0) {
+            result = -1;
+            continue;
+        }
+
+        group->dirty = false;
+    }
+
+    g_free(directory);
+    return result;
+}
+
+void newsrc_close(newsrc_t *newsrc)
+{
+    if (newsrc == NULL)
+        return;
+
+    for (guint i = 0; i < newsrc->groups->len; i++) {
+        newsrc_group_free(g_ptr_array_index(newsrc->groups, i));
+    }
+
+    g_hash_table_destroy(newsrc->names);
+    g_ptr_array_free(newsrc->groups, true);
+    g_free(newsrc->published);
+    g_free(newsrc);
+}
+
+group_t * newsrc_lookup(newsrc_t *newsrc, const char *name)
+{
+    return g_hash_table_lookup(newsrc->names, name);
+}
+
+group_t * newsrc_subscribe(newsrc_t *newsrc, const char *name)
+{
+    group_t *group = newsrc_lookup(newsrc, name);
+
+    if (group == NULL) {
+        g_debug("group %s was not in the article map, I'm adding it", name);
+
+        group = newsrc_group_new(name, 1);
+
+        newsrc_add_group(newsrc, group);
+    }
+
+    return group;
+}
+
+// Translate an article number into a spool key, or zero if there isn't one.
+uint64_t newsrc_article(group_t *group, int number)
+{
+    if (number < group->low || number - group->low >= group->articles->len)
+        return 0;
+
+    return g_array_index(group->articles, uint64_t, number - group->low);
+}
+
+// Translate a spool key into an article number, or zero if it has none.
+int newsrc_number(group_t *group, uint64_t key)
+{
+    return GPOINTER_TO_INT(idtable_lookup(group->numbers, key));
+}
+
+// Give key the next article number, unless it already has one.
+int newsrc_assign(group_t *group, uint64_t key)
+{
+    int number = newsrc_number(group, key);
+
+    if (number != 0)
+        return number;
+
+    number = group->low + group->articles->len;
+
+    group->dirty = true;
+
+    g_array_append_val(group->articles, key);
+    idtable_insert(group->numbers, key, GINT_TO_POINTER(number));
+
+    return number;
+}
+
+// Forget the number key had, e.g. because it was expunged, and return it.
+// Numbers are never reused, so this leaves a hole, unless it was the lowest
+// one and the low watermark can move up instead.
+int newsrc_unassign(group_t *group, uint64_t key)
+{
+    int number = newsrc_number(group, key);
+    guint holes = 0;
+
+    if (number == 0)
+        return 0;
+
+    idtable_remove(group->numbers, key);
+
+    g_array_index(group->articles, uint64_t, number - group->low) = 0;
+
+    group->dirty      = true;
+    group->unassigned = true;
+
+    if (number != group->low)
+        return number;
+
+    while (holes < group->articles->len && g_array_index(group->articles, uint64_t, holes) == 0)
+        holes++;
+
+    // Keep the last slot, so the high watermark doesn't move back.
+    holes = MIN(holes, group->articles->len - 1);
+
+    g_array_remove_range(group->articles, 0, holes);
+
+    group->low += holes;
+    return number;
+}
+
+// Let readers see the article numbers assigned since the last call.
+void newsrc_publish(group_t *group)
+{
+    artmap_t *map;
+    artmap_t *old = group->published;
+
+    if (old && old->low == group->low && old->count == group->articles->len && !group->unassigned)
+        return;
+
+    group->unassigned = false;
+
+    map        = g_malloc(sizeof(artmap_t) + group->articles->len * sizeof(uint64_t));
+    map->low   = group->low;
+    map->count = group->articles->len;
+
+    if (map->count)
+        memcpy(map->keys, group->articles->data, map->count * sizeof(uint64_t));
+
+    rcu_publish(group->published, map);
+
+    if (old) {
+        rcu_retire(old, g_free);
+    }
+}
+
+// The rest are for readers, they don't need the spool lock but the thread
+// must be online, see rcu.h.
+grouplist_t * newsrc_groups(newsrc_t *newsrc)
+{
+    return rcu_load(newsrc->published);
+}
+
+group_t * newsrc_find(newsrc_t *newsrc, const char *name)
+{
+    grouplist_t *list = newsrc_groups(newsrc);
+
+    for (unsigned i = 0; list && i < list->count; i++) {
+        if (strcmp(list->groups[i]->name, name) == 0)
+            return list->groups[i];
+    }
+
+    return NULL;
+}
+
+artmap_t * newsrc_snapshot(group_t *group)
+{
+    return rcu_load(group->published);
+}
+
+uint64_t artmap_article(const artmap_t *map, int number)
+{
+    if (number < map->low || number - map->low >= map->count)
+        return 0;
+
+    return map->keys[number - map->low];
+}
+
+int artmap_highwatermark(const artmap_t *map)
+{
+    return map->count ? map->low + map->count - 1 : 0;
+}
+
+int artmap_lowwatermark(const artmap_t *map)
+{
+    return map->count ? map->low : 0;
+}
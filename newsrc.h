@@ -0,0 +1,97 @@
+#ifndef __NEWSRC_H
+#define __NEWSRC_H
+
+// The newsrc records every group we know about, and the article numbers we
+// have assigned to spool objects in each one. Numbers are never reused, so
+// they have to be stable across restarts for newsreaders to track what has
+// been read.
+//
+// Each group is saved to its own file in the newsrc.d directory, and only
+// when it has changed.
+
+// What readers see of a group's article numbers. Once published it never
+// changes, the writer publishes a new one instead, see rcu.h.
+typedef struct artmap {
+    int          low;       // The article number of keys[0].
+    unsigned     count;
+    uint64_t     keys[];    // Article number - low => spool key, or 0.
+} artmap_t;
+
+typedef struct group {
+    char        *name;
+    int          low;       // The article number of articles[0].
+    GArray      *articles;  // Article number - low => spool key, or 0.
+    struct idtable *numbers;// Spool key => article number.
+    int          interval;  // Seconds between refreshes, or 0 for the default.
+    char        *after;     // Where backfilling older stories will resume.
+    int          pages;     // How many pages have been backfilled.
+    bool         backfilled;// Nothing older left to backfill.
+    bool         dirty;     // Changed since it was last saved.
+    bool         unassigned;// A number was removed since it was published.
+    artmap_t    *published; // The articles as readers see them.
+} group_t;
+
+// What readers see of the list of groups. Groups are never removed, so
+// their pointers stay valid.
+typedef struct grouplist {
+    unsigned     count;
+    group_t     *groups[];
+} grouplist_t;
+
+// Everything but the published snapshots can only be used with the spool
+// lock held.
+typedef struct newsrc {
+    GPtrArray   *groups;    // Every group_t, in the order they were added.
+    GHashTable  *names;     // Group name => group_t.
+    grouplist_t *published; // The groups as readers see them.
+} newsrc_t;
+
+newsrc_t *
+newsrc_open(const char *path);
+
+int
+newsrc_save(newsrc_t *newsrc, const char *path);
+
+void
+newsrc_close(newsrc_t *newsrc);
+
+group_t *
+newsrc_lookup(newsrc_t *newsrc, const char *name);
+
+group_t *
+newsrc_subscribe(newsrc_t *newsrc, const char *name);
+
+uint64_t
+newsrc_article(group_t *group, int number);
+
+int
+newsrc_number(group_t *group, uint64_t key);
+
+int
+newsrc_assign(group_t *group, uint64_t key);
+
+int
+newsrc_unassign(group_t *group, uint64_t key);
+
+void
+newsrc_publish(group_t *group);
+
+grouplist_t *
+newsrc_groups(newsrc_t *newsrc);
+
+group_t *
+newsrc_find(newsrc_t *newsrc, const char *name);
+
+artmap_t *
+newsrc_snapshot(group_t *group);
+
+uint64_t
+artmap_article(const artmap_t *map, int number);
+
+int
+artmap_highwatermark(const artmap_t *map);
+
+int
+artmap_lowwatermark(const artmap_t *map);
+
+#endif
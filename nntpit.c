@@ -27,6 +27,8 @@
 #include  <stdarg.h>
 #include  <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include  <ev.h>
 
@@ -38,11 +40,28 @@
 
 #include "json_object.h"
 #include "jsonutil.h"
+#include "newsrc.h"
 #include "reddit.h"
+#include "artcache.h"
+#include "rcu.h"
+#include "fetch.h"
+#include "scheduler.h"
 
-static json_object *newsrc;
-static json_object *spool;
-static json_object *groupset;
+static newsrc_t *newsrc;
+static spool_t *spool;
+static scheduler_t *scheduler;
+static artcache_t *articles;
+
+// Seconds between background refreshes of each group, 0 disables them.
+static int refresh_interval = 600;
+static int backfill_pages = 0;
+static int backfill_days = 14;
+
+// Megabytes of rendered articles to keep, 0 disables the cache.
+static int article_cache_size = 32;
+
+// Seconds between looking for old articles to expunge.
+#define EXPUNGE_INTERVAL (60 * 60)
 
 char  *listen_host;
 char  *port;
@@ -58,8 +77,11 @@ typedef struct thread {
   struct ev_loop    *th_loop;
   pthread_mutex_t    th_mtx;
   struct ev_prepare  th_deadlist_ev;
+  struct ev_check    th_online_ev;
   struct client   *th_deadlist;
 
+  fetcher_t   *th_fetcher;
+
   int     *th_accept;
   int      th_naccept;
   int      th_acceptsize;
@@ -70,6 +92,7 @@ typedef struct thread {
          th_nrefuse,
          th_ndefer,
          th_nreject;
+  charq_stats_t    th_cqstats;
   ev_timer     th_stats;
 } thread_t;
 
@@ -81,15 +104,30 @@ void   thread_wakeup(struct ev_loop *, ev_async *, int);
 void  *thread_run(void *);
 void   thread_accept(thread_t *);
 void   thread_deadlist(struct ev_loop *, ev_prepare *w, int revents);
+void   thread_online(struct ev_loop *, ev_check *w, int revents);
 void   do_thread_stats(struct ev_loop *, ev_timer *w, int);
 
 typedef enum client_state {
   CL_NORMAL,
   CL_TAKETHIS,
-  CL_IHAVE
+  CL_IHAVE,
+  CL_WAITING
 } client_state_t;
 
 #define CL_DEAD   0x1
+#define CL_PAUSED 0x2 /* Not reading, see client_run */
+
+/*
+ * Replies are queued and written once all the commands we have are handled,
+ * or sooner if this much is waiting.
+ */
+#define CL_HIGHWATER  (64 * 1024)
+
+/*
+ * A client with this much waiting to be written isn't keeping up, so stop
+ * handling its commands until it's read some.
+ */
+#define CL_WRLIMIT  (1024 * 1024)
 
 typedef struct client {
   thread_t  *cl_thread;
@@ -101,14 +139,20 @@ typedef struct client {
   client_state_t   cl_state;
   int    cl_flags;
   char    *cl_msgid;
+  refresh_t *cl_refresh;
+  group_t   *cl_group;  /* Selected by GROUP, or NULL */
+  int    cl_article;  /* Current article number, 0 if there isn't one */
   struct client *cl_next;
 } client_t;
 
 void  client_read(struct ev_loop *, ev_io *, int);
+void  client_process(client_t *);
+void  client_run(client_t *);
 void  client_write(struct ev_loop *, ev_io *, int);
 void  client_flush(client_t *);
 void  client_close(client_t *);
 void  client_send(client_t *, char const *);
+void  client_send_article(client_t *, article_t const *, size_t, size_t);
 void  client_printf(client_t *, char const *, ...);
 void  client_vprintf(client_t *, char const *, va_list);
 
@@ -121,6 +165,7 @@ void  listener_accept(struct ev_loop *, ev_io *, int);
 
 struct ev_loop  *main_loop;
 ev_timer   stats_timer;
+ev_timer   expunge_timer;
 time_t     start_time;
 
 void   usage(char const *);
@@ -134,20 +179,45 @@ usage(p)
   char const  *p;
 {
   fprintf(stderr,
-"usage: %s [-VDhIS] [-t <threads>] [-l <host>] [-p <port>] [subreddit] [subreddit] ...\n"
+"usage: %s [-VDhISR] [-t <threads>] [-r <seconds>] [-b <pages>] [-a <days>] [-c <megabytes>] [-l <host>] [-p <port>] [subreddit] [subreddit] ...\n"
 "\n"
 "    -V                   print version and exit\n"
 "    -h                   print this text\n"
-"    -D                   show data sent/received\n"
+"    -D                   show data sent/received, and statistics every minute\n"
 "    -I                   support IHAVE only (not streaming)\n"
 "    -S                   support streaming only (not IHAVE)\n"
+"    -R                   also keep everything reddit sends in spool.raw\n"
 "    -l <host>            address to listen on (default: localhost)\n"
 "    -p <port>            port to listen on (default: 119)\n"
 "    -t <threads>         number of processing threads (default: 1)\n"
+"    -r <seconds>         how often to refresh each group, 0 to only refresh\n"
+"                         when a client asks for it (default: 600)\n"
+"    -b <pages>           backfill up to this many pages of older stories\n"
+"                         in each group (default: 0)\n"
+"    -a <days>            don't backfill stories older than this (default: 14)\n"
+"    -c <megabytes>       memory to keep recently read articles in, 0 to\n"
+"                         generate them every time (default: 32)\n"
 "    [subreddit]          optionally force-add these subs to the database\n"
 , p);
 }
 
+// Remove old articles from the spool, and save whatever that changed.
+static void do_expunge(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    reddit_spool_lock(spool);
+    reddit_spool_expunge(spool, newsrc);
+    newsrc_save(newsrc, "newsrc");
+    reddit_spool_sync(spool);
+    reddit_spool_unlock(spool);
+}
+
+// The spool calls this when an object changes, so its article gets generated
+// again next time.
+static void article_changed(uint64_t key, void *opaque)
+{
+    artcache_forget(opaque, key);
+}
+
 int main(int argc, char **argv)
 {
     int  c, i;
@@ -155,16 +225,20 @@ int main(int argc, char **argv)
     struct addrinfo *res, *r, hints;
 
 
-    newsrc = json_object_from_file("newsrc");
-    spool = json_object_from_file("spool");
+    if (fetch_global_init() != 0) {
+        fprintf(stderr, "%s: failed to initialize the fetcher\n", progname);
+        return 1;
+    }
 
-    // Use an empty spool if that didn't work.
-    spool = spool ? spool : json_object_new_object();
+    newsrc = newsrc_open("newsrc");
+    spool = reddit_spool_open("spool");
 
-    // Use an empty newsrc if that didn't work.
-    newsrc = newsrc ? newsrc : json_object_new_object();
+    if (spool == NULL) {
+        fprintf(stderr, "%s: failed to open the spool\n", progname);
+        return 1;
+    }
 
-    while ((c = getopt(argc, argv, "VDSIhl:p:t:")) != -1) {
+    while ((c = getopt(argc, argv, "VDSIRhl:p:t:r:b:a:c:")) != -1) {
         switch (c) {
             case 'V':
                 printf("nntpit %s\n", PACKAGE_VERSION);
@@ -174,6 +248,13 @@ int main(int argc, char **argv)
                 debug++;
                 break;
 
+            case 'R':
+                if (reddit_spool_keep_raw(spool, "spool.raw") != 0) {
+                    fprintf(stderr, "%s: failed to open the raw spool\n", progname);
+                    return 1;
+                }
+                break;
+
             case 'I':
                 do_streaming = 0;
                 break;
@@ -200,6 +281,38 @@ int main(int argc, char **argv)
                 }
                 break;
 
+            case 'r':
+                if ((refresh_interval = atoi(optarg)) < 0) {
+                    fprintf(stderr, "%s: refresh interval must not be negative\n",
+                            argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                if ((backfill_pages = atoi(optarg)) < 0) {
+                    fprintf(stderr, "%s: backfill pages must not be negative\n",
+                            argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'a':
+                if ((backfill_days = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "%s: backfill age must be greater than zero\n",
+                            argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'c':
+                if ((article_cache_size = atoi(optarg)) < 0) {
+                    fprintf(stderr, "%s: article cache size must not be negative\n",
+                            argv[0]);
+                    return 1;
+                }
+                break;
+
             case 'h':
                 usage(argv[0]);
                 return 0;
@@ -219,6 +332,11 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (article_cache_size) {
+        articles = artcache_new((size_t) article_cache_size << 20);
+        reddit_spool_watch(spool, article_changed, articles);
+    }
+
     if (!listen_host)
         listen_host = strdup("localhost");
 
@@ -309,14 +427,24 @@ int main(int argc, char **argv)
 
     freeaddrinfo(res);
 
-    //ev_timer_init(&stats_timer, do_stats, 60., 60.);
-    //ev_timer_start(main_loop, &stats_timer);
+    // Expunging looks at everything in the spool, so it isn't done on every
+    // save.
+    ev_timer_init(&expunge_timer, do_expunge, 60., EXPUNGE_INTERVAL);
+    ev_timer_start(main_loop, &expunge_timer);
+
+    // The fetcher, article cache and buffer pool counters are only worth
+    // printing when debugging.
+    if (debug) {
+        ev_timer_init(&stats_timer, do_stats, 60., 60.);
+        ev_timer_start(main_loop, &stats_timer);
+    }
 
     threads = xcalloc(nthreads, sizeof(thread_t));
     for (i = 0; i < nthreads; i++) {
         thread_t  *th = &threads[i];
 
         th->th_loop = ev_loop_new(ev_supported_backends());
+        th->th_fetcher = fetcher_new(th->th_loop);
 
         ev_async_init(&th->th_wakeup, thread_wakeup);
         th->th_wakeup.data = th;
@@ -324,6 +452,10 @@ int main(int argc, char **argv)
         ev_prepare_init(&th->th_deadlist_ev, thread_deadlist);
         th->th_deadlist_ev.data = th;
 
+        /* Before any other callbacks, they may read spool snapshots. */
+        ev_check_init(&th->th_online_ev, thread_online);
+        ev_set_priority(&th->th_online_ev, EV_MAXPRI);
+
         ev_timer_init(&th->th_stats, do_thread_stats, .1, .1); 
         th->th_stats.data = th;
 
@@ -331,14 +463,20 @@ int main(int argc, char **argv)
         pthread_create(&th->th_id, NULL, thread_run, th);
     }
 
+    if (refresh_interval) {
+        scheduler = scheduler_start(spool, newsrc, refresh_interval, backfill_pages, backfill_days);
+    }
+
     time(&start_time);
     ev_run(main_loop, 0);
 
-    reddit_spool_expunge(spool);
-    json_object_to_file("newsrc", newsrc);
-    json_object_to_file("spool", spool);
-    json_object_put(newsrc);
-    json_object_put(spool);
+    scheduler_stop(scheduler);
+
+    newsrc_save(newsrc, "newsrc");
+    reddit_spool_close(spool);
+    artcache_free(articles);
+    newsrc_close(newsrc);
+    fetch_global_cleanup();
     return 0;
 }
 
@@ -349,6 +487,7 @@ thread_run(p)
 thread_t  *th = p;
   ev_async_start(th->th_loop, &th->th_wakeup);
   ev_prepare_start(th->th_loop, &th->th_deadlist_ev);
+  ev_check_start(th->th_loop, &th->th_online_ev);
   ev_timer_start(th->th_loop, &th->th_stats);
   ev_run(th->th_loop, 0);
   return NULL;
@@ -434,12 +573,18 @@ void client_write(struct ev_loop *loop, ev_io *w, int revents)
 {
     client_t *cl = w->data;
     client_flush(cl);
+
+    // Start on its commands again once it's read a good part of the backlog.
+    if ((cl->cl_flags & CL_PAUSED) && cq_len(cl->cl_wrbuf) < CL_WRLIMIT / 2)
+        client_run(cl);
 }
 
 void
 client_destroy(cl)
   client_t  *cl;
 {
+  if (cl->cl_refresh)
+    fetch_subreddit_detach(cl->cl_refresh);
   close(cl->cl_fd);
   cq_free(cl->cl_rdbuf);
   cq_free(cl->cl_wrbuf);
@@ -469,6 +614,12 @@ struct ev_loop  *loop = th->th_loop;
     return;
   }
 
+  /* A short write means the socket is full, wait until there's room. */
+  if (cq_len(cl->cl_wrbuf)) {
+    ev_io_start(loop, &cl->cl_writable);
+    return;
+  }
+
   ev_io_stop(loop, &cl->cl_writable);
 }
 
@@ -496,19 +647,40 @@ client_send(cl, s)
   char const  *s;
 {
   cq_append(cl->cl_wrbuf, s, strlen(s));
-  if (cq_len(cl->cl_wrbuf) > 1024)
+  if (cq_len(cl->cl_wrbuf) > CL_HIGHWATER)
     client_flush(cl);
 }
 
+// Queue part of a rendered article, the client keeps a reference to it until
+// it's been written rather than copying it.
+void
+client_send_article(client_t *cl, article_t const *article, size_t offset, size_t len)
+{
+    const char *data = g_bytes_get_data(article->blob, NULL);
+
+    cq_append_ref(cl->cl_wrbuf,
+                  data + offset,
+                  len,
+                  (charq_release_t) g_bytes_unref,
+                  g_bytes_ref(article->blob));
+
+    if (cq_len(cl->cl_wrbuf) > CL_HIGHWATER)
+        client_flush(cl);
+}
+
 void
 client_vprintf(client_t *cl, char const *fmt, va_list ap)
 {
 char  line[1024];
 int n;
   n = vsnprintf(line, sizeof(line), fmt, ap);
+  if (n < 0)
+    return;
+  if (n >= sizeof(line))
+    n = sizeof(line) - 1;
   cq_append(cl->cl_wrbuf, line, n);
 
-  //if (cq_len(cl->cl_wrbuf) > 1024)
+  if (cq_len(cl->cl_wrbuf) > CL_HIGHWATER)
     client_flush(cl);
 }
 
@@ -527,12 +699,15 @@ void handle_list_cmd(client_t *cl, const char *param)
     if (!param || strcasecmp(param, "ACTIVE") == 0) {
         client_printf(cl, "215 subreddits available\r\n");
 
+        grouplist_t *list = newsrc_groups(newsrc);
+
         // The syntax is documented here: https://tools.ietf.org/html/rfc977#section-3.6.1
-        json_object_object_foreach(newsrc, group, artmap) {
+        for (unsigned i = 0; list && i < list->count; i++) {
+            artmap_t *map = newsrc_snapshot(list->groups[i]);
             client_printf(cl, "%s %d %d n\r\n",
-                              group,
-                              reddit_spool_highwatermark(artmap),
-                              reddit_spool_lowwatermark(artmap));
+                              list->groups[i]->name,
+                              artmap_highwatermark(map),
+                              artmap_lowwatermark(map));
         }
 
         client_printf(cl, ".\r\n");
@@ -551,13 +726,9 @@ void handle_list_cmd(client_t *cl, const char *param)
     }
 
     client_printf(cl, "501 keyword not recognized, see 7.6.2\r\n");
-    client_flush(cl);
     return;
 }
 
-// See comments.c
-unsigned str_count_newlines(const char *string);
-
 void handle_xover_cmd(client_t *cl, const char *param)
 {
     /* PARAM:
@@ -569,16 +740,24 @@ void handle_xover_cmd(client_t *cl, const char *param)
     /* Output: CRLF-separated stream of
          number TAB subject TAB author TAB date TAB message-id TAB references TAB byte-count TAB line-count
     */
-    json_object *object;
     char* endptr = NULL;
-    char* references;
+    char* lines;
+    size_t len;
     int end = INT_MAX;
-    if (!param) {
+
+    if (!cl->cl_group) {
+        client_send(cl, "412 No newsgroup selected\r\n");
+        return;
+    }
+
+    // With no range, it's just the current article.
+    if (!param && cl->cl_article == 0) {
         client_send(cl, "420 No current article selected\r\n");
         return;
     }
-    int beginning = strtol(param, &endptr, 10);
-    if (endptr && *endptr == '-') {
+
+    int beginning = param ? strtol(param, &endptr, 10) : cl->cl_article;
+    if (param && endptr && *endptr == '-') {
         param = endptr + 1;
         if (*param) {
             end = strtol(param, &endptr, 10);
@@ -587,104 +766,54 @@ void handle_xover_cmd(client_t *cl, const char *param)
                 return;
             }
         }
+    } else {
+        end = beginning;
     }
 
-    client_send(cl, "224 Overview information follows\r\n");
-    json_object_object_foreach(groupset, msg, artnum) {
-        int i = json_object_get_int(artnum);
-        if (i >= beginning && i <= end) {
-            // Now we lookup that id in the spool file.
-            if (json_object_object_get_ex(spool, msg, &object)) {
-                json_object *data;
-                json_object *created;
-                time_t unixtime;
-                char date[128];
-                const char *body;
-                int byte_count;
-                unsigned line_count;
-                bool iscomment;
-
-                if (!json_object_object_get_ex(object, "data", &data))
-                    continue;
-
-                if (!json_object_object_get_ex(data, "created_utc", &created))
-                    continue;
-
-                if (!json_object_is_type(created, json_type_double))
-                    continue;
-
-                // Convert that into a UNIX time.
-                unixtime = json_object_get_int64(created);
-
-                // RFC822 Format
-                strftime(date, sizeof date, "%a, %d %b %Y %T %z", gmtime(&unixtime));
-
-                // If this is a comment we need to generate Xrefs, and prefix the subject with "Re:"
-                iscomment = reddit_object_type(object) == REDDIT_OBJ_COMMENT;
-
-                if (article_generate_references(spool, object, &references) != 0)
-                    references = "null";
-
-                if (references && *references == 0)
-                    references = "null";
-
-                body = json_object_get_string_prop(data, "body");
-                byte_count = body ? strlen(body) : 0;
-                line_count = body ? str_count_newlines(body) : 0;
-
-                client_printf(cl, "%d\t%s%s\t%s\t%s\t<%s@reddit>\t%s\t%d\t%u\r\n",
-                                  i,
-                                  iscomment ? "Re: " : "",
-                                  json_object_get_string_prop(data, "title"),
-                                  json_object_get_string_prop(data, "author"),
-                                  date,
-                                  msg,
-                                  references,
-                                  byte_count,
-                                  line_count);
-                // TODO: "\tXref: someserver somegroup:somenumber" at the end
-            }
-        }
+    // The lines were generated when the articles were spooled, so this is
+    // just one read, and it doesn't need the spool lock.
+    if (reddit_spool_overview(spool, cl->cl_group, beginning, end, &lines, &len) != 0) {
+        client_send(cl, "503 Overview information unavailable\r\n");
+        return;
     }
-    client_printf(cl, ".\r\n");
+
+    client_send(cl, "224 Overview information follows\r\n");
+
+    // Hand the lines over to be written rather than copying them.
+    cq_append_ref(cl->cl_wrbuf, lines, len, g_free, lines);
+
+    client_send(cl, ".\r\n");
 }
 
 void handle_newgroups_cmd(client_t *cl, const char *param)
 {
     client_printf(cl, "231 new groups are not provided by nntpit\r\n");
     client_printf(cl, ".\r\n");
-    client_flush(cl);
     return;
 }
 
-void handle_group_cmd(client_t *cl, const char *param)
+// Answer GROUP or LISTGROUP from whatever is in the spool now.
+void handle_group_reply(client_t *cl, const char *param, bool listgroup)
 {
+    group_t *group;
+    artmap_t *map;
     int highwm;
     int lowwm;
 
-    if (!param) {
-        client_printf(cl, "501 group must be specified, see 6.1.1.2\r\n");
-        return;
-    }
-
-    if (fetch_subreddit_json(spool, newsrc, param) == 0) {
-        g_debug("the fetch worked");
-
-        // Save any updates to the spool or article map.
-        reddit_spool_expunge(spool);
-
-        json_object_to_file("newsrc", newsrc);
-        json_object_to_file("spool", spool);
-    }
-
-    if (!json_object_object_get_ex(newsrc, param, &groupset)) {
+    // If the group doesn't exist, the selected group doesn't change.
+    if ((group = newsrc_find(newsrc, param)) == NULL) {
         g_warning("unknown group: TODO: subscribe to it, this is like a command in slrn");
         client_printf(cl, "411 i dont have that group\r\n");
         return;
     }
 
-    highwm = reddit_spool_highwatermark(groupset);
-    lowwm  = reddit_spool_lowwatermark(groupset);
+    map    = newsrc_snapshot(group);
+    highwm = artmap_highwatermark(map);
+    lowwm  = artmap_lowwatermark(map);
+
+    // Each client has its own group and current article, see RFC3977 6.1.1.
+    cl->cl_group   = group;
+    cl->cl_article = highwm != 0 ? lowwm : 0;
 
     client_printf(cl, "211 %d %d %d %s\r\n",
         highwm - lowwm,
@@ -692,148 +821,248 @@ void handle_group_cmd(client_t *cl, const char *param)
         highwm,
         param);
 
-    client_flush(cl);
+    if (listgroup) {
+        for (int i = lowwm; i <= highwm && highwm != 0; i++) {
+            if (artmap_article(map, i) != 0)
+                client_printf(cl, "%d\r\n", i);
+        }
+
+        client_printf(cl, ".\r\n");
+    }
+
     return;
 }
 
-void handle_listgroup_cmd(client_t *cl, const char *param)
+void client_refreshed(client_t *cl, const char *group, int result, bool listgroup)
 {
-    int highwm;
-    int lowwm;
+    cl->cl_refresh = NULL;
+    cl->cl_state = CL_NORMAL;
 
-    if (!param) {
-        client_printf(cl, "501 group must be specified, see 6.1.1.2\r\n");
-        return;
-    }
+    reddit_spool_lock(spool);
 
-    if (fetch_subreddit_json(spool, newsrc, param) == 0) {
+    if (result == 0) {
         g_debug("the fetch worked");
 
         // Save any updates to the spool or article map.
-        reddit_spool_expunge(spool);
-
-        json_object_to_file("newsrc", newsrc);
-        json_object_to_file("spool", spool);
+        newsrc_save(newsrc, "newsrc");
+        reddit_spool_sync(spool);
     }
 
-    if (!json_object_object_get_ex(newsrc, param, &groupset)) {
-        g_warning("unknown group: TODO: subscribe to it, this is like a command in slrn");
-        client_printf(cl, "411 i dont have that group\r\n");
+    reddit_spool_unlock(spool);
+
+    if (cl->cl_flags & CL_DEAD)
         return;
-    }
 
-    highwm = reddit_spool_highwatermark(groupset);
-    lowwm  = reddit_spool_lowwatermark(groupset);
+    handle_group_reply(cl, group, listgroup);
 
-    client_printf(cl, "211 %d %d %d %s\r\n",
-        highwm - lowwm,
-        lowwm,
-        highwm,
-        param);
+    // Now catch up on anything the client sent while it was waiting.
+    client_run(cl);
+}
+
+void client_group_refreshed(const refreshed_t *refreshed, void *opaque)
+{
+    client_refreshed(opaque, refreshed->group, refreshed->result, false);
+}
+
+void client_listgroup_refreshed(const refreshed_t *refreshed, void *opaque)
+{
+    client_refreshed(opaque, refreshed->group, refreshed->result, true);
+}
 
-    for (int i = lowwm; i < highwm; i++) {
-        client_printf(cl, "%d\r\n", i);
+// Groups we know about are kept fresh by the scheduler, so we can answer
+// right away. Otherwise the group is refreshed before we answer, the client
+// has to wait for that but nobody else on this thread does.
+void handle_group_cmd(client_t *cl, const char *param, bool listgroup)
+{
+    thread_t *th = cl->cl_thread;
+
+    if (!param) {
+        client_printf(cl, "501 group must be specified, see 6.1.1.2\r\n");
+        return;
     }
 
-    client_printf(cl, ".\r\n");
-    client_flush(cl);
+    if (scheduler && newsrc_find(newsrc, param)) {
+        handle_group_reply(cl, param, listgroup);
+        return;
+    }
 
-    client_flush(cl);
-    return;
+    cl->cl_refresh = fetch_subreddit(th->th_fetcher,
+                                     spool,
+                                     newsrc,
+                                     param,
+                                     NULL,
+                                     0,
+                                     listgroup ? client_listgroup_refreshed
+                                               : client_group_refreshed,
+                                     cl);
+
+    // If we couldn't even start a fetch, just use what we have.
+    if (cl->cl_refresh == NULL) {
+        handle_group_reply(cl, param, listgroup);
+        return;
+    }
+
+    cl->cl_state = CL_WAITING;
 }
 
-void handle_head_cmd(client_t *cl, const char *param, bool head, bool article)
+// Find the article, generating it if it isn't cached. The caller must release
+// it.
+static int client_find_article(client_t *cl, uint64_t key, const char *msgid, article_t *rendered)
 {
     json_object *object;
-    char *endptr;
     char *headers;
     char *body;
-    char *msgid;
-    int number;
-    int code;
+    uint64_t generation = 0;
 
-    // List available newsgroups
-    if (!param) {
-        client_printf(cl, "501 no parameters, see 3.1.2\r\n");
-        return;
+    if (artcache_lookup(articles, key, rendered, &generation)) {
+        return 0;
     }
 
-    if (!groupset) {
-        client_printf(cl, "412 no newsgroup, see 3.1.2\r\n");
-        return;
+    // Only misses need the spool.
+    reddit_spool_lock(spool);
+
+    // Now we lookup that id in the spool file.
+    if (!reddit_spool_retrieve_key(spool, key, &object)) {
+        reddit_spool_unlock(spool);
+        // Umm, I guess it was outdated?
+        client_printf(cl, "423 sorry, couldnt find msg %s\r\n", msgid);
+        return -1;
+    }
+
+    // Now we need to translate that object into an RFC5536 message
+    if (reddit_parse_comment(spool, object, &headers, &body) != 0) {
+        reddit_spool_unlock(spool);
+        client_printf(cl, "503 sorry, couldnt get the headers\r\n");
+        return -1;
     }
 
-    // Parse the number requested, note if *endptr == '<' it's a msgid.
-    number = strtoul(param, &endptr, 10);
+    reddit_spool_unlock(spool);
 
-    object = NULL;
+    if (headers == NULL || body == NULL) {
+        client_printf(cl, "503 sorry, failure generating message\r\n");
+        g_free(headers);
+        g_free(body);
+        return -1;
+    }
 
-    // In slrn there is a get_parent_header command that uses this command
-    // to rebuild threads.
-    if (number == 0 && *endptr != '\0') {
+    artcache_render(headers, body, rendered);
+    artcache_store(articles, key, rendered, generation);
+
+    g_free(headers);
+    g_free(body);
+    return 0;
+}
+
+// Work out which article a HEAD, BODY, ARTICLE or STAT is asking for, which
+// is the current article if param is NULL. If it's by number, that becomes the
+// current article.
+static int client_select_article(client_t *cl, const char *param, int *number, uint64_t *key, char **msgid)
+{
+    char name[REDDIT_MAX_NAME];
+    char *endptr;
+
+    *number = 0;
+
+    if (param && *param == '<') {
         char *hostpart;
 
         // Check that it looks like <msgid>
-        if (*endptr != '<' || endptr[strlen(endptr) - 1] != '>') {
+        if (param[strlen(param) - 1] != '>') {
             client_printf(cl, "501 didnt understand, see 3.1.2\r\n");
-            client_flush(cl);
-            return;
+            return -1;
         }
 
         // Extract the id.
-        msgid = g_strndup(endptr + 1, strlen(endptr) - 2);
+        *msgid = g_strndup(param + 1, strlen(param) - 2);
 
         // The agent might be including a host part, e.g. msgid@reddit
-        hostpart = strchr(msgid, '@');
+        hostpart = strchr(*msgid, '@');
 
         // If there was a hostpart, truncate it to just the id.
         if (hostpart != NULL) {
             *hostpart = '\0';
         }
 
-        // Now we lookup that id in the spool file.
-        if (!json_object_object_get_ex(spool, msgid, &object)) {
-            // Umm, I guess it was outdated?
-            client_printf(cl, "423 sorry, couldnt find msg %s\r\n", msgid);
-            g_free(msgid);
-            return;
-        }
-    } else {
-        json_object_object_foreach(groupset, msg, artnum) {
-            if (json_object_get_int(artnum) == number) {
-
-                // Now we lookup that id in the spool file.
-                if (!json_object_object_get_ex(spool, msg, &object)) {
-                    // Umm, I guess it was outdated?
-                    client_printf(cl, "423 sorry, couldnt find that one\r\n");
-                    return;
-                }
+        *key = reddit_name_key(*msgid);
+        return 0;
+    }
 
-                // We found the number requested.
-                msgid = g_strdup(msg);
+    if (!cl->cl_group) {
+        client_printf(cl, "412 no newsgroup, see 3.1.2\r\n");
+        return -1;
+    }
 
-                break;
-            }
+    if (param) {
+        *number = strtoul(param, &endptr, 10);
+
+        if (*number == 0 || *endptr != '\0') {
+            client_printf(cl, "501 didnt understand, see 3.1.2\r\n");
+            return -1;
         }
+    } else if ((*number = cl->cl_article) == 0) {
+        client_printf(cl, "420 no current article, see 3.1.2\r\n");
+        return -1;
     }
 
-    // If we reach here without a message, that we couldn't find it in the spool
-    if (object == NULL) {
+    // Not a number we've given out.
+    if ((*key = artmap_article(newsrc_snapshot(cl->cl_group), *number)) == 0) {
         client_printf(cl, "423 understood but couldnt find it, see 3.1.2\r\n");
-        client_flush(cl);
-        return;
+        return -1;
     }
 
-    // Now we need to translate that object into an RFC5536 message
-    if (reddit_parse_comment(spool, object, &headers, &body) != 0) {
-        client_printf(cl, "503 sorry, couldnt get the headers\r\n");
+    cl->cl_article = *number;
+
+    // We found the number requested.
+    *msgid = g_strdup(reddit_key_name(*key, name));
+    return 0;
+}
+
+void handle_stat_cmd(client_t *cl, const char *param)
+{
+    json_object *object;
+    article_t cached;
+    char *msgid;
+    uint64_t key;
+    int number;
+    bool exists;
+
+    if (client_select_article(cl, param, &number, &key, &msgid) != 0)
         return;
+
+    // If we've rendered it recently, there's no need to look in the spool.
+    if ((exists = artcache_lookup(articles, key, &cached, NULL))) {
+        artcache_release(&cached);
+    } else {
+        reddit_spool_lock(spool);
+        exists = reddit_spool_retrieve_key(spool, key, &object);
+        reddit_spool_unlock(spool);
     }
 
-    if (headers == NULL || body == NULL) {
-        client_printf(cl, "503 sorry, failure generating message\r\n");
-        g_free(headers);
-        g_free(body);
+    if (exists) {
+        client_printf(cl, "223 %d <%s> article exists\r\n", number, msgid);
+    } else {
+        client_printf(cl, "423 sorry, couldnt find msg %s\r\n", msgid);
+    }
+
+    g_free(msgid);
+}
+
+void handle_head_cmd(client_t *cl, const char *param, bool head, bool article)
+{
+    article_t rendered;
+    char *msgid;
+    uint64_t key;
+    size_t size;
+    int number;
+    int code;
+
+    // In slrn there is a get_parent_header command that uses this command
+    // with a msgid to rebuild threads.
+    if (client_select_article(cl, param, &number, &key, &msgid) != 0)
+        return;
+
+    if (client_find_article(cl, key, msgid, &rendered) != 0) {
+        g_free(msgid);
         return;
     }
 
@@ -853,31 +1082,27 @@ void handle_head_cmd(client_t *cl, const char *param, bool head, bool article)
         number,
         msgid);
 
-    if (head) {
-        client_send(cl, headers);
-    }
+    size = g_bytes_get_size(rendered.blob);
 
+    // The article is already dot-stuffed and has a blank line after the
+    // headers, so each response is just a slice of it.
     if (head && article) {
-        client_send(cl, "\r\n");
-    }
-
-    if (article) {
-        client_send(cl, body);
-        client_send(cl, "\r\n");
+        client_send_article(cl, &rendered, 0, size);
+    } else if (head) {
+        client_send_article(cl, &rendered, 0, rendered.headers);
+    } else {
+        client_send_article(cl, &rendered, rendered.body, size - rendered.body);
     }
 
-    client_printf(cl, ".\r\n");
-    client_flush(cl);
-    g_free(headers);
-    g_free(body);
+    client_send(cl, ".\r\n");
+    artcache_release(&rendered);
+    g_free(msgid);
     return;
 }
 
 void client_read(struct ev_loop *loop, ev_io *w, int revents)
 {
     client_t  *cl = w->data;
-    thread_t  *th = cl->cl_thread;
-    char    *ln;
     ssize_t    n;
 
     if ((n = cq_read(cl->cl_rdbuf, cl->cl_fd)) == -1) {
@@ -894,7 +1119,46 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
         return;
     }
 
-    while ((ln = cq_read_line(cl->cl_rdbuf))) {
+    client_run(cl);
+}
+
+// Handle the commands we have and write the replies, for as long as the
+// client keeps up with them.
+void client_run(client_t *cl)
+{
+    struct ev_loop  *loop = cl->cl_thread->th_loop;
+
+    do {
+        client_process(cl);
+        client_flush(cl);
+
+        if (cl->cl_flags & CL_DEAD)
+            return;
+
+        // It isn't reading the replies, so stop reading its commands until
+        // it does, client_write will start again.
+        if (cq_len(cl->cl_wrbuf) >= CL_WRLIMIT) {
+            ev_io_stop(loop, &cl->cl_readable);
+            cl->cl_flags |= CL_PAUSED;
+            return;
+        }
+
+        if (cl->cl_flags & CL_PAUSED) {
+            ev_io_start(loop, &cl->cl_readable);
+            cl->cl_flags &= ~CL_PAUSED;
+        }
+    } while (cl->cl_state != CL_WAITING && cq_line(cl->cl_rdbuf));
+}
+
+// Handle every complete line we have, unless we're waiting for a fetch.
+void client_process(client_t *cl)
+{
+    thread_t  *th = cl->cl_thread;
+    char    *ln;
+
+    while (cl->cl_state != CL_WAITING
+        && cq_len(cl->cl_wrbuf) < CL_WRLIMIT
+        && (ln = cq_line(cl->cl_rdbuf))) {
         char  *cmd, *data;
 
         if (debug)
@@ -911,6 +1175,8 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
          * 436 <msg-id> -- IHAVE, defer the article
          */
 
+        // Handlers that need the spool lock take it themselves, the rest
+        // only read published snapshots, see rcu.h.
         if (cl->cl_state == CL_NORMAL) {
             cmd = ln;
             if ((data = index(cmd, ' ')) != NULL) {
@@ -924,9 +1190,9 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
             if (strcasecmp(cmd, "LIST") == 0) {
                 handle_list_cmd(cl, data);
             } else if (strcasecmp(cmd, "GROUP") == 0) {
-                handle_group_cmd(cl, data);
+                handle_group_cmd(cl, data, false);
             } else if (strcasecmp(cmd, "LISTGROUP") == 0) {
-                handle_listgroup_cmd(cl, data);
+                handle_group_cmd(cl, data, true);
             } else if (strcasecmp(cmd, "NEWGROUPS") == 0) {
                 handle_newgroups_cmd(cl, data);
             } else if (strcasecmp(cmd, "HEAD") == 0) {
@@ -935,6 +1201,8 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
                 handle_head_cmd(cl, data, true, true);
             } else if (strcasecmp(cmd, "BODY") == 0) {
                 handle_head_cmd(cl, data, false, true);
+            } else if (strcasecmp(cmd, "STAT") == 0) {
+                handle_stat_cmd(cl, data);
             } else if (strcasecmp(cmd, "CAPABILITIES") == 0) {
                 client_printf(cl,
                         "101 Capability list:\r\n"
@@ -948,9 +1216,10 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
                 client_send(cl, ".\r\n");
             } else if (strcasecmp(cmd, "QUIT") == 0) {
                 client_close(cl);
-                reddit_spool_expunge(spool);
-                json_object_to_file("newsrc", newsrc);
-                json_object_to_file("spool", spool);
+                reddit_spool_lock(spool);
+                newsrc_save(newsrc, "newsrc");
+                reddit_spool_sync(spool);
+                reddit_spool_unlock(spool);
             } else if (strcasecmp(cmd, "MODE") == 0) {
                 if (!data)
                     client_send(cl, "501 Unknown MODE.\r\n");
@@ -1009,12 +1278,11 @@ void client_read(struct ev_loop *loop, ev_io *w, int revents)
             }
         }
 
-        free(ln);
+        // The line is still in the read buffer, nothing can use it after this.
+        cq_line_done(cl->cl_rdbuf);
         if (cl->cl_flags & CL_DEAD)
             return;
     }
-
-    client_flush(cl);
 }
 
 void *
@@ -1046,6 +1314,9 @@ void  *ret = calloc(n, sz);
 void do_stats(struct ev_loop *loop, ev_timer *w, int revents)
 {
     struct rusage rus;
+    fetchstats_t fst;
+    artcachestats_t ast;
+    charq_stats_t cqs = {0};
     uint64_t ct;
     time_t upt = time(NULL) - start_time;
 
@@ -1056,6 +1327,28 @@ void do_stats(struct ev_loop *loop, ev_timer *w, int revents)
 
     printf("send it: %d/s, refused: %d/s, rejected: %d/s, deferred: %d/s, accepted: %d/s, cpu %.2f%%\n",
             nsend, nrefuse, nreject, ndefer, naccept, (((double)ct / 1000) / upt) * 100);
+
+    fetch_stats(&fst);
+    printf("fetch: %" PRIu64 " not modified, %" PRIu64 " modified, %" PRIu64 " bytes received, %" PRIu64 " bytes decoded\n",
+            fst.hits, fst.misses, fst.received, fst.decoded);
+    printf("fetch queue: %" PRIu64 " waiting, %" PRIu64 " sent, %" PRIu64 " joined, %" PRIu64 " throttled, %.2fs average wait, %.2fs max wait\n",
+            fst.queued, fst.dispatched, fst.joined, fst.throttled,
+            fst.dispatched ? fst.waited / fst.dispatched : 0., fst.maxwait);
+
+    artcache_stats(articles, &ast);
+    printf("article cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " evicted, %" PRIu64 " articles, %" PRIu64 " bytes\n",
+            ast.hits, ast.misses,
+            ast.hits + ast.misses ? 100. * ast.hits / (ast.hits + ast.misses) : 0.,
+            ast.evictions, ast.articles, ast.bytes);
+
+    // Buffer pools are per thread.
+    for (int i = 0; i < nthreads; i++) {
+        cqs.cqs_hits     += threads[i].th_cqstats.cqs_hits;
+        cqs.cqs_misses   += threads[i].th_cqstats.cqs_misses;
+        cqs.cqs_resident += threads[i].th_cqstats.cqs_resident;
+    }
+    printf("buffer pool: %" PRIu64 " reused, %" PRIu64 " allocated, %zu bytes pooled\n",
+            cqs.cqs_hits, cqs.cqs_misses, cqs.cqs_resident);
     nsend = nrefuse = nreject = ndefer = naccept = 0;
     pthread_mutex_unlock(&stats_mtx);
 }
@@ -1075,6 +1368,15 @@ thread_deadlist(struct ev_loop * loop, ev_prepare *w, int revents)
     }
 
     th->th_deadlist = NULL;
+
+    /* About to wait, so nothing loaded from a snapshot is in use now. */
+    rcu_offline();
+}
+
+void
+thread_online(struct ev_loop *loop, ev_check *w, int revents)
+{
+    rcu_online();
 }
 
 void do_thread_stats(struct ev_loop *loop, ev_timer *w, int revents)
@@ -1086,8 +1388,12 @@ void do_thread_stats(struct ev_loop *loop, ev_timer *w, int revents)
   ndefer += th->th_ndefer;
   nreject += th->th_nreject;
   nrefuse += th->th_nrefuse;
+  cq_stats(&th->th_cqstats);
   pthread_mutex_unlock(&stats_mtx);
 
+  /* Free any old snapshots nobody can be reading now. */
+  rcu_reclaim();
+
   th->th_nsend = th->th_naccepted = th->th_ndefer = th->th_nreject
     = th->th_nrefuse = 0;
 }
@@ -0,0 +1,679 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "setup.h"
+#include "overview.h"
+#include "rcu.h"
+
+#define OVERVIEW_NONE UINT64_MAX
+
+// Compact a file once this many bytes of it are replaced lines, as long as
+// that's at least half of it.
+#define OVERVIEW_GARBAGE (1024 * 1024)
+
+typedef struct ovline {
+    uint64_t    offset;     // OVERVIEW_NONE if there's no line.
+    uint64_t    len;
+} ovline_t;
+
+// Readers might still be using a file that compaction replaced, so it's
+// retired rather than closed.
+typedef struct ovfile {
+    int         fd;
+} ovfile_t;
+
+// What readers see of a group's overview. Once published it never changes,
+// the writer publishes a new one instead, see rcu.h.
+typedef struct ovsnap {
+    ovfile_t   *file;
+    int         base;       // The article number of lines[0].
+    unsigned    count;
+    ovline_t    lines[];
+} ovsnap_t;
+
+typedef struct ovgroup {
+    char       *name;
+    ovfile_t   *file;
+    uint64_t    size;
+    uint64_t    garbage;    // Bytes of lines that have been replaced.
+    int         base;       // The article number of lines[0].
+    int         last;       // Highest article number seen.
+    GArray     *lines;      // Article number - base => ovline_t
+    bool        changed;    // The lines are different to what was published.
+    ovsnap_t   *published;  // The lines as readers see them.
+} ovgroup_t;
+
+// What readers see of the groups that have been published. Groups are only
+// freed when the overview is closed, so their pointers stay valid.
+typedef struct ovindex {
+    unsigned    count;
+    ovgroup_t  *groups[];
+} ovindex_t;
+
+struct overview {
+    char        *path;
+    GHashTable  *groups;    // Group name => ovgroup_t
+    ovindex_t   *published; // The groups as readers see them.
+};
+
+static void overview_file_close(ovfile_t *file)
+{
+    close(file->fd);
+    g_free(file);
+}
+
+static void overview_group_free(ovgroup_t *ovgroup)
+{
+    overview_file_close(ovgroup->file);
+
+    g_array_free(ovgroup->lines, true);
+    g_free(ovgroup->published);
+    g_free(ovgroup->name);
+    g_free(ovgroup);
+}
+
+overview_t * overview_open(const char *path)
+{
+    overview_t *overview;
+
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        g_warning("failed to create overview directory %s, %s", path, strerror(errno));
+        return NULL;
+    }
+
+    overview = g_new0(overview_t, 1);
+    overview->path   = g_strdup(path);
+    overview->groups = g_hash_table_new_full(g_str_hash,
+                                             g_str_equal,
+                                             NULL,
+                                             (GDestroyNotify) overview_group_free);
+    return overview;
+}
+
+void overview_close(overview_t *overview)
+{
+    if (overview == NULL)
+        return;
+
+    overview_sync(overview);
+
+    g_hash_table_destroy(overview->groups);
+    g_free(overview->published);
+    g_free(overview->path);
+    g_free(overview);
+}
+
+// Record where the line for number is, replacing any line it had before.
+static void overview_group_index(ovgroup_t *ovgroup, int number, uint64_t offset, uint64_t len)
+{
+    ovline_t none = { OVERVIEW_NONE, 0 };
+    ovline_t *line;
+
+    if (ovgroup->lines->len == 0)
+        ovgroup->base = number;
+
+    // Only a replacement can come before the first line.
+    if (number < ovgroup->base) {
+        guint gap = ovgroup->base - number;
+        guint count = ovgroup->lines->len;
+
+        g_array_set_size(ovgroup->lines, count + gap);
+
+        memmove(&g_array_index(ovgroup->lines, ovline_t, gap),
+                &g_array_index(ovgroup->lines, ovline_t, 0),
+                count * sizeof(ovline_t));
+
+        for (guint i = 0; i < gap; i++)
+            g_array_index(ovgroup->lines, ovline_t, i) = none;
+
+        ovgroup->base = number;
+    }
+
+    while (ovgroup->base + (int) ovgroup->lines->len <= number)
+        g_array_append_val(ovgroup->lines, none);
+
+    line = &g_array_index(ovgroup->lines, ovline_t, number - ovgroup->base);
+
+    if (line->offset != OVERVIEW_NONE)
+        ovgroup->garbage += line->len;
+
+    line->offset = offset;
+    line->len    = len;
+
+    ovgroup->changed = true;
+}
+
+// Forget the line for number, if it has one.
+static void overview_group_unindex(ovgroup_t *ovgroup, int number)
+{
+    ovline_t *line;
+
+    if (number < ovgroup->base || number - ovgroup->base >= (int) ovgroup->lines->len)
+        return;
+
+    line = &g_array_index(ovgroup->lines, ovline_t, number - ovgroup->base);
+
+    if (line->offset == OVERVIEW_NONE)
+        return;
+
+    ovgroup->garbage += line->len;
+    ovgroup->changed  = true;
+
+    line->offset = OVERVIEW_NONE;
+    line->len    = 0;
+}
+
+// Find the lines in an existing overview file. A line for an article that
+// already had one replaces it, and a line with just the number removes it.
+static void overview_group_scan(ovgroup_t *ovgroup)
+{
+    char buf[65536];
+    uint64_t offset = 0;
+    uint64_t complete = 0;
+    bool linestart = true;
+    GString *number = g_string_new(NULL);
+    int artnum = 0;
+    size_t digits = 0;
+    ssize_t n;
+
+    while ((n = pread(ovgroup->file->fd, buf, sizeof buf, offset)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (linestart) {
+                if (g_ascii_isdigit(buf[i])) {
+                    g_string_append_c(number, buf[i]);
+                    continue;
+                }
+
+                linestart = false;
+                artnum    = number->len ? atoi(number->str) : 0;
+                digits    = number->len;
+
+                g_string_truncate(number, 0);
+            }
+
+            if (buf[i] == '\n') {
+                uint64_t len = offset + i + 1 - complete;
+
+                // Nothing but the number and CRLF.
+                if (artnum > 0 && len == digits + 2) {
+                    overview_group_unindex(ovgroup, artnum);
+                    ovgroup->garbage += len;
+                } else if (artnum > 0) {
+                    overview_group_index(ovgroup, artnum, complete, len);
+                    ovgroup->last = MAX(ovgroup->last, artnum);
+                }
+
+                complete  = offset + i + 1;
+                linestart = true;
+            }
+        }
+
+        offset += n;
+    }
+
+    // Drop a torn line at the end, it will be generated again. Lines are
+    // only indexed once they're complete, so it was never seen.
+    if (complete != offset) {
+        g_warning("discarding a partial line at the end of an overview file");
+
+        if (ftruncate(ovgroup->file->fd, complete) != 0) {
+            g_warning("failed to truncate overview file, %s", strerror(errno));
+        }
+    }
+
+    ovgroup->size = complete;
+
+    g_string_free(number, true);
+}
+
+static ovgroup_t * overview_group(overview_t *overview, const char *group)
+{
+    ovgroup_t *ovgroup = g_hash_table_lookup(overview->groups, group);
+    char *name;
+    int fd;
+
+    if (ovgroup)
+        return ovgroup;
+
+    // Group names become filenames, so be careful.
+    if (strchr(group, '/') || *group == '.' || *group == '\0') {
+        g_warning("refusing to create overview for strange group name %s", group);
+        return NULL;
+    }
+
+    name = g_strdup_printf("%s/%s", overview->path, group);
+    fd   = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+
+    if (fd < 0) {
+        g_warning("failed to open overview file %s, %s", name, strerror(errno));
+        g_free(name);
+        return NULL;
+    }
+
+    ovgroup           = g_new0(ovgroup_t, 1);
+    ovgroup->name     = g_strdup(group);
+    ovgroup->lines    = g_array_new(false, false, sizeof(ovline_t));
+    ovgroup->file     = g_new(ovfile_t, 1);
+    ovgroup->file->fd = fd;
+
+    overview_group_scan(ovgroup);
+
+    g_hash_table_insert(overview->groups, ovgroup->name, ovgroup);
+
+    g_debug("opened overview for %s, last article is %d", group, ovgroup->last);
+
+    g_free(name);
+    return ovgroup;
+}
+
+// Return the highest article number with an overview line.
+int overview_last(overview_t *overview, const char *group)
+{
+    ovgroup_t *ovgroup = overview_group(overview, group);
+
+    return ovgroup ? ovgroup->last : 0;
+}
+
+// Add a line to the end of the file for number.
+static int overview_group_write(ovgroup_t *ovgroup,
+                                const char *group,
+                                int number,
+                                const char *line,
+                                size_t len)
+{
+    if (write(ovgroup->file->fd, line, len) != (ssize_t) len) {
+        g_warning("failed to append overview for %s, %s", group, strerror(errno));
+
+        if (ftruncate(ovgroup->file->fd, ovgroup->size) != 0) {
+            g_warning("failed to truncate overview file, %s", strerror(errno));
+        }
+
+        return -1;
+    }
+
+    overview_group_index(ovgroup, number, ovgroup->size, len);
+
+    ovgroup->size += len;
+    return 0;
+}
+
+// Articles must be appended in order, a NULL line just records that number
+// has no overview.
+int overview_append(overview_t *overview,
+                    const char *group,
+                    int number,
+                    const char *line,
+                    size_t len)
+{
+    ovgroup_t *ovgroup = overview_group(overview, group);
+
+    if (ovgroup == NULL)
+        return -1;
+
+    if (number <= ovgroup->last) {
+        g_warning("overview for %s article %d is out of order", group, number);
+        return -1;
+    }
+
+    ovgroup->last = number;
+
+    if (line == NULL)
+        return 0;
+
+    return overview_group_write(ovgroup, group, number, line, len);
+}
+
+// Return the lines for every article from first to last, where lines[0] is
+// for base. Runs of lines that are next to each other in the file are read
+// together.
+static int overview_lines_read(int fd,
+                               const ovline_t *lines,
+                               int base,
+                               int count,
+                               const char *group,
+                               int first,
+                               int last,
+                               char **data,
+                               size_t *len)
+{
+    uint64_t start = OVERVIEW_NONE;
+    uint64_t run = 0;
+    size_t total = 0;
+    size_t done = 0;
+
+    first = MAX(first, base);
+    last  = MIN(last, base + count - 1);
+
+    for (int i = first - base; i <= last - base; i++) {
+        total += lines[i].len;
+    }
+
+    *data = g_malloc(total + 1);
+
+    // The extra iteration reads the last run.
+    for (int i = first - base; i <= last - base + 1; i++) {
+        const ovline_t *line = i <= last - base ? &lines[i] : NULL;
+
+        if (line && line->offset == OVERVIEW_NONE)
+            continue;
+
+        if (line && start != OVERVIEW_NONE && line->offset == start + run) {
+            run += line->len;
+            continue;
+        }
+
+        if (start != OVERVIEW_NONE) {
+            if (pread(fd, *data + done, run, start) != (ssize_t) run) {
+                g_warning("short read from overview for %s", group);
+                g_free(*data);
+                *data = NULL;
+                *len  = 0;
+                return -1;
+            }
+
+            done += run;
+        }
+
+        if (line) {
+            start = line->offset;
+            run   = line->len;
+        }
+    }
+
+    (*data)[done] = '\0';
+    *len = done;
+    return 0;
+}
+
+static int overview_group_read(ovgroup_t *ovgroup,
+                               int first,
+                               int last,
+                               char **data,
+                               size_t *len)
+{
+    return overview_lines_read(ovgroup->file->fd,
+                               (const ovline_t *) ovgroup->lines->data,
+                               ovgroup->base,
+                               ovgroup->lines->len,
+                               ovgroup->name,
+                               first,
+                               last,
+                               data,
+                               len);
+}
+
+// Return the lines for every article from first to last. This doesn't need
+// the lock, any reader that's online can call it, see rcu.h. It only sees
+// what was there at the last overview_publish().
+int overview_read(overview_t *overview,
+                  const char *group,
+                  int first,
+                  int last,
+                  char **data,
+                  size_t *len)
+{
+    ovindex_t *index = rcu_load(overview->published);
+
+    *data = NULL;
+    *len  = 0;
+
+    for (unsigned i = 0; index && i < index->count; i++) {
+        if (strcmp(index->groups[i]->name, group) == 0) {
+            ovsnap_t *snap = rcu_load(index->groups[i]->published);
+
+            return overview_lines_read(snap->file->fd,
+                                       snap->lines,
+                                       snap->base,
+                                       snap->count,
+                                       group,
+                                       first,
+                                       last,
+                                       data,
+                                       len);
+        }
+    }
+
+    return -1;
+}
+
+// Replace the lines readers see with a copy of the current ones.
+static void overview_group_publish(ovgroup_t *ovgroup)
+{
+    ovsnap_t *old = ovgroup->published;
+    ovsnap_t *snap;
+
+    if (old && !ovgroup->changed)
+        return;
+
+    snap        = g_malloc(sizeof(ovsnap_t) + ovgroup->lines->len * sizeof(ovline_t));
+    snap->file  = ovgroup->file;
+    snap->base  = ovgroup->base;
+    snap->count = ovgroup->lines->len;
+
+    if (snap->count)
+        memcpy(snap->lines, ovgroup->lines->data, snap->count * sizeof(ovline_t));
+
+    rcu_publish(ovgroup->published, snap);
+
+    ovgroup->changed = false;
+
+    if (old)
+        rcu_retire(old, g_free);
+}
+
+// Let readers see the overview for group as it is now, they don't see any
+// appends or replacements until this is called.
+int overview_publish(overview_t *overview, const char *group)
+{
+    ovgroup_t *ovgroup = overview_group(overview, group);
+    ovindex_t *index = overview->published;
+    ovindex_t *update;
+    unsigned count = index ? index->count : 0;
+
+    if (ovgroup == NULL)
+        return -1;
+
+    overview_group_publish(ovgroup);
+
+    for (unsigned i = 0; i < count; i++) {
+        if (index->groups[i] == ovgroup)
+            return 0;
+    }
+
+    // It's new, so readers need a new index to find it.
+    update        = g_malloc(sizeof(ovindex_t) + (count + 1) * sizeof(ovgroup_t *));
+    update->count = count + 1;
+
+    if (count)
+        memcpy(update->groups, index->groups, count * sizeof(ovgroup_t *));
+
+    update->groups[count] = ovgroup;
+
+    rcu_publish(overview->published, update);
+
+    if (index)
+        rcu_retire(index, g_free);
+
+    return 0;
+}
+
+// Rewrite the file with only the current lines, in article number order.
+static void overview_group_compact(overview_t *overview, ovgroup_t *ovgroup, const char *group)
+{
+    // Group names never start with a dot, so this can't be another group.
+    char *temp = g_strdup_printf("%s/.%s", overview->path, group);
+    char *name = g_strdup_printf("%s/%s", overview->path, group);
+    uint64_t offset = 0;
+    ovfile_t *old;
+    size_t len;
+    char *data;
+    int fd;
+
+    if (overview_group_read(ovgroup, ovgroup->base, ovgroup->last, &data, &len) != 0)
+        goto finished;
+
+    fd = open(temp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    if (fd < 0
+     || write(fd, data, len) != (ssize_t) len
+     || fsync(fd) != 0
+     || rename(temp, name) != 0) {
+        g_warning("failed to compact overview for %s, %s", group, strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+
+        unlink(temp);
+        g_free(data);
+        goto finished;
+    }
+
+    g_debug("compacted overview for %s from %" PRIu64 " to %zu bytes", group, ovgroup->size, len);
+
+    old = ovgroup->file;
+
+    ovgroup->file     = g_new(ovfile_t, 1);
+    ovgroup->file->fd = fd;
+    ovgroup->size     = len;
+    ovgroup->garbage  = 0;
+
+    // The lines are in the same order, just closer together.
+    for (guint i = 0; i < ovgroup->lines->len; i++) {
+        ovline_t *line = &g_array_index(ovgroup->lines, ovline_t, i);
+
+        if (line->offset == OVERVIEW_NONE)
+            continue;
+
+        line->offset = offset;
+        offset      += line->len;
+    }
+
+    // A reader might still have the old file, so it can only go once
+    // nobody can find it.
+    if (ovgroup->published) {
+        ovgroup->changed = true;
+        overview_group_publish(ovgroup);
+    }
+
+    rcu_retire(old, (GDestroyNotify) overview_file_close);
+
+    g_free(data);
+
+finished:
+    g_free(temp);
+    g_free(name);
+}
+
+// Give an article that was already appended a new line, e.g. because it was
+// edited or its References have changed.
+int overview_replace(overview_t *overview,
+                     const char *group,
+                     int number,
+                     const char *line,
+                     size_t len)
+{
+    ovgroup_t *ovgroup = overview_group(overview, group);
+    ovline_t *old = NULL;
+
+    if (ovgroup == NULL)
+        return -1;
+
+    if (number > ovgroup->last) {
+        g_warning("overview for %s article %d was never appended", group, number);
+        return -1;
+    }
+
+    if (number >= ovgroup->base && number - ovgroup->base < (int) ovgroup->lines->len)
+        old = &g_array_index(ovgroup->lines, ovline_t, number - ovgroup->base);
+
+    // Usually nothing that's in the overview has changed.
+    if (old && old->offset != OVERVIEW_NONE && old->len == len) {
+        char *current = g_malloc(len);
+        bool same = pread(ovgroup->file->fd, current, len, old->offset) == (ssize_t) len
+                 && memcmp(current, line, len) == 0;
+
+        g_free(current);
+
+        if (same)
+            return 0;
+    }
+
+    if (overview_group_write(ovgroup, group, number, line, len) != 0)
+        return -1;
+
+    if (ovgroup->garbage > OVERVIEW_GARBAGE && ovgroup->garbage > ovgroup->size / 2)
+        overview_group_compact(overview, ovgroup, group);
+
+    return 0;
+}
+
+// Remove the line for an article that no longer exists, e.g. because it
+// was expunged. A line with just the number records that in the file.
+int overview_remove(overview_t *overview, const char *group, int number)
+{
+    ovgroup_t *ovgroup = overview_group(overview, group);
+    char tombstone[32];
+    int len;
+
+    if (ovgroup == NULL)
+        return -1;
+
+    if (number < ovgroup->base
+     || number - ovgroup->base >= (int) ovgroup->lines->len
+     || g_array_index(ovgroup->lines, ovline_t, number - ovgroup->base).offset == OVERVIEW_NONE)
+        return 0;
+
+    len = snprintf(tombstone, sizeof tombstone, "%d\r\n", number);
+
+    if (write(ovgroup->file->fd, tombstone, len) != len) {
+        g_warning("failed to append overview for %s, %s", group, strerror(errno));
+
+        if (ftruncate(ovgroup->file->fd, ovgroup->size) != 0) {
+            g_warning("failed to truncate overview file, %s", strerror(errno));
+        }
+
+        return -1;
+    }
+
+    ovgroup->size    += len;
+    ovgroup->garbage += len;
+
+    overview_group_unindex(ovgroup, number);
+
+    if (ovgroup->garbage > OVERVIEW_GARBAGE && ovgroup->garbage > ovgroup->size / 2)
+        overview_group_compact(overview, ovgroup, group);
+
+    return 0;
+}
+
+int overview_sync(overview_t *overview)
+{
+    GHashTableIter iter;
+    ovgroup_t *ovgroup;
+    int result = 0;
+
+    g_hash_table_iter_init(&iter, overview->groups);
+
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &ovgroup)) {
+#ifdef HAVE_FDATASYNC
+        if (fdatasync(ovgroup->file->fd) != 0)
+            result = -1;
+#else
+        if (fsync(ovgroup->file->fd) != 0)
+            result = -1;
+#endif
+    }
+
+    return result;
+}
@@ -0,0 +1,58 @@
+#ifndef __OVERVIEW_H
+#define __OVERVIEW_H
+
+// The overview database holds ready-made XOVER lines for every article, one
+// append-only file per group. Articles are numbered in the order they're
+// spooled, so the lines in each file are in article number order and any
+// range of articles is usually a single contiguous read.
+//
+// If an article changes, its new line is appended and replaces the old one,
+// which is left behind until there's enough of that to compact the file.
+// Removing an article appends a line with just its number.
+//
+// Only the writer holding the spool lock can change it. Readers don't see
+// the changes until overview_publish(), and then read without locking.
+
+typedef struct overview overview_t;
+
+overview_t *
+overview_open(const char *path);
+
+void
+overview_close(overview_t *overview);
+
+int
+overview_last(overview_t *overview, const char *group);
+
+int
+overview_append(overview_t *overview,
+                const char *group,
+                int number,
+                const char *line,
+                size_t len);
+
+int
+overview_replace(overview_t *overview,
+                 const char *group,
+                 int number,
+                 const char *line,
+                 size_t len);
+
+int
+overview_remove(overview_t *overview, const char *group, int number);
+
+int
+overview_publish(overview_t *overview, const char *group);
+
+int
+overview_read(overview_t *overview,
+              const char *group,
+              int first,
+              int last,
+              char **data,
+              size_t *len);
+
+int
+overview_sync(overview_t *overview);
+
+#endif
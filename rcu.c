@@ -0,0 +1,114 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib.h>
+
+#include "rcu.h"
+
+typedef struct rcureader {
+    uint64_t            epoch;  // The epoch when it came online, 0 if offline.
+    struct rcureader   *next;
+} rcureader_t;
+
+typedef struct rcuretired {
+    void               *ptr;
+    GDestroyNotify      destroy;
+    uint64_t            epoch;  // Readers that have seen this can't have ptr.
+} rcuretired_t;
+
+// Advanced every time something is retired.
+static uint64_t rcu_epoch = 1;
+
+// Readers are added the first time a thread comes online, and never removed.
+// Threads live as long as the process.
+static rcureader_t *rcu_readers;
+
+// Waiting to be destroyed, oldest first.
+static GQueue rcu_retired = G_QUEUE_INIT;
+
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread rcureader_t *rcu_self;
+
+static rcureader_t * rcu_reader(void)
+{
+    if (rcu_self == NULL) {
+        rcu_self = g_new0(rcureader_t, 1);
+
+        pthread_mutex_lock(&rcu_lock);
+        rcu_self->next = rcu_readers;
+        rcu_readers    = rcu_self;
+        pthread_mutex_unlock(&rcu_lock);
+    }
+
+    return rcu_self;
+}
+
+// This thread is about to start reading. Anything it loads from now on is
+// safe to use until it goes offline.
+void rcu_online(void)
+{
+    rcureader_t *self = rcu_reader();
+
+    // This has to be visible to writers before we load anything, or a writer
+    // could think we're offline while we load something it's retiring.
+    __atomic_store_n(&self->epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// This thread has finished with everything it loaded, e.g. it's going to
+// wait for events.
+void rcu_offline(void)
+{
+    __atomic_store_n(&rcu_reader()->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Destroy ptr once no reader can be using it. It must already have been
+// replaced with rcu_publish(), so no new reader can find it.
+void rcu_retire(void *ptr, GDestroyNotify destroy)
+{
+    rcuretired_t *retired = g_new(rcuretired_t, 1);
+
+    retired->ptr     = ptr;
+    retired->destroy = destroy;
+    retired->epoch   = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&rcu_lock);
+    g_queue_push_tail(&rcu_retired, retired);
+    pthread_mutex_unlock(&rcu_lock);
+
+    rcu_reclaim();
+}
+
+// Destroy anything retired before every online reader last came online.
+// There's no waiting, anything still in use is left for next time.
+void rcu_reclaim(void)
+{
+    uint64_t oldest = UINT64_MAX;
+    rcuretired_t *retired;
+
+    // Pairs with the fence in rcu_online(), anything published before this
+    // is visible to a reader we see as offline.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&rcu_lock);
+
+    for (rcureader_t *reader = rcu_readers; reader; reader = reader->next) {
+        uint64_t epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    while ((retired = g_queue_peek_head(&rcu_retired)) && retired->epoch <= oldest) {
+        g_queue_pop_head(&rcu_retired);
+        retired->destroy(retired->ptr);
+        g_free(retired);
+    }
+
+    pthread_mutex_unlock(&rcu_lock);
+}
@@ -0,0 +1,32 @@
+#ifndef __RCU_H
+#define __RCU_H
+
+// Quiescent state based reclamation, for things that are read far more often
+// than they change. Instead of changing something in place, the writer makes
+// a new copy, publishes it with rcu_publish(), then hands the old one to
+// rcu_retire(). Readers just rcu_load() the current version and use it
+// without taking any lock.
+//
+// A retired version is only destroyed once every reader thread has passed
+// through a quiescent state, i.e. gone back to its event loop, so nobody can
+// still be using it. Reader threads call rcu_online() when they start
+// handling events and rcu_offline() before they wait for more, anything they
+// loaded must not be used after that. Writers must be serialized by the
+// caller, in nntpit that's the spool lock.
+
+#define rcu_load(p)         __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_publish(p, v)   __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void
+rcu_online(void);
+
+void
+rcu_offline(void);
+
+void
+rcu_retire(void *ptr, GDestroyNotify destroy);
+
+void
+rcu_reclaim(void);
+
+#endif
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <json.h>
 #include <glib.h>
 
+#include "newsrc.h"
 #include "reddit.h"
 #include "jsonutil.h"
 
@@ -26,70 +28,128 @@ reddit_object_id(json_object *object)
     return NULL;
 }
 
+// The value of each character in kidAlphabet plus one, zero if it's not in
+// the alphabet.
+static const uint8_t kidValues[256] = {
+    ['0'] =  1, ['1'] =  2, ['2'] =  3, ['3'] =  4, ['4'] =  5, ['5'] =  6,
+    ['6'] =  7, ['7'] =  8, ['8'] =  9, ['9'] = 10, ['a'] = 11, ['b'] = 12,
+    ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['g'] = 17, ['h'] = 18,
+    ['i'] = 19, ['j'] = 20, ['k'] = 21, ['l'] = 22, ['m'] = 23, ['n'] = 24,
+    ['o'] = 25, ['p'] = 26, ['q'] = 27, ['r'] = 28, ['s'] = 29, ['t'] = 30,
+    ['u'] = 31, ['v'] = 32, ['w'] = 33, ['x'] = 34, ['y'] = 35, ['z'] = 36,
+};
+
+// The object types of t1_ to t8_.
+static const int kThingTypes[] = {
+    ['1'] = REDDIT_OBJ_COMMENT,
+    ['2'] = REDDIT_OBJ_ACCOUNT,
+    ['3'] = REDDIT_OBJ_LINK,
+    ['4'] = REDDIT_OBJ_MESSAGE,
+    ['5'] = REDDIT_OBJ_SUBREDDIT,
+    ['6'] = REDDIT_OBJ_AWARD,
+    ['7'] = -1,
+    ['8'] = REDDIT_OBJ_PROMO,
+};
+
+static int reddit_classify_kind(const char *kind)
+{
+    if (kind == NULL)
+        return -1;
+
+    if ((kind[0] == 't' || kind[0] == 'T') && kind[1] >= '1' && kind[1] <= '8' && kind[2] == '\0')
+        return kThingTypes[(uint8_t) kind[1]];
+
+    if (g_ascii_strcasecmp(kind, "listing") == 0)
+        return REDDIT_OBJ_LISTING;
+
+    if (g_ascii_strcasecmp(kind, "more") == 0)
+        return REDDIT_OBJ_MORE;
+
+    return -1;
+}
+
+// The kind is read once, after that the type is cached on the object itself
+// so the articles we keep in the spool are only ever classified once.
 int
 reddit_object_type(json_object *obj)
 {
-    if (json_object_check_strprop(obj, "kind", "listing", false))
-        return REDDIT_OBJ_LISTING;
+    void *cached = json_object_get_userdata(obj);
+    int type;
 
-    if (json_object_check_strprop(obj, "kind", "t1", false))
-        return REDDIT_OBJ_COMMENT;
+    if (cached)
+        return GPOINTER_TO_INT(cached) - 1;
 
-    if (json_object_check_strprop(obj, "kind", "t3", false))
-        return REDDIT_OBJ_LINK;
+    type = reddit_classify_kind(json_object_get_string_prop(obj, "kind"));
 
-    if (json_object_check_strprop(obj, "kind", "t2", false))
-        return REDDIT_OBJ_ACCOUNT;
+    if (type < 0) {
+        g_warning("unexpected object kind found %s", json_object_get_string_prop(obj, "kind"));
+        return -1;
+    }
 
-    if (json_object_check_strprop(obj, "kind", "t4", false))
-        return REDDIT_OBJ_MESSAGE;
+    if (json_object_is_type(obj, json_type_object)) {
+        json_object_set_userdata(obj, GINT_TO_POINTER(type + 1), NULL);
+    }
 
-    if (json_object_check_strprop(obj, "kind", "t5", false))
-        return REDDIT_OBJ_SUBREDDIT;
+    return type;
+}
 
-    if (json_object_check_strprop(obj, "kind", "t6", false))
-        return REDDIT_OBJ_AWARD;
+// Returns zero if idstr isn't a valid id.
+uint64_t reddit_decode_id(const char *idstr)
+{
+    uint64_t id = 0;
 
-    if (json_object_check_strprop(obj, "kind", "t8", false))
-        return REDDIT_OBJ_PROMO;
+    for (; *idstr; idstr++) {
+        uint8_t val = kidValues[(uint8_t) *idstr];
 
-    if (json_object_check_strprop(obj, "kind", "more", false))
-        return REDDIT_OBJ_MORE;
+        if (val == 0)
+            return 0;
 
-    g_warning("unexpected object kind found %s", json_object_get_string_prop(obj, "kind"));
+        id = id * 36 + val - 1;
+    }
 
-    return -1;
+    return id;
 }
 
-unsigned reddit_decode_id(const char *idstr)
+int reddit_encode_id(uint64_t id, char idstr[REDDIT_MAX_ID])
 {
-    long id;
+    char digits[REDDIT_MAX_ID];
+    char *p = digits + sizeof(digits) - 1;
 
-    for (id = 0; *idstr; idstr++) {
-        uint8_t val = index(kidAlphabet, *idstr) - kidAlphabet;
-        id = id * 36 + val;
+    // Fill from the right, then move it into place once.
+    for (*p = '\0'; id != 0 && p > digits; id /= 36) {
+        *--p = kidAlphabet[id % 36];
     }
 
-    return id;
+    memcpy(idstr, p, digits + sizeof(digits) - p);
+    return 0;
 }
 
-int reddit_encode_id(unsigned id, char idstr[8])
+// Pack a name like "t1_abc123" into a spool key, the type number goes in the
+// top byte and the id in the rest. Returns zero if it's not a name.
+uint64_t reddit_name_key(const char *name)
 {
-    ldiv_t result = {
-        .quot = id
-    };
+    uint64_t id;
 
-    // I copied this algorithm from str_to_base() in reddit code, just
-    // translated it into c.
-    for (*idstr = 0; result.quot != 0;) {
-        result = ldiv(result.quot, 36);
+    if (name == NULL || name[0] != 't' || name[1] < '1' || name[1] > '9' || name[2] != '_')
+        return 0;
 
-        // Make room at the start of the string.
-        memmove(idstr + 1, idstr, strlen(idstr) + 1);
+    if (name[3] == '\0' || strlen(name + 3) > REDDIT_MAX_ID - 1)
+        return 0;
 
-        // Insert a new character.
-        *idstr = kidAlphabet[result.rem];
-    }
+    if ((id = reddit_decode_id(name + 3)) == 0 || id >= REDDIT_KEY_ID_LIMIT)
+        return 0;
 
-    return 0;
+    return REDDIT_KEY(name[1] - '0', id);
+}
+
+// Regenerate the name that a spool key was made from.
+char * reddit_key_name(uint64_t key, char name[REDDIT_MAX_NAME])
+{
+    char idstr[REDDIT_MAX_ID];
+
+    reddit_encode_id(key & (REDDIT_KEY_ID_LIMIT - 1), idstr);
+
+    snprintf(name, REDDIT_MAX_NAME, "t%u_%s", (unsigned)(key >> 56), idstr);
+
+    return name;
 }
@@ -13,52 +13,112 @@ enum {
     REDDIT_OBJ_MORE,
 };
 
+typedef struct spool spool_t;
+
+typedef void (*spool_watch_t)(uint64_t key, void *opaque);
+
+// Ids are base 36, this is enough for any that fit in a spool key.
+#define REDDIT_MAX_ID 12
+
+// Longest name, e.g. "t1_abc123", that reddit_key_name() can return.
+#define REDDIT_MAX_NAME (REDDIT_MAX_ID + 3)
+
+// A spool key packs the type number of a name (the 1 in t1_) and its id into
+// one integer, so objects can be indexed without string hashing.
+#define REDDIT_KEY(type, id) (((uint64_t)(type) << 56) | (id))
+#define REDDIT_KEY_ID_LIMIT (1ULL << 56)
+
 int
 reddit_object_type(json_object *obj);
 
 const char *
 reddit_object_id(json_object *obj);
 
+spool_t *
+reddit_spool_open(const char *path);
+
 int
-reddit_spool_store(json_object *spool, json_object *object);
+reddit_spool_sync(spool_t *spool);
+
+void
+reddit_spool_close(spool_t *spool);
 
 int
-reddit_spool_retrieve(json_object *spool, const char *id, json_object **object);
+reddit_spool_keep_raw(spool_t *spool, const char *path);
+
+void
+reddit_spool_watch(spool_t *spool, spool_watch_t callback, void *opaque);
+
+const char *
+reddit_spool_title(spool_t *spool, json_object *data);
+
+char *
+reddit_spool_references(spool_t *spool, json_object *object);
+
+void
+reddit_spool_lock(spool_t *spool);
+
+void
+reddit_spool_unlock(spool_t *spool);
 
 int
-reddit_spool_expunge(json_object *spool);
+reddit_spool_store(spool_t *spool, json_object *object);
 
-unsigned
+int
+reddit_spool_retrieve_key(spool_t *spool, uint64_t key, json_object **object);
+
+int
+reddit_spool_retrieve(spool_t *spool, const char *id, json_object **object);
+
+int
+reddit_spool_expunge(spool_t *spool, newsrc_t *newsrc);
+
+uint64_t
 reddit_decode_id(const char *idstr);
 
 int
-reddit_encode_id(unsigned id, char idstr[8]);
+reddit_encode_id(uint64_t id, char idstr[REDDIT_MAX_ID]);
+
+uint64_t
+reddit_name_key(const char *name);
+
+char *
+reddit_key_name(uint64_t key, char name[REDDIT_MAX_NAME]);
 
 int
-reddit_spool_merge_object(json_object *spool, json_object *object);
+reddit_spool_merge_object(spool_t *spool, json_object *object);
+
+char *
+reddit_spool_take_more(spool_t *spool, const char *linkid, unsigned max);
+
+void
+reddit_spool_more_done(spool_t *spool, const char *linkid, const char *batch, bool fetched);
 
 int
-reddit_spool_maparticles(json_object *spool, const char *subreddit, json_object *newsrc);
+reddit_spool_maparticles(spool_t *spool, const char *subreddit, newsrc_t *newsrc);
 
 int
-reddit_spool_highwatermark(json_object *groupmap);
+reddit_spool_highwatermark(group_t *group);
 
 int
-reddit_spool_lowwatermark(json_object *groupmap);
+reddit_spool_lowwatermark(group_t *group);
 
 int
-reddit_parse_comment(json_object *spool,
+reddit_parse_comment(spool_t *spool,
                      json_object *comment,
                      char **headers,
                      char **body);
 
 int
-fetch_subreddit_json(json_object *spool, json_object *newsrc, const char *url);
+fetch_subreddit_json(spool_t *spool, newsrc_t *newsrc, const char *group);
+
+int
+article_generate_references(spool_t *spool, json_object *object, char **references);
 
 int
-fetch_comments_json(json_object *spool, json_object *newsrc, const char *group, const char *id);
+article_generate_overview(spool_t *spool, json_object *object, int number, char **line);
 
 int
-article_generate_references(json_object *spool, json_object *object, char **references);
+reddit_spool_overview(spool_t *spool, group_t *group, int first, int last, char **lines, size_t *len);
 
 #endif
@@ -1,68 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <json.h>
 #include <glib.h>
 
 #include "jsonutil.h"
+#include "newsrc.h"
 #include "reddit.h"
 
-int article_generate_references(json_object *spool, json_object *object, char **references)
+int article_generate_references(spool_t *spool, json_object *object, char **references)
 {
-    json_object *data;
-
-    // Initialize result.
-    *references = g_strdup("");
-
     // A link object is simple to handle, there are no references.
     if (reddit_object_type(object) == REDDIT_OBJ_LINK) {
+        *references = g_strdup("");
         return 0;
     }
 
     if (reddit_object_type(object) != REDDIT_OBJ_COMMENT) {
         g_debug("cant generate references for this object type");
+        *references = g_strdup("");
         return -1;
     }
 
-    // Now we try to build a list of all the references this article has.
-    for (json_object *parent = object; true;) {
-        const char *parentid;
-        char *refs;
-
-        // We must be at the top of the chain.
-        if (reddit_object_type(parent) != REDDIT_OBJ_COMMENT) {
-            g_warn_if_fail(reddit_object_type(parent) == REDDIT_OBJ_LINK);
-            break;
-        }
-
-        // Fetch the contents.
-        if (!json_object_object_get_ex(parent, "data", &data)) {
-            g_warning("there was no data in a comment, unexpected");
-            return -1;
-        }
-
-        // Find out the next comment in the chain.
-        parentid = json_object_get_string_prop(data, "parent_id");
-
-        // Append that to the list.
-        refs = g_strdup_printf("<%s@reddit>%s%s",
-            parentid,
-            **references != '\0' ? " " : "",
-            *references);
-
-        // Free the old header.
-        g_free(*references);
-
-        // Use the new one.
-        *references = refs;
-
-        // Now fetch the parent.
-        if (reddit_spool_retrieve(spool, parentid, &parent) != true) {
-            g_debug("failed to complete chain, might be incomplete");
-            break;
-        }
+    // The spool keeps the chain of ancestors for every comment, so this
+    // doesn't have to look up every parent each time.
+    if ((*references = reddit_spool_references(spool, object)) == NULL) {
+        *references = g_strdup("");
+        return -1;
     }
 
     // Header complete.
@@ -70,3 +37,84 @@ int article_generate_references(json_object *spool, json_object *object, char **
 
     return 0;
 }
+
+// See comments.c
+unsigned str_count_newlines(const char *string);
+
+// Overview fields are tab separated lines, so those can't appear in them.
+static char * overview_field(const char *value)
+{
+    char *field = g_strdup(value ? value : "");
+
+    for (char *p = field; *p; p++) {
+        if (*p == '\t' || *p == '\r' || *p == '\n')
+            *p = ' ';
+    }
+
+    return field;
+}
+
+// Generate the XOVER line for an article, see RFC3977 8.3.
+int article_generate_overview(spool_t *spool, json_object *object, int number, char **line)
+{
+    json_object *data;
+    json_object *created;
+    time_t unixtime;
+    char date[128];
+    const char *body;
+    char *references;
+    char *subject;
+    char *author;
+    int byte_count;
+    unsigned line_count;
+    bool iscomment;
+
+    *line = NULL;
+
+    if (!json_object_object_get_ex(object, "data", &data))
+        return -1;
+
+    if (!json_object_object_get_ex(data, "created_utc", &created))
+        return -1;
+
+    if (!json_object_is_type(created, json_type_double))
+        return -1;
+
+    // Convert that into a UNIX time.
+    unixtime = json_object_get_int64(created);
+
+    // RFC822 Format
+    strftime(date, sizeof date, "%a, %d %b %Y %T %z", gmtime(&unixtime));
+
+    // If this is a comment we need to generate Xrefs, and prefix the subject with "Re:"
+    iscomment = reddit_object_type(object) == REDDIT_OBJ_COMMENT;
+
+    if (article_generate_references(spool, object, &references) != 0 || *references == 0) {
+        g_free(references);
+        references = g_strdup("null");
+    }
+
+    body = json_object_get_string_prop(data, "body");
+    byte_count = body ? strlen(body) : 0;
+    line_count = body ? str_count_newlines(body) : 0;
+
+    subject = overview_field(reddit_spool_title(spool, data));
+    author  = overview_field(json_object_get_string_prop(data, "author"));
+
+    *line = g_strdup_printf("%d\t%s%s\t%s\t%s\t<%s@reddit>\t%s\t%d\t%u\r\n",
+                            number,
+                            iscomment ? "Re: " : "",
+                            subject,
+                            author,
+                            date,
+                            reddit_object_id(object),
+                            references,
+                            byte_count,
+                            line_count);
+    // TODO: "\tXref: someserver somegroup:somenumber" at the end
+
+    g_free(references);
+    g_free(subject);
+    g_free(author);
+    return 0;
+}
@@ -0,0 +1,346 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <ev.h>
+#include <json.h>
+#include <glib.h>
+
+#include "newsrc.h"
+#include "reddit.h"
+#include "fetch.h"
+#include "scheduler.h"
+
+// Never refresh a group more often than this, no matter how busy it is.
+#define SCHEDULER_MIN_INTERVAL 60
+
+// A refresh that finds this many new comments means the group is busy.
+#define SCHEDULER_BUSY_CHURN 50
+
+// How many groups can be refreshing at once.
+#define SCHEDULER_MAX_ACTIVE 2
+
+typedef struct schedule {
+    scheduler_t *scheduler;
+    char        *group;
+    int          base;      // The configured interval for this group.
+    ev_tstamp    interval;  // The interval adjusted for how busy it is.
+    ev_tstamp    next;      // When the next refresh is due.
+    bool         active;
+} schedule_t;
+
+struct scheduler {
+    pthread_t        thread;
+    struct ev_loop  *loop;
+    fetcher_t       *fetcher;
+    spool_t         *spool;
+    newsrc_t        *newsrc;
+    int              interval;  // Default seconds between refreshes.
+    int              active;    // Refreshes in progress.
+    int              pages;     // How many older pages to backfill per group.
+    time_t           age;       // Don't backfill stories older than this.
+    bool             backfilling;
+    ev_tstamp        resume;    // When backfilling can resume after a failure.
+    GHashTable      *groups;    // Group name => schedule_t
+    ev_timer         tick;
+    ev_async         stop;
+};
+
+static void scheduler_schedule_free(schedule_t *schedule)
+{
+    g_free(schedule->group);
+    g_free(schedule);
+}
+
+static void scheduler_refreshed(const refreshed_t *refreshed, void *opaque)
+{
+    schedule_t *schedule = opaque;
+    scheduler_t *scheduler = schedule->scheduler;
+    const char *group = refreshed->group;
+    unsigned churn = refreshed->churn;
+    int result = refreshed->result;
+
+    schedule->active = false;
+    scheduler->active--;
+
+    if (result != 0) {
+        g_warning("background refresh of %s failed", group);
+        schedule->interval = schedule->base;
+    } else if (churn >= SCHEDULER_BUSY_CHURN) {
+        // Busy, so come back sooner.
+        schedule->interval = MAX(schedule->interval / 2, schedule->base / 4);
+    } else if (churn == 0) {
+        // Quiet, so back off a little.
+        schedule->interval = MIN(schedule->interval * 2, schedule->base * 2);
+    } else {
+        schedule->interval = schedule->base;
+    }
+
+    schedule->interval = MAX(schedule->interval, SCHEDULER_MIN_INTERVAL);
+    schedule->next     = ev_now(scheduler->loop) + schedule->interval;
+
+    g_debug("refreshed %s, %u new comments, next refresh in %.0f seconds",
+            group,
+            churn,
+            schedule->interval);
+
+    if (result == 0) {
+        reddit_spool_lock(scheduler->spool);
+
+        // Save any updates to the spool or article map.
+        newsrc_save(scheduler->newsrc, "newsrc");
+        reddit_spool_sync(scheduler->spool);
+
+        reddit_spool_unlock(scheduler->spool);
+    }
+}
+
+// A page of older stories was fetched, remember where to resume so that
+// backfilling can pick up where it left off after a restart.
+static void scheduler_backfilled(const refreshed_t *refreshed, void *opaque)
+{
+    schedule_t *schedule = opaque;
+    scheduler_t *scheduler = schedule->scheduler;
+    group_t *group;
+
+    scheduler->backfilling = false;
+
+    if (refreshed->result != 0) {
+        g_warning("backfilling %s failed, will try again later", refreshed->group);
+        scheduler->resume = ev_now(scheduler->loop) + SCHEDULER_MIN_INTERVAL;
+        return;
+    }
+
+    // We didn't see the page, so we don't know what comes after it. Keep the
+    // cursor we have and try it again once the page has had time to change.
+    if (refreshed->unchanged) {
+        g_debug("backfill page for %s was not modified", refreshed->group);
+        scheduler->resume = ev_now(scheduler->loop) + SCHEDULER_MIN_INTERVAL;
+        return;
+    }
+
+    reddit_spool_lock(scheduler->spool);
+
+    group = newsrc_lookup(scheduler->newsrc, refreshed->group);
+
+    g_free(group->after);
+
+    group->after = g_strdup(refreshed->after);
+    group->pages++;
+
+    if (group->after == NULL
+     || group->pages >= scheduler->pages
+     || (refreshed->oldest && refreshed->oldest < time(NULL) - scheduler->age)) {
+        g_debug("finished backfilling %s after %d pages", group->name, group->pages);
+        group->backfilled = true;
+    }
+
+    group->dirty = true;
+
+    newsrc_save(scheduler->newsrc, "newsrc");
+    reddit_spool_sync(scheduler->spool);
+
+    reddit_spool_unlock(scheduler->spool);
+}
+
+// Fetch the next page of older stories for one group, one page at a time so
+// that backfilling never competes with keeping groups up to date.
+static void scheduler_backfill(scheduler_t *scheduler)
+{
+    schedule_t *schedule = NULL;
+    char *after = NULL;
+
+    if (scheduler->backfilling || scheduler->pages == 0)
+        return;
+
+    if (ev_now(scheduler->loop) < scheduler->resume)
+        return;
+
+    reddit_spool_lock(scheduler->spool);
+
+    for (guint i = 0; i < scheduler->newsrc->groups->len; i++) {
+        group_t *group = g_ptr_array_index(scheduler->newsrc->groups, i);
+
+        if (group->backfilled)
+            continue;
+
+        // Wait for the front page first, so we know what's new.
+        schedule = g_hash_table_lookup(scheduler->groups, group->name);
+
+        if (schedule == NULL || schedule->active || schedule->next <= ev_now(scheduler->loop)) {
+            schedule = NULL;
+            continue;
+        }
+
+        after = g_strdup(group->after ? group->after : "");
+        break;
+    }
+
+    reddit_spool_unlock(scheduler->spool);
+
+    if (schedule == NULL)
+        return;
+
+    if (fetch_subreddit(scheduler->fetcher,
+                        scheduler->spool,
+                        scheduler->newsrc,
+                        schedule->group,
+                        after,
+                        FETCH_BACKGROUND,
+                        scheduler_backfilled,
+                        schedule) == NULL) {
+        g_warning("failed to start backfilling %s", schedule->group);
+    } else {
+        scheduler->backfilling = true;
+    }
+
+    g_free(after);
+}
+
+static gint scheduler_compare_due(gconstpointer a, gconstpointer b)
+{
+    const schedule_t *x = *(schedule_t **) a;
+    const schedule_t *y = *(schedule_t **) b;
+
+    return (x->next > y->next) - (x->next < y->next);
+}
+
+// Start refreshing any groups that are due, most overdue first.
+static void scheduler_tick(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    scheduler_t *scheduler = w->data;
+    GPtrArray *due = g_ptr_array_new();
+    ev_tstamp now = ev_now(loop);
+
+    reddit_spool_lock(scheduler->spool);
+
+    // Pick up any groups that were subscribed since the last tick.
+    for (guint i = 0; i < scheduler->newsrc->groups->len; i++) {
+        group_t *group = g_ptr_array_index(scheduler->newsrc->groups, i);
+        schedule_t *schedule = g_hash_table_lookup(scheduler->groups, group->name);
+
+        if (schedule == NULL) {
+            schedule            = g_new0(schedule_t, 1);
+            schedule->scheduler = scheduler;
+            schedule->group     = g_strdup(group->name);
+            schedule->next      = now;
+            schedule->interval  = group->interval ? group->interval : scheduler->interval;
+            g_hash_table_insert(scheduler->groups, schedule->group, schedule);
+        }
+
+        schedule->base = group->interval ? group->interval : scheduler->interval;
+
+        if (!schedule->active && schedule->next <= now) {
+            g_ptr_array_add(due, schedule);
+        }
+    }
+
+    reddit_spool_unlock(scheduler->spool);
+
+    g_ptr_array_sort(due, scheduler_compare_due);
+
+    for (guint i = 0; i < due->len && scheduler->active < SCHEDULER_MAX_ACTIVE; i++) {
+        schedule_t *schedule = g_ptr_array_index(due, i);
+
+        if (fetch_subreddit(scheduler->fetcher,
+                            scheduler->spool,
+                            scheduler->newsrc,
+                            schedule->group,
+                            NULL,
+                            FETCH_BACKGROUND,
+                            scheduler_refreshed,
+                            schedule) == NULL) {
+            g_warning("failed to start a background refresh of %s", schedule->group);
+            schedule->next = now + schedule->base;
+            continue;
+        }
+
+        schedule->active = true;
+        scheduler->active++;
+    }
+
+    g_ptr_array_free(due, true);
+
+    scheduler_backfill(scheduler);
+}
+
+static void scheduler_wakeup(struct ev_loop *loop, ev_async *w, int revents)
+{
+    ev_break(loop, EVBREAK_ALL);
+}
+
+static void * scheduler_run(void *opaque)
+{
+    scheduler_t *scheduler = opaque;
+
+    ev_timer_start(scheduler->loop, &scheduler->tick);
+    ev_async_start(scheduler->loop, &scheduler->stop);
+    ev_run(scheduler->loop, 0);
+    return NULL;
+}
+
+scheduler_t * scheduler_start(spool_t *spool,
+                              newsrc_t *newsrc,
+                              int interval,
+                              int pages,
+                              int days)
+{
+    scheduler_t *scheduler = g_new0(scheduler_t, 1);
+
+    scheduler->spool    = spool;
+    scheduler->newsrc   = newsrc;
+    scheduler->interval = MAX(interval, SCHEDULER_MIN_INTERVAL);
+    scheduler->pages    = pages;
+    scheduler->age      = days * 60 * 60 * 24;
+    scheduler->loop     = ev_loop_new(ev_supported_backends());
+    scheduler->fetcher  = fetcher_new(scheduler->loop);
+    scheduler->groups   = g_hash_table_new_full(g_str_hash,
+                                                g_str_equal,
+                                                NULL,
+                                                (GDestroyNotify) scheduler_schedule_free);
+
+    if (scheduler->fetcher == NULL) {
+        g_warning("failed to create a fetcher for the scheduler");
+        goto error;
+    }
+
+    ev_timer_init(&scheduler->tick, scheduler_tick, 0., 1.);
+    scheduler->tick.data = scheduler;
+
+    ev_async_init(&scheduler->stop, scheduler_wakeup);
+    scheduler->stop.data = scheduler;
+
+    if (pthread_create(&scheduler->thread, NULL, scheduler_run, scheduler) != 0) {
+        g_warning("failed to start the scheduler thread");
+        goto error;
+    }
+
+    return scheduler;
+
+  error:
+    fetcher_free(scheduler->fetcher);
+    ev_loop_destroy(scheduler->loop);
+    g_hash_table_destroy(scheduler->groups);
+    g_free(scheduler);
+    return NULL;
+}
+
+// Refreshes still in progress fail, and are called back before this returns.
+void scheduler_stop(scheduler_t *scheduler)
+{
+    if (scheduler == NULL)
+        return;
+
+    ev_async_send(scheduler->loop, &scheduler->stop);
+    pthread_join(scheduler->thread, NULL);
+
+    fetcher_free(scheduler->fetcher);
+    ev_loop_destroy(scheduler->loop);
+    g_hash_table_destroy(scheduler->groups);
+    g_free(scheduler);
+}
@@ -0,0 +1,20 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+// The scheduler refreshes every group in the newsrc on a thread of its own,
+// so clients can be answered from the spool without waiting for reddit.
+// Groups with a lot of new comments are refreshed more often than quiet ones.
+//
+// If pages is non-zero, it also backfills up to that many pages of older
+// stories in each group, stopping at stories more than days old. Where it got
+// to is saved in the newsrc, so it resumes after a restart.
+
+typedef struct scheduler scheduler_t;
+
+scheduler_t *
+scheduler_start(spool_t *spool, newsrc_t *newsrc, int interval, int pages, int days);
+
+void
+scheduler_stop(scheduler_t *scheduler);
+
+#endif
@@ -1,67 +1,721 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include <json.h>
 #include <glib.h>
 
 #include "json_object.h"
 #include "jsonutil.h"
+#include "newsrc.h"
 #include "reddit.h"
+#include "artlog.h"
+#include "idtable.h"
+#include "overview.h"
 
 // Articles older than this get expunged.
 #define MAX_SPOOL_AGE (60 * 60 * 24 * 14)
 
-int reddit_comment_add_title(json_object *spool, json_object *comment)
+// Parsed objects that are already in the log are dropped once there are more
+// than this many, the least recently used first.
+#define MAX_SPOOL_PARSED (64 * 1024)
+
+// The only properties of an object's data that anything reads. Everything
+// else reddit sends (awards, flair, media, previews...) is usually most of
+// the object, and is dropped before it's spooled.
+static const char *spool_fields[] = {
+    "name",
+    "parent_id",
+    "link_id",
+    "subreddit",
+    "author",
+    "title",
+    "body",
+    "selftext",
+    "url",
+    "permalink",
+    "created_utc",
+    "num_comments",
+    NULL,
+};
+
+// The ancestors of a comment, for its References header. Each comment's
+// chain points at its parent's, so a thread's chains share everything but
+// their last link, and are only worked out once.
+typedef struct refchain {
+    int              refcount;
+    uint64_t         parent;    // The key of the last reference.
+    struct refchain *up;        // The chain before that, or NULL.
+    uint64_t         missing;   // An ancestor we don't have yet, or 0.
+    unsigned         depth;     // How many references there are.
+} refchain_t;
+
+// A parsed object that's the same as its copy in the log, so it can be
+// dropped and parsed again later.
+typedef struct spool_clean {
+    GList            link;      // In spool->lru, link.data points here.
+    uint64_t         key;
+} spool_clean_t;
+
+// The properties that are the same in lots of objects, which are shared
+// rather than copied.
+static const char *spool_interned[] = {
+    "subreddit",
+    "author",
+    "link_id",
+    "parent_id",
+    NULL,
+};
+
+struct spool {
+    idtable_t   *objects;   // Objects parsed or merged, by key.
+    artlog_t    *log;       // Every object we know about.
+    idtable_t   *dirty;     // Keys of objects changed since the last sync.
+    idtable_t   *clean;     // Keys of the other objects => spool_clean_t
+    GQueue       lru;       // Every spool_clean_t, least recently used first.
+    GHashTable  *pending;   // Interned subreddit => keys that might need a number.
+    GHashTable  *strings;   // Interned string properties, see spool_interned.
+    overview_t  *overview;  // XOVER lines for every numbered article.
+    GHashTable  *more;      // Link id => comment ids not yet fetched => being fetched.
+    artlog_t    *raw;       // Objects exactly as reddit sent them, or NULL.
+    bool         failed;    // An object couldn't be written during a sync.
+    idtable_t   *chains;    // Comment key => refchain_t
+    idtable_t   *waiting;   // Missing ancestor key => keys of chains that stop there.
+    spool_watch_t watch;    // Told about objects that change, or NULL.
+    void        *watcher;
+    pthread_mutex_t lock;   // Held by anyone using the spool or the newsrc.
+};
+
+static void reddit_refchain_unref(refchain_t *chain)
+{
+    while (chain && --chain->refcount == 0) {
+        refchain_t *up = chain->up;
+        g_free(chain);
+        chain = up;
+    }
+}
+
+// Anything generated from the object key, e.g. a rendered article, is stale.
+static void reddit_spool_changed(spool_t *spool, uint64_t key)
+{
+    if (spool->watch) {
+        spool->watch(key, spool->watcher);
+    }
+}
+
+static void reddit_spool_add_pending(spool_t *spool, json_object *data, uint64_t key, const char *id);
+static void reddit_spool_prune_strings(spool_t *spool);
+static void reddit_spool_publish_group(spool_t *spool, group_t *group);
+
+// The parsed object for key is the same as the one in the log.
+static void reddit_spool_add_clean(spool_t *spool, uint64_t key)
+{
+    spool_clean_t *clean = g_new0(spool_clean_t, 1);
+
+    clean->key       = key;
+    clean->link.data = clean;
+
+    idtable_insert(spool->clean, key, clean);
+    g_queue_push_tail_link(&spool->lru, &clean->link);
+}
+
+// The parsed object for key was used, so keep it a while longer.
+static void reddit_spool_touch(spool_t *spool, uint64_t key)
+{
+    spool_clean_t *clean = idtable_lookup(spool->clean, key);
+
+    if (clean) {
+        g_queue_unlink(&spool->lru, &clean->link);
+        g_queue_push_tail_link(&spool->lru, &clean->link);
+    }
+}
+
+// The parsed object for key is dirty or gone, so it can't be dropped.
+static void reddit_spool_forget_clean(spool_t *spool, uint64_t key)
+{
+    spool_clean_t *clean = idtable_lookup(spool->clean, key);
+
+    if (clean) {
+        g_queue_unlink(&spool->lru, &clean->link);
+        idtable_remove(spool->clean, key);
+    }
+}
+
+// Drop the least recently used parsed objects, they can be read from the log
+// again. Nobody can be using them, because parsed objects are only used with
+// the lock held.
+static void reddit_spool_trim(spool_t *spool)
+{
+    if (spool->lru.length <= MAX_SPOOL_PARSED)
+        return;
+
+    // Leave some room, so this isn't done on every unlock.
+    while (spool->lru.length > MAX_SPOOL_PARSED * 3 / 4) {
+        spool_clean_t *clean = g_queue_peek_head(&spool->lru);
+        uint64_t key = clean->key;
+
+        reddit_spool_forget_clean(spool, key);
+
+        idtable_remove(spool->objects, key);
+        idtable_remove(spool->chains, key);
+    }
+
+    reddit_spool_prune_strings(spool);
+}
+
+// Forget the chains that stopped short because we didn't have key.
+static void reddit_spool_invalidate_chains(spool_t *spool, uint64_t key)
+{
+    GArray *keys = idtable_lookup(spool->waiting, key);
+
+    for (guint i = 0; keys && i < keys->len; i++) {
+        uint64_t reply = g_array_index(keys, uint64_t, i);
+        char name[REDDIT_MAX_NAME];
+        json_object *object;
+        json_object *data;
+
+        idtable_remove(spool->chains, reply);
+
+        // Their References will be different now.
+        reddit_spool_changed(spool, reply);
+
+        // Map them again, so their overview lines are rewritten.
+        if (reddit_spool_retrieve_key(spool, reply, &object)
+         && json_object_object_get_ex(object, "data", &data)) {
+            reddit_spool_add_pending(spool, data, reply, reddit_key_name(reply, name));
+        }
+    }
+
+    idtable_remove(spool->waiting, key);
+}
+
+static json_object * reddit_spool_parse(const char *text, size_t len)
+{
+    json_tokener *tokener = json_tokener_new_ex(64);
+    json_object *object;
+
+    if (tokener == NULL)
+        return NULL;
+
+    object = json_tokener_parse_ex(tokener, text, len);
+
+    json_tokener_free(tokener);
+
+    return object;
+}
+
+// Older versions kept the whole spool in one json file, bring those objects
+// into the log so nothing is lost.
+static void reddit_spool_import(spool_t *spool, const char *path)
+{
+    json_object *legacy = json_object_from_file(path);
+
+    if (legacy == NULL)
+        return;
+
+    g_message("importing legacy spool file %s, this only happens once", path);
+
+    json_object_object_foreach(legacy, id, object) {
+        uint64_t key = reddit_name_key(id);
+
+        if (key == 0) {
+            g_warning("ignoring legacy object with bad id %s", id);
+            continue;
+        }
+
+        idtable_insert(spool->objects, key, json_object_get(object));
+        idtable_insert(spool->dirty, key, NULL);
+    }
+
+    json_object_put(legacy);
+
+    reddit_spool_sync(spool);
+}
+
+// The overview lives next to the log, in path.overview.
+static overview_t * reddit_spool_open_overview(const char *path)
+{
+    char *name = g_strdup_printf("%s.overview", path);
+    overview_t *overview = overview_open(name);
+
+    g_free(name);
+    return overview;
+}
+
+spool_t * reddit_spool_open(const char *path)
+{
+    spool_t *spool = g_new0(spool_t, 1);
+
+    pthread_mutex_init(&spool->lock, NULL);
+
+    spool->objects = idtable_new((GDestroyNotify) json_object_put);
+    spool->dirty   = idtable_new(NULL);
+    spool->clean   = idtable_new(g_free);
+    spool->chains  = idtable_new((GDestroyNotify) reddit_refchain_unref);
+    spool->waiting = idtable_new((GDestroyNotify) g_array_unref);
+    spool->pending = g_hash_table_new_full(g_direct_hash,
+                                           g_direct_equal,
+                                           NULL,
+                                           (GDestroyNotify) g_array_unref);
+    spool->strings = g_hash_table_new_full(g_str_hash,
+                                           g_str_equal,
+                                           NULL,
+                                           (GDestroyNotify) json_object_put);
+    spool->more     = g_hash_table_new_full(g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) g_hash_table_destroy);
+    spool->log      = artlog_open(path);
+    spool->overview = reddit_spool_open_overview(path);
+
+    if (spool->log == NULL || spool->overview == NULL) {
+        g_warning("failed to open the spool %s", path);
+        reddit_spool_close(spool);
+        return NULL;
+    }
+
+    // Nothing is read here, objects are parsed the first time someone asks
+    // for them.
+    if (artlog_count(spool->log) == 0) {
+        reddit_spool_import(spool, path);
+    }
+
+    return spool;
+}
+
+static void reddit_spool_sync_object(uint64_t key, void *value, void *opaque)
+{
+    spool_t *spool = opaque;
+    json_object *object;
+    json_object *timestamp;
+    const char *text;
+    char id[REDDIT_MAX_NAME];
+
+    reddit_key_name(key, id);
+
+    if ((object = idtable_lookup(spool->objects, key)) == NULL) {
+        g_debug("dirty object %s is no longer in the spool", id);
+        return;
+    }
+
+    json_object_object_get_ex(object, "timestamp", &timestamp);
+
+    text = json_object_to_json_string_ext(object, JSON_C_TO_STRING_PLAIN);
+
+    if (artlog_append(spool->log, id, text, strlen(text), json_object_get_int64(timestamp)) != 0) {
+        g_warning("failed to write object %s to the spool", id);
+        spool->failed = true;
+        return;
+    }
+
+    // Now it can be parsed again if it's dropped.
+    reddit_spool_add_clean(spool, key);
+}
+
+// Append every object that changed since the last sync to the log, the cost
+// of this is proportional to how much changed, not the size of the spool.
+int reddit_spool_sync(spool_t *spool)
+{
+    int result = 0;
+
+    spool->failed = false;
+
+    idtable_foreach(spool->dirty, reddit_spool_sync_object, spool);
+    idtable_remove_all(spool->dirty);
+
+    if (spool->failed)
+        result = -1;
+
+    if (spool->raw && artlog_sync(spool->raw) != 0) {
+        g_warning("failed to sync the raw spool to disk");
+        result = -1;
+    }
+
+    if (artlog_sync(spool->log) != 0 || overview_sync(spool->overview) != 0) {
+        g_warning("failed to sync the spool to disk");
+        result = -1;
+    }
+
+    return result;
+}
+
+void reddit_spool_close(spool_t *spool)
+{
+    if (spool == NULL)
+        return;
+
+    if (spool->log && spool->overview) {
+        reddit_spool_sync(spool);
+    }
+
+    artlog_close(spool->log);
+    artlog_close(spool->raw);
+    overview_close(spool->overview);
+
+    idtable_free(spool->objects);
+    idtable_free(spool->dirty);
+    idtable_free(spool->clean);
+    idtable_free(spool->chains);
+    idtable_free(spool->waiting);
+    g_hash_table_destroy(spool->pending);
+    g_hash_table_destroy(spool->strings);
+    g_hash_table_destroy(spool->more);
+    pthread_mutex_destroy(&spool->lock);
+    g_free(spool);
+}
+
+// Also keep the data of every object as reddit sent it, less its replies, in
+// a separate log at path. This is only useful for debugging.
+int reddit_spool_keep_raw(spool_t *spool, const char *path)
+{
+    if ((spool->raw = artlog_open(path)) == NULL) {
+        g_warning("failed to open the raw spool %s", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Ask to be called with the key of any object that's re-merged, expunged, or
+// whose References change. It's called with the spool locked.
+void reddit_spool_watch(spool_t *spool, spool_watch_t callback, void *opaque)
+{
+    spool->watch   = callback;
+    spool->watcher = opaque;
+}
+
+// Even reading from the spool can change it, so every thread has to hold
+// this while it uses the spool, or the newsrc that goes with it.
+void reddit_spool_lock(spool_t *spool)
+{
+    pthread_mutex_lock(&spool->lock);
+}
+
+void reddit_spool_unlock(spool_t *spool)
 {
+    reddit_spool_trim(spool);
+    pthread_mutex_unlock(&spool->lock);
+}
+
+// Comments don't have a title of their own, they use the title of the link
+// they were posted to. The link is almost always in the spool already.
+const char * reddit_spool_title(spool_t *spool, json_object *data)
+{
+    const char *title;
+    json_object *link;
+
+    // Links have their own, and older spools copied it into every comment.
+    if ((title = json_object_get_string_prop(data, "title")))
+        return title;
+
+    if (!reddit_spool_retrieve(spool, json_object_get_string_prop(data, "link_id"), &link)) {
+        g_debug("cant find link %s, what happened?", json_object_get_string_prop(data, "link_id"));
+        return NULL;
+    }
+
+    json_object_object_get_ex(link, "data", &data);
+
+    return json_object_get_string_prop(data, "title");
+}
+
+// Return a shared copy of a string property, so that every object from the
+// same subreddit or thread holds a reference to one string instead of a copy
+// each.
+static json_object * reddit_spool_intern(spool_t *spool, json_object *value)
+{
+    json_object *interned;
+
+    if (!json_object_is_type(value, json_type_string))
+        return json_object_get(value);
+
+    if ((interned = g_hash_table_lookup(spool->strings, json_object_get_string(value))) == NULL) {
+        interned = json_object_get(value);
+        g_hash_table_insert(spool->strings, (gpointer) json_object_get_string(interned), interned);
+    }
+
+    return json_object_get(interned);
+}
+
+// Add a string that's already shared back into strings.
+static void reddit_spool_reintern(GHashTable *strings, json_object *value)
+{
+    if (value == NULL || !json_object_is_type(value, json_type_string))
+        return;
+
+    if (!g_hash_table_contains(strings, json_object_get_string(value))) {
+        g_hash_table_insert(strings, (gpointer) json_object_get_string(value), json_object_get(value));
+    }
+}
+
+static void reddit_spool_reintern_object(uint64_t key, void *value, void *opaque)
+{
+    GHashTable *strings = opaque;
+    json_object *crossposts;
+    json_object *property;
+    json_object *data;
+
+    if (!json_object_object_get_ex(value, "data", &data))
+        return;
+
+    for (int i = 0; spool_interned[i]; i++) {
+        if (json_object_object_get_ex(data, spool_interned[i], &property)) {
+            reddit_spool_reintern(strings, property);
+        }
+    }
+
+    if (json_object_object_get_ex(data, "crosspost_parent_list", &crossposts)
+     && json_object_is_type(crossposts, json_type_array)) {
+        for (size_t i = 0; i < json_object_array_length(crossposts); i++) {
+            json_object *entry = json_object_array_get_idx(crossposts, i);
+
+            if (json_object_object_get_ex(entry, "subreddit", &property)) {
+                reddit_spool_reintern(strings, property);
+            }
+        }
+    }
+}
+
+// Forget the shared strings that no object in memory uses any more. The
+// table is rebuilt from the objects rather than counting references, json-c
+// doesn't tell us when an object we share a string with is freed.
+static void reddit_spool_prune_strings(spool_t *spool)
+{
+    GHashTable *strings = g_hash_table_new_full(g_str_hash,
+                                                g_str_equal,
+                                                NULL,
+                                                (GDestroyNotify) json_object_put);
+    guint before = g_hash_table_size(spool->strings);
+
+    idtable_foreach(spool->objects, reddit_spool_reintern_object, strings);
+
+    g_hash_table_destroy(spool->strings);
+
+    spool->strings = strings;
+
+    g_debug("%u of %u shared strings still in use", g_hash_table_size(strings), before);
+}
+
+// Replace the common properties of data with shared copies.
+static void reddit_spool_share(spool_t *spool, json_object *data)
+{
+    json_object *value;
+
+    for (int i = 0; spool_interned[i]; i++) {
+        if (json_object_object_get_ex(data, spool_interned[i], &value)) {
+            json_object_object_add(data, spool_interned[i], reddit_spool_intern(spool, value));
+        }
+    }
+}
+
+// Queue key to be mapped into the group it was posted to.
+static void reddit_spool_add_pending(spool_t *spool, json_object *data, uint64_t key, const char *id)
+{
+    const char *subreddit = json_object_get_string_prop(data, "subreddit");
+    GArray *pending;
+    const char *group;
+    char *lower;
+
+    if (subreddit == NULL) {
+        g_warning("object %s has no subreddit, it can't be mapped", id);
+        return;
+    }
+
+    // Group names are matched case-insensitively.
+    lower = g_ascii_strdown(subreddit, -1);
+    group = g_intern_string(lower);
+
+    g_free(lower);
+
+    if ((pending = g_hash_table_lookup(spool->pending, group)) == NULL) {
+        pending = g_array_new(false, false, sizeof(uint64_t));
+        g_hash_table_insert(spool->pending, (gpointer) group, pending);
+    }
+
+    g_array_append_val(pending, key);
+}
+
+// A more object lists comments that reddit left out of a thread, remember
+// them so they can be fetched later.
+static int reddit_spool_add_more(spool_t *spool, json_object *object)
+{
+    const char *parentid;
     const char *linkid;
-    const char *subject;
+    json_object *children;
     json_object *parent;
-    json_object *parentdata;
-    json_object *commentdata;
+    json_object *data;
+    GHashTable *ids;
 
-    if (reddit_object_type(comment) != REDDIT_OBJ_COMMENT) {
+    if (!json_object_object_get_ex(object, "data", &data)
+     || !json_object_object_get_ex(data, "children", &children)
+     || !json_object_is_type(children, json_type_array)) {
+        g_warning("badly formed more object");
         return -1;
     }
 
-    json_object_object_get_ex(comment, "data", &commentdata);
+    // An empty list means "continue this thread", that's not handled.
+    if (json_object_array_length(children) == 0)
+        return 0;
+
+    parentid = json_object_get_string_prop(data, "parent_id");
+
+    // The more object doesn't say which link it belongs to, but its parent
+    // does.
+    if (parentid && strncmp(parentid, "t3_", 3) == 0) {
+        linkid = parentid;
+    } else if (reddit_spool_retrieve(spool, parentid, &parent)
+            && json_object_object_get_ex(parent, "data", &data)) {
+        linkid = json_object_get_string_prop(data, "link_id");
+    } else {
+        linkid = NULL;
+    }
 
-    // Already has a topic?
-    if (json_object_get_string_prop(commentdata, "title")) {
-        g_debug("comment already had a title, no need to append another.");
+    if (linkid == NULL) {
+        g_debug("cant find the link for more object under %s", parentid);
         return 0;
     }
 
-    // Reformat it to the format expected.
-    linkid = json_object_get_string_prop(commentdata, "link_id");
+    if ((ids = g_hash_table_lookup(spool->more, linkid)) == NULL) {
+        ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        g_hash_table_insert(spool->more, g_strdup(linkid), ids);
+    }
 
-    if (!reddit_spool_retrieve(spool, linkid, &parent)) {
-        g_debug("cant find parent %s, what happened?", linkid);
-        return -1;
+    for (size_t i = 0; i < json_object_array_length(children); i++) {
+        const char *child = json_object_get_string(json_object_array_get_idx(children, i));
+
+        // If it's already being fetched, leave it to that request.
+        if (child && !g_hash_table_contains(ids, child))
+            g_hash_table_insert(ids, g_strdup(child), GINT_TO_POINTER(false));
     }
 
-    // Insert it.
-    json_object_object_get_ex(parent, "data", &parentdata);
+    g_debug("%u comments in %s still to be fetched", g_hash_table_size(ids), linkid);
+    return 0;
+}
 
-    subject = json_object_get_string_prop(parentdata, "title");
+// Return up to max comma separated ids of comments in linkid that still need
+// to be fetched, or NULL if there are none. They stay pending until they're
+// passed to reddit_spool_more_done().
+char * reddit_spool_take_more(spool_t *spool, const char *linkid, unsigned max)
+{
+    GHashTable *ids = g_hash_table_lookup(spool->more, linkid);
+    GHashTableIter iter;
+    GString *batch;
+    const char *id;
+    gpointer fetching;
+    unsigned count = 0;
 
-    json_object_object_add(commentdata, "title", json_object_new_string(subject));
+    if (ids == NULL)
+        return NULL;
 
-    return 0;
+    batch = g_string_new(NULL);
+
+    g_hash_table_iter_init(&iter, ids);
+
+    while (count < max && g_hash_table_iter_next(&iter, (gpointer *) &id, &fetching)) {
+        char *name;
+
+        if (GPOINTER_TO_INT(fetching))
+            continue;
+
+        name = g_strdup_printf("t1_%s", id);
+
+        // It might have turned up some other way.
+        if (idtable_contains(spool->objects, reddit_name_key(name))
+         || artlog_contains(spool->log, name)) {
+            g_hash_table_iter_remove(&iter);
+        } else {
+            g_string_append_printf(batch, "%s%s", count ? "," : "", id);
+            g_hash_table_iter_replace(&iter, GINT_TO_POINTER(true));
+            count++;
+        }
+
+        g_free(name);
+    }
+
+    if (g_hash_table_size(ids) == 0) {
+        g_hash_table_remove(spool->more, linkid);
+    }
+
+    return g_string_free(batch, count == 0);
+}
+
+// A batch from reddit_spool_take_more() has been fetched, or the request
+// failed and the ids should be tried again later.
+void reddit_spool_more_done(spool_t *spool, const char *linkid, const char *batch, bool fetched)
+{
+    GHashTable *ids = g_hash_table_lookup(spool->more, linkid);
+    char **children = g_strsplit(batch, ",", -1);
+
+    for (int i = 0; ids && children[i]; i++) {
+        if (!g_hash_table_contains(ids, children[i]))
+            continue;
+
+        // Anything reddit didn't return must have been deleted.
+        if (fetched) {
+            g_hash_table_remove(ids, children[i]);
+        } else {
+            g_hash_table_insert(ids, g_strdup(children[i]), GINT_TO_POINTER(false));
+        }
+    }
+
+    if (ids && g_hash_table_size(ids) == 0) {
+        g_hash_table_remove(spool->more, linkid);
+    }
+
+    g_strfreev(children);
+}
+
+// Make a copy of data with only the properties in spool_fields.
+static json_object * reddit_spool_project(spool_t *spool, json_object *data)
+{
+    json_object *compact = json_object_new_object();
+    json_object *crossposts;
+    json_object *value;
+
+    for (int i = 0; spool_fields[i]; i++) {
+        if (json_object_object_get_ex(data, spool_fields[i], &value)) {
+            json_object_object_add(compact, spool_fields[i], json_object_get(value));
+        }
+    }
+
+    reddit_spool_share(spool, compact);
+
+    // Only the subreddit of each crosspost is used, for Newsgroups.
+    if (json_object_object_get_ex(data, "crosspost_parent_list", &crossposts)
+     && json_object_is_type(crossposts, json_type_array)) {
+        json_object *list = json_object_new_array();
+
+        for (size_t i = 0; i < json_object_array_length(crossposts); i++) {
+            json_object *xpost = json_object_array_get_idx(crossposts, i);
+            json_object *entry = json_object_new_object();
+
+            if (json_object_object_get_ex(xpost, "subreddit", &value)) {
+                json_object_object_add(entry, "subreddit", reddit_spool_intern(spool, value));
+            }
+
+            json_object_array_add(list, entry);
+        }
+
+        json_object_object_add(compact, "crosspost_parent_list", list);
+    }
+
+    return compact;
 }
 
 // Add the comment or link object to the spool.
-int reddit_spool_store(json_object *spool, json_object *object)
+int reddit_spool_store(spool_t *spool, json_object *object)
 {
     int type = reddit_object_type(object);
     const char *id = reddit_object_id(object);
     json_object *replies;
     json_object *data;
+    uint64_t key;
+    int result = 0;
 
     if (type == REDDIT_OBJ_MORE) {
-        g_debug("TODO: handle 'more' objects");
-        return -1;
+        return reddit_spool_add_more(spool, object);
     }
 
     g_warn_if_fail(type == REDDIT_OBJ_LINK || type == REDDIT_OBJ_COMMENT);
@@ -71,59 +725,279 @@ int reddit_spool_store(json_object *spool, json_object *object)
         return -1;
     }
 
-    // Is this object already in the spool?
-    json_object_object_add(spool, id, object);
+    if ((key = reddit_name_key(id)) == 0) {
+        g_warning("attempted to spool object with bad id %s", id);
+        return -1;
+    }
 
     if (!json_object_object_get_ex(object, "data", &data)) {
         g_warning("badly formed object, expected a data property");
         return -1;
     }
 
-    // Increment reference count.
-    json_object_get(object);
+    // We still need the original for the replies and the raw spool.
+    json_object_get(data);
+
+    json_object_object_add(object, "data", reddit_spool_project(spool, data));
+
+    // Is this object already in the spool?
+    idtable_insert(spool->objects, key, json_object_get(object));
+    reddit_spool_forget_clean(spool, key);
+
+    // If it was, it might have been edited.
+    reddit_spool_changed(spool, key);
+
+    // Any chains that stopped short because we didn't have this have to be
+    // worked out again.
+    reddit_spool_invalidate_chains(spool, key);
+
+    // Remember to write it out on the next sync.
+    idtable_insert(spool->dirty, key, NULL);
+
+    // And to give it an article number next time the group is mapped.
+    reddit_spool_add_pending(spool, data, key, id);
 
     // Add a timestamp.
     json_object_object_add(object, "timestamp", json_object_new_int64(time(0)));
 
     g_debug("added object %s to spoolfile", id);
 
-    // Add a topic if it needs one.
-    reddit_comment_add_title(spool, object);
-
     // Comments have a replies object, so we need to parse that too.
     if (json_object_object_get_ex(data, "replies", &replies)) {
         if (json_object_is_type(replies, json_type_object)) {
             g_debug("object had a replies property, attempting to parse.");
-            return reddit_spool_merge_object(spool, replies);
+            result = reddit_spool_merge_object(spool, replies);
+        } else {
+            // I think it must be an empty string then?
+            g_warn_if_fail(json_object_is_type(replies, json_type_string));
         }
 
-        // I think it must be an empty string then?
-        g_warn_if_fail(json_object_is_type(replies, json_type_string));
+        // The replies are spooled individually, so don't keep another copy
+        // of the whole subtree with the parent.
+        json_object_object_del(data, "replies");
     }
 
-    return 0;
+    if (spool->raw) {
+        const char *text = json_object_to_json_string_ext(data, JSON_C_TO_STRING_PLAIN);
+
+        if (artlog_append(spool->raw, id, text, strlen(text), time(0)) != 0) {
+            g_warning("failed to write object %s to the raw spool", id);
+        }
+    }
+
+    json_object_put(data);
+    return result;
+}
+
+int reddit_spool_retrieve(spool_t *spool, const char *id, json_object **object)
+{
+    if (id == NULL)
+        return false;
+
+    return reddit_spool_retrieve_key(spool, reddit_name_key(id), object);
 }
 
-int reddit_spool_retrieve(json_object *spool, const char *id, json_object **object)
+int reddit_spool_retrieve_key(spool_t *spool, uint64_t key, json_object **object)
 {
-    return json_object_object_get_ex(spool, id, object);
+    json_object *data;
+    size_t len;
+    char *text;
+    char id[REDDIT_MAX_NAME];
+
+    if (key == 0)
+        return false;
+
+    if ((*object = idtable_lookup(spool->objects, key))) {
+        reddit_spool_touch(spool, key);
+        return true;
+    }
+
+    // The log is still indexed by name.
+    if (artlog_read(spool->log, reddit_key_name(key, id), &text, &len) != 0)
+        return false;
+
+    *object = reddit_spool_parse(text, len);
+
+    g_free(text);
+
+    if (*object == NULL) {
+        g_warning("spooled object %s was corrupt", id);
+        return false;
+    }
+
+    if (json_object_object_get_ex(*object, "data", &data)) {
+        reddit_spool_share(spool, data);
+    }
+
+    // Keep it parsed, it's likely to be needed again soon.
+    idtable_insert(spool->objects, key, *object);
+    reddit_spool_add_clean(spool, key);
+    return true;
 }
 
-int reddit_spool_expunge(json_object *spool)
+// Work out the chain of ancestors of a comment, or return the cached one.
+static refchain_t * reddit_spool_chain(spool_t *spool, uint64_t key, json_object *object)
 {
-    json_object_object_foreach(spool, id, article) {
-        json_object *timestamp;
-        json_object_object_get_ex(article, "timestamp", &timestamp);
-        if (json_object_get_int64(timestamp) - time(0) > MAX_SPOOL_AGE) {
-            json_object_object_del(article, id);
+    refchain_t *chain;
+    json_object *data;
+    json_object *parent;
+
+    if ((chain = idtable_lookup(spool->chains, key)))
+        return chain;
+
+    if (!json_object_object_get_ex(object, "data", &data)) {
+        g_warning("there was no data in a comment, unexpected");
+        return NULL;
+    }
+
+    chain           = g_new0(refchain_t, 1);
+    chain->refcount = 1;
+    chain->parent   = reddit_name_key(json_object_get_string_prop(data, "parent_id"));
+    chain->depth    = 1;
+
+    if (chain->parent == 0) {
+        g_warning("comment has no valid parent, unexpected");
+        g_free(chain);
+        return NULL;
+    }
+
+    // If the parent is the link, that's the top of the chain. We don't need
+    // to have it for that.
+    if (chain->parent >> 56 == 3) {
+        idtable_insert(spool->chains, key, chain);
+        return chain;
+    }
+
+    if (reddit_spool_retrieve_key(spool, chain->parent, &parent)
+     && reddit_object_type(parent) == REDDIT_OBJ_COMMENT) {
+        chain->up = reddit_spool_chain(spool, chain->parent, parent);
+    }
+
+    if (chain->up) {
+        chain->up->refcount++;
+        chain->depth   = chain->up->depth + 1;
+        chain->missing = chain->up->missing;
+    } else {
+        g_debug("failed to complete chain, might be incomplete");
+        chain->missing = chain->parent;
+    }
+
+    // Remember to throw this away if the missing ancestor turns up.
+    if (chain->missing) {
+        GArray *keys = idtable_lookup(spool->waiting, chain->missing);
+
+        if (keys == NULL) {
+            keys = g_array_new(false, false, sizeof(uint64_t));
+            idtable_insert(spool->waiting, chain->missing, keys);
         }
+
+        g_array_append_val(keys, key);
+    }
+
+    idtable_insert(spool->chains, key, chain);
+    return chain;
+}
+
+// Generate the References header for a comment from its chain, oldest
+// first.
+char * reddit_spool_references(spool_t *spool, json_object *object)
+{
+    const char *id = reddit_object_id(object);
+    refchain_t *chain;
+    uint64_t *keys;
+    GString *refs;
+    unsigned depth;
+
+    if ((chain = reddit_spool_chain(spool, reddit_name_key(id), object)) == NULL)
+        return NULL;
+
+    depth = chain->depth;
+    keys  = g_new(uint64_t, depth);
+    refs  = g_string_sized_new(depth * (REDDIT_MAX_NAME + 10));
+
+    for (unsigned i = depth; chain; chain = chain->up) {
+        keys[--i] = chain->parent;
+    }
+
+    for (unsigned i = 0; i < depth; i++) {
+        char name[REDDIT_MAX_NAME];
+
+        g_string_append_printf(refs, "%s<%s@reddit>", i ? " " : "", reddit_key_name(keys[i], name));
+    }
+
+    g_free(keys);
+    return g_string_free(refs, false);
+}
+
+typedef struct spool_expunge {
+    spool_t     *spool;
+    GArray      *keys;      // Keys of the objects expunged.
+} spool_expunge_t;
+
+static void reddit_spool_expunge_object(const char *id, time_t timestamp, void *opaque)
+{
+    spool_expunge_t *expunge = opaque;
+    spool_t *spool = expunge->spool;
+    uint64_t key = reddit_name_key(id);
+
+    if (time(0) - timestamp > MAX_SPOOL_AGE) {
+        g_debug("expunging %s from the spool", id);
+        artlog_remove(spool->log, id);
+        idtable_remove(spool->dirty, key);
+        idtable_remove(spool->objects, key);
+        reddit_spool_forget_clean(spool, key);
+        idtable_remove(spool->chains, key);
+        reddit_spool_changed(spool, key);
+        g_array_append_val(expunge->keys, key);
+    }
+}
+
+int reddit_spool_expunge(spool_t *spool, newsrc_t *newsrc)
+{
+    size_t parsed = idtable_size(spool->objects);
+    spool_expunge_t expunge = {
+        .spool = spool,
+        .keys  = g_array_new(false, false, sizeof(uint64_t)),
+    };
+
+    // The index records when each object was spooled, so there is no need
+    // to parse anything here.
+    artlog_foreach(spool->log, reddit_spool_expunge_object, &expunge);
+
+    // Their article numbers go too, so clients aren't offered articles that
+    // can't be retrieved. A crosspost can be in more than one group.
+    for (guint i = 0; expunge.keys->len && i < newsrc->groups->len; i++) {
+        group_t *group = g_ptr_array_index(newsrc->groups, i);
+        bool removed = false;
+
+        for (guint k = 0; k < expunge.keys->len; k++) {
+            int number = newsrc_unassign(group, g_array_index(expunge.keys, uint64_t, k));
+
+            if (number != 0) {
+                overview_remove(spool->overview, group->name, number);
+                removed = true;
+            }
+        }
+
+        if (removed) {
+            reddit_spool_publish_group(spool, group);
+            newsrc_publish(group);
+        }
+    }
+
+    g_array_free(expunge.keys, true);
+
+    // Only objects in memory hold shared strings, so unless some of those
+    // went, every string is still in use.
+    if (idtable_size(spool->objects) < parsed) {
+        reddit_spool_prune_strings(spool);
     }
-    // TODO: also expunge old mappings in newsrc
+
     return 0;
 }
 
 // Add all of the reddit objects (e.g. comments) in object to spool.
-int reddit_spool_merge_object(json_object *spool, json_object *object)
+int reddit_spool_merge_object(spool_t *spool, json_object *object)
 {
     // Comment objects are sometimes served as an array, so handle that here.
     if (json_object_is_type(object, json_type_array)) {
@@ -176,86 +1050,154 @@ int reddit_spool_merge_object(json_object *spool, json_object *object)
     return reddit_spool_store(spool, object);
 }
 
-int reddit_spool_highwatermark(json_object *groupmap)
+// The high-watermark is the highest article number we've assigned.
+int reddit_spool_highwatermark(group_t *group)
 {
-    int watermark = 0;
-
-    json_object_object_foreach(groupmap, id, number) {
-        if (json_object_get_int(number) > watermark)
-            watermark = json_object_get_int(number);
-    }
+    if (group->articles->len == 0)
+        return 0;
 
-    return watermark;
+    return group->low + group->articles->len - 1;
 }
 
 // The low-watermark is the lowest article-id we have, sent to the
 // client after GROUP.
-int reddit_spool_lowwatermark(json_object *groupmap)
+int reddit_spool_lowwatermark(group_t *group)
 {
-    int watermark = 0;
-
-    // Set the initial watermark to the first entry, if possible.
-    if (json_object_get_object(groupmap)->head) {
-        struct lh_entry *e = json_object_get_object(groupmap)->head;
-        watermark = json_object_get_int(e->v);
-    }
-
-    json_object_object_foreach(groupmap, id, number) {
-        if (json_object_get_int(number) < watermark)
-            watermark = json_object_get_int(number);
-    }
+    if (group->articles->len == 0)
+        return 0;
 
-    return watermark;
+    return group->low;
 }
 
 
-int reddit_spool_maparticles(json_object *spool, const char *subreddit, json_object *newsrc)
+// Generate overview lines for any articles in group that don't have one yet,
+// this is normally just the ones that were numbered since the last call.
+static void reddit_spool_update_overview(spool_t *spool, group_t *group)
 {
-    json_object *groupmap;
-    int watermark;
+    int high = reddit_spool_highwatermark(group);
+    int number = overview_last(spool->overview, group->name) + 1;
 
-    if (!json_object_object_get_ex(newsrc, subreddit, &groupmap)) {
-        g_debug("group %s was not in the article map, I'm adding it", subreddit);
+    for (number = MAX(number, reddit_spool_lowwatermark(group)); number <= high; number++) {
+        uint64_t key = newsrc_article(group, number);
+        json_object *object;
+        char *line = NULL;
 
-        groupmap = json_object_new_object();
-        json_object_object_add(newsrc, subreddit, groupmap);
+        if (key && reddit_spool_retrieve_key(spool, key, &object)) {
+            if (article_generate_overview(spool, object, number, &line) != 0) {
+                g_debug("failed to generate overview for article %d", number);
+            }
+        }
+
+        overview_append(spool->overview, group->name, number, line, line ? strlen(line) : 0);
+
+        g_free(line);
     }
+}
 
-    // Learn the high watermark (this is a nntp concept)
-    watermark = reddit_spool_highwatermark(groupmap);
+static gint reddit_spool_compare_numbers(gconstpointer a, gconstpointer b)
+{
+    return *(const int *) a - *(const int *) b;
+}
 
-    g_debug("the current high watermark for %s is %d", subreddit, watermark);
+// Generate the overview lines again for articles that already had one, e.g.
+// because they were edited or a missing parent turned up.
+static void reddit_spool_rewrite_overview(spool_t *spool, group_t *group, GArray *stale)
+{
+    g_array_sort(stale, reddit_spool_compare_numbers);
 
-    // Now check for any articles in this group.
-    json_object_object_foreach(spool, key, article) {
-        int type = reddit_object_type(article);
-        json_object *data;
+    for (guint i = 0; i < stale->len; i++) {
+        int number = g_array_index(stale, int, i);
+        uint64_t key = newsrc_article(group, number);
+        json_object *object;
+        char *line = NULL;
 
-        if (!json_object_object_get_ex(article, "data", &data)) {
-            g_warning("failed to find the data element of a spool entry, corrupted?");
+        if (i > 0 && number == g_array_index(stale, int, i - 1))
             continue;
-        }
 
-        if (type == REDDIT_OBJ_MORE) {
-            g_debug("TODO: handle more objects");
+        if (key == 0 || !reddit_spool_retrieve_key(spool, key, &object))
             continue;
+
+        // If it can't be generated now, the old line is better than nothing.
+        if (article_generate_overview(spool, object, number, &line) == 0 && line) {
+            overview_replace(spool->overview, group->name, number, line, strlen(line));
         }
 
-        g_warn_if_fail(type == REDDIT_OBJ_LINK || type == REDDIT_OBJ_COMMENT);
+        g_free(line);
+    }
+}
 
-        // Check if this belongs to this group.
-        if (json_object_check_strprop(data, "subreddit", subreddit, false)) {
-            // We found one, check if he's in the groupmap.
-            if (!json_object_object_get_ex(groupmap, key, NULL)) {
-                // He's not in there, add it.
-                json_object_object_add(groupmap, key, json_object_new_int(++watermark));
-            }
+// Make sure group has a complete overview, e.g. in case it was deleted, and
+// let readers see it.
+static void reddit_spool_publish_group(spool_t *spool, group_t *group)
+{
+    reddit_spool_update_overview(spool, group);
+
+    overview_publish(spool->overview, group->name);
+}
+
+// Fetch the ready-made overview lines for a range of articles.
+// This doesn't need the spool lock, readers see the overview as it was when
+// the group was last published. A group that hasn't changed since we started
+// isn't published until the first time it's read, so that startup doesn't
+// have to read every overview.
+int reddit_spool_overview(spool_t *spool, group_t *group, int first, int last, char **lines, size_t *len)
+{
+    if (overview_read(spool->overview, group->name, first, last, lines, len) == 0)
+        return 0;
+
+    reddit_spool_lock(spool);
+    reddit_spool_publish_group(spool, group);
+    reddit_spool_unlock(spool);
+
+    return overview_read(spool->overview, group->name, first, last, lines, len);
+}
+
+// Give every object spooled since the last call an article number in the
+// group, so the cost only depends on how much was fetched.
+int reddit_spool_maparticles(spool_t *spool, const char *subreddit, newsrc_t *newsrc)
+{
+    group_t *group = newsrc_subscribe(newsrc, subreddit);
+    int last = overview_last(spool->overview, group->name);
+    GArray *stale = g_array_new(false, false, sizeof(int));
+    GArray *pending;
+    const char *key;
+    char *lower;
+
+    g_debug("the current high watermark for %s is %d",
+            subreddit,
+            reddit_spool_highwatermark(group));
+
+    lower   = g_ascii_strdown(subreddit, -1);
+    key     = g_intern_string(lower);
+    pending = g_hash_table_lookup(spool->pending, key);
+
+    // Ids are queued in the order they were spooled, so parents are numbered
+    // before their replies. Anything already in the group keeps its number,
+    // but it was queued again because its overview might have changed.
+    for (guint i = 0; pending && i < pending->len; i++) {
+        int number = newsrc_assign(group, g_array_index(pending, uint64_t, i));
+
+        if (number <= last) {
+            g_array_append_val(stale, number);
         }
     }
 
-    g_debug("finished searching, high watermark for %s is now %d",
+    g_hash_table_remove(spool->pending, key);
+    g_free(lower);
+
+    reddit_spool_update_overview(spool, group);
+    reddit_spool_rewrite_overview(spool, group, stale);
+
+    g_array_free(stale, true);
+
+    // Clients can only see the new articles once they're published, and
+    // their overview has to be there first.
+    overview_publish(spool->overview, group->name);
+    newsrc_publish(group);
+
+    g_debug("finished mapping, high watermark for %s is now %d",
             subreddit,
-            reddit_spool_highwatermark(groupmap));
+            reddit_spool_highwatermark(group));
 
     return 0;
 }
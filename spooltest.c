@@ -0,0 +1,155 @@
+// This file is part of nntpit, https://github.com/taviso/nntpit.
+//
+// Check that overview lines are generated again when a comment changes, or
+// when its parent turns up after it, and removed when it's expunged. Run
+// with `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <json.h>
+#include <glib.h>
+
+#include "newsrc.h"
+#include "reddit.h"
+
+#define TEST_GROUP "test"
+
+static int failures;
+
+static void check(bool passed, const char *what, const char *line)
+{
+    if (!passed) {
+        fprintf(stderr, "FAIL: %s, the line was %s", what, line);
+        failures++;
+    }
+}
+
+static void store_comment(spool_t *spool, const char *id, const char *parent, const char *body)
+{
+    char *text = g_strdup_printf("{\"kind\": \"t1\", \"data\": {"
+                                 "\"name\": \"t1_%s\","
+                                 "\"parent_id\": \"%s\","
+                                 "\"link_id\": \"t3_link\","
+                                 "\"subreddit\": \"" TEST_GROUP "\","
+                                 "\"author\": \"someone\","
+                                 "\"body\": \"%s\","
+                                 "\"created_utc\": 1600000000.0}}",
+                                 id,
+                                 parent,
+                                 body);
+    json_object *object = json_tokener_parse(text);
+
+    reddit_spool_merge_object(spool, object);
+
+    json_object_put(object);
+    g_free(text);
+}
+
+static char * overview_line(spool_t *spool, newsrc_t *newsrc, int number)
+{
+    char *lines;
+    size_t len;
+
+    if (reddit_spool_overview(spool, newsrc_lookup(newsrc, TEST_GROUP), number, number, &lines, &len) != 0)
+        return g_strdup("missing\n");
+
+    return lines;
+}
+
+int main(int argc, char **argv)
+{
+    char *dir = g_dir_make_tmp("spooltest-XXXXXX", NULL);
+    json_object *object;
+    newsrc_t *newsrc;
+    spool_t *spool;
+    char *line;
+
+    // Everything is opened in the current directory.
+    if (dir == NULL || chdir(dir) != 0) {
+        fprintf(stderr, "%s: couldn't make a temporary directory\n", argv[0]);
+        return 1;
+    }
+
+    newsrc = newsrc_open("newsrc");
+    spool  = reddit_spool_open("spool");
+
+    // A reply arrives before the comment it replies to, so its References
+    // stop at the parent.
+    store_comment(spool, "reply", "t1_parent", "first");
+    reddit_spool_maparticles(spool, TEST_GROUP, newsrc);
+
+    line = overview_line(spool, newsrc, 1);
+    check(strstr(line, "\t<t1_parent@reddit>\t") != NULL, "reply references only its parent", line);
+    g_free(line);
+
+    // Now the parent turns up, and the whole thread is known.
+    store_comment(spool, "parent", "t3_link", "text");
+    reddit_spool_maparticles(spool, TEST_GROUP, newsrc);
+
+    line = overview_line(spool, newsrc, 1);
+    check(strstr(line, "\t<t3_link@reddit> <t1_parent@reddit>\t") != NULL, "reply references the whole thread", line);
+    g_free(line);
+
+    // Editing it changes the byte count.
+    store_comment(spool, "reply", "t1_parent", "edited, and longer");
+    reddit_spool_maparticles(spool, TEST_GROUP, newsrc);
+
+    line = overview_line(spool, newsrc, 1);
+    check(strstr(line, "\t18\t1\r\n") != NULL, "reply has the edited byte count", line);
+    g_free(line);
+
+    // An old comment is expunged, and its number goes with it.
+    store_comment(spool, "old", "t1_parent", "stale");
+    reddit_spool_maparticles(spool, TEST_GROUP, newsrc);
+
+    if (reddit_spool_retrieve(spool, "t1_old", &object)) {
+        json_object_object_add(object, "timestamp", json_object_new_int64(1));
+    }
+
+    reddit_spool_sync(spool);
+    reddit_spool_expunge(spool, newsrc);
+
+    line = overview_line(spool, newsrc, 3);
+    check(strcmp(line, "") == 0, "expunged comment has no overview", line);
+    g_free(line);
+
+    check(newsrc_article(newsrc_lookup(newsrc, TEST_GROUP), 3) == 0, "expunged comment has no number", "-\n");
+
+    // The replaced lines have to be the ones found after a restart, when the
+    // group is only published once it's read.
+    reddit_spool_sync(spool);
+    reddit_spool_close(spool);
+
+    spool = reddit_spool_open("spool");
+
+    line = overview_line(spool, newsrc, 1);
+    check(strstr(line, "\t<t3_link@reddit> <t1_parent@reddit>\t18\t1\r\n") != NULL, "reply is the same after a restart", line);
+    g_free(line);
+
+    line = overview_line(spool, newsrc, 2);
+    check(strncmp(line, "2\tRe: ", 6) == 0, "parent is article 2", line);
+    g_free(line);
+
+    line = overview_line(spool, newsrc, 3);
+    check(strcmp(line, "") == 0, "expunged comment is still gone after a restart", line);
+    g_free(line);
+
+    reddit_spool_close(spool);
+    newsrc_close(newsrc);
+
+    if (chdir("/") == 0) {
+        char *command = g_strdup_printf("rm -rf '%s'", dir);
+
+        if (system(command) != 0)
+            fprintf(stderr, "%s: failed to remove %s\n", argv[0], dir);
+
+        g_free(command);
+    }
+
+    g_free(dir);
+    return failures != 0;
+}